@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "memory.h"
+#include "bootparams.h"
+#include "topology.h"
+#include "numa.h"
+#include "acpi.h"
+
+/*
+ * Just enough ACPI to describe guest numa: RSDP, XSDT, a hardware
+ * reduced FADT with an empty DSDT, SRAT and SLIT. There is no MADT, so
+ * the guest still takes cpus and interrupt routing from the MP table.
+ * All tables sit in the bios area at ACPI_START, which the guest never
+ * uses as ram.
+ */
+#define ACPI_OEM_ID		"MICROV"
+#define ACPI_OEM_TABLE_ID	"MICROVM "
+#define ACPI_CREATOR_ID		"MCRV"
+
+//fadt flags and iapc_boot_arch, see ACPI 6.4 5.2.9
+#define ACPI_FADT_HW_REDUCED	(1 << 20)
+#define ACPI_FADT_NO_VGA	(1 << 2)
+#define ACPI_FADT_NO_CMOS_RTC	(1 << 5)
+
+#define ACPI_SRAT_CPU_AFFINITY	0
+#define ACPI_SRAT_MEM_AFFINITY	1
+#define ACPI_SRAT_ENABLED	1
+#define ACPI_SRAT_HOTPLUGGABLE	2
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    char creator_id[4];
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_fadt {
+    struct acpi_header header;
+    uint32_t firmware_ctrl;
+    uint32_t dsdt;
+    uint8_t reserved0[65];
+    uint16_t iapc_boot_arch;
+    uint8_t reserved1;
+    uint32_t flags;
+    uint8_t reset_reg[12];
+    uint8_t reset_value;
+    uint16_t arm_boot_arch;
+    uint8_t minor_revision;
+    uint64_t x_firmware_ctrl;
+    uint64_t x_dsdt;
+    uint8_t reserved2[120];
+    uint64_t hypervisor_id;
+} __attribute__((packed));
+
+struct acpi_srat {
+    struct acpi_header header;
+    uint32_t reserved0;
+    uint64_t reserved1;
+} __attribute__((packed));
+
+struct acpi_srat_cpu {
+    uint8_t type;
+    uint8_t length;
+    uint8_t proximity_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_mem {
+    uint8_t type;
+    uint8_t length;
+    uint32_t proximity;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+struct acpi_slit {
+    struct acpi_header header;
+    uint64_t localities;
+    uint8_t entries[];
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct acpi_fadt) == 276, "FADT revision 6 layout");
+
+static uint8_t acpi_checksum(void *data, int len)
+{
+    uint8_t sum = 0;
+
+    for (int i = 0; i < len; i++)
+        sum += ((uint8_t *)data)[i];
+    return -sum;
+}
+
+static void acpi_init_header(struct acpi_header *h, const char *sig,
+                             uint32_t len, uint8_t revision)
+{
+    memcpy(h->signature, sig, 4);
+    h->length = len;
+    h->revision = revision;
+    memcpy(h->oem_id, ACPI_OEM_ID, 6);
+    memcpy(h->oem_table_id, ACPI_OEM_TABLE_ID, 8);
+    h->oem_revision = 1;
+    memcpy(h->creator_id, ACPI_CREATOR_ID, 4);
+    h->creator_revision = 1;
+}
+
+//table at the next 16 byte boundary, zeroed, returns its gpa
+static uint64_t acpi_alloc(uint64_t *next, uint32_t len, void **table)
+{
+    uint64_t gpa = (*next + 15) & ~15ULL;
+
+    *next = gpa + len;
+    if (*next > MB_BIOS_START) {
+        fprintf(stderr, "acpi tables overflow the bios area\n");
+        exit(1);
+    }
+    *table = get_userspace_ptr(gpa, len);
+    memset(*table, 0, len);
+    return gpa;
+}
+
+static void acpi_seal(struct acpi_header *h)
+{
+    h->checksum = acpi_checksum(h, h->length);
+}
+
+void setup_acpi(int vcpu_count)
+{
+    struct boot_params *boot_params = get_userspace_ptr(ZERO_PAGE_START, sizeof(*boot_params));
+    uint64_t next = ACPI_START;
+    uint64_t rsdp_gpa, xsdt_gpa, fadt_gpa, dsdt_gpa, srat_gpa, slit_gpa;
+    struct acpi_rsdp *rsdp;
+    struct acpi_header *xsdt, *dsdt;
+    struct acpi_fadt *fadt;
+    struct acpi_srat *srat;
+    struct acpi_slit *slit;
+    uint64_t *xsdt_entries;
+    uint8_t *p;
+    int nr_mem = 0, n = nr_numa_nodes;
+    uint32_t len;
+    uint64_t gpa, size, hotplug_gpa;
+    int node;
+
+    rsdp_gpa = acpi_alloc(&next, sizeof(*rsdp), (void **)&rsdp);
+
+    //empty aml, hardware reduced acpi needs no methods
+    dsdt_gpa = acpi_alloc(&next, sizeof(*dsdt), (void **)&dsdt);
+    acpi_init_header(dsdt, "DSDT", sizeof(*dsdt), 2);
+    acpi_seal(dsdt);
+
+    fadt_gpa = acpi_alloc(&next, sizeof(*fadt), (void **)&fadt);
+    acpi_init_header(&fadt->header, "FACP", sizeof(*fadt), 6);
+    fadt->flags = ACPI_FADT_HW_REDUCED;
+    fadt->iapc_boot_arch = ACPI_FADT_NO_VGA | ACPI_FADT_NO_CMOS_RTC;
+    fadt->minor_revision = 4;
+    fadt->x_dsdt = dsdt_gpa;
+    memcpy(&fadt->hypervisor_id, "MICROV  ", 8);
+    acpi_seal(&fadt->header);
+
+    while (get_ram_slot(nr_mem, &gpa, &size, &node) == 0)
+        nr_mem++;
+    len = sizeof(*srat) + vcpu_count * sizeof(struct acpi_srat_cpu) +
+          nr_mem * sizeof(struct acpi_srat_mem);
+    srat_gpa = acpi_alloc(&next, len, (void **)&srat);
+    acpi_init_header(&srat->header, "SRAT", len, 3);
+    srat->reserved0 = 1;
+    p = (uint8_t *)(srat + 1);
+    for (int i = 0; i < vcpu_count; i++) {
+        struct acpi_srat_cpu *cpu = (struct acpi_srat_cpu *)p;
+
+        cpu->type = ACPI_SRAT_CPU_AFFINITY;
+        cpu->length = sizeof(*cpu);
+        cpu->proximity_lo = numa_cpu_node(i);
+        cpu->apic_id = topology_apic_id(i);
+        cpu->flags = ACPI_SRAT_ENABLED;
+        p += sizeof(*cpu);
+    }
+    if (get_hotplug_ram(&hotplug_gpa, &size, &node) < 0)
+        hotplug_gpa = 0;
+    for (int i = 0; i < nr_mem; i++) {
+        struct acpi_srat_mem *mem = (struct acpi_srat_mem *)p;
+
+        get_ram_slot(i, &gpa, &size, &node);
+        mem->type = ACPI_SRAT_MEM_AFFINITY;
+        mem->length = sizeof(*mem);
+        mem->proximity = node;
+        mem->base = gpa;
+        mem->size = size;
+        mem->flags = ACPI_SRAT_ENABLED;
+        if (hotplug_gpa && gpa == hotplug_gpa)
+            mem->flags |= ACPI_SRAT_HOTPLUGGABLE;
+        p += sizeof(*mem);
+    }
+    acpi_seal(&srat->header);
+
+    len = sizeof(*slit) + n * n;
+    slit_gpa = acpi_alloc(&next, len, (void **)&slit);
+    acpi_init_header(&slit->header, "SLIT", len, 1);
+    slit->localities = n;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++)
+            slit->entries[i * n + j] = numa_distance(i, j);
+    }
+    acpi_seal(&slit->header);
+
+    len = sizeof(*xsdt) + 3 * sizeof(uint64_t);
+    xsdt_gpa = acpi_alloc(&next, len, (void **)&xsdt);
+    acpi_init_header(xsdt, "XSDT", len, 1);
+    xsdt_entries = (uint64_t *)(xsdt + 1);
+    xsdt_entries[0] = fadt_gpa;
+    xsdt_entries[1] = srat_gpa;
+    xsdt_entries[2] = slit_gpa;
+    acpi_seal(xsdt);
+
+    memcpy(rsdp->signature, "RSD PTR ", 8);
+    memcpy(rsdp->oem_id, ACPI_OEM_ID, 6);
+    rsdp->revision = 2;
+    rsdp->length = sizeof(*rsdp);
+    rsdp->xsdt_address = xsdt_gpa;
+    rsdp->checksum = acpi_checksum(rsdp, 20);
+    rsdp->ext_checksum = acpi_checksum(rsdp, sizeof(*rsdp));
+
+    //kernels before 5.0 still find it by scanning 0xe0000-0xfffff
+    boot_params->acpi_rsdp_addr = rsdp_gpa;
+}
@@ -0,0 +1,6 @@
+#ifndef MICROV_ACPI_H
+#define MICROV_ACPI_H
+
+void setup_acpi(int vcpu_count);
+
+#endif /* MICROV_ACPI_H */
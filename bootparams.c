@@ -14,19 +14,40 @@ uint64_t InitrdSize;
 uint64_t InitrdAddr;
 static const char CMDLINE[] = "console=ttyS0 pci=conf1 panic=1 reboot=k root=/dev/ram rdinit=/bin/sh";
 
-static int file_len(FILE *fp)
+static uint64_t KernelEnd;
+
+static long file_len(FILE *fp)
 {
-    int num;
+    long num;
     fseek(fp,0,SEEK_END);
     num=ftell(fp);
     fseek(fp,0,SEEK_SET);
     return num;
 }
 
-static void load_initrd(const char *initrd_path)
+//read len bytes of fp into guest ram at gpa, the range may span slots
+static int load_file(FILE *fp, uint64_t gpa, uint64_t len)
+{
+    struct iovec iov[8];
+    int n = gpa_to_iovec(gpa, len, iov, 8);
+
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        if (fread(iov[i].iov_base, 1, iov[i].iov_len, fp) != iov[i].iov_len)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * The initrd goes at the top of low ram, below INITRD_ADDR_MAX: the
+ * kernel is loaded raw, there is no setup header saying it could take
+ * one higher. Large guests still have all of it in the first 1G.
+ */
+static int load_initrd(const char *initrd_path)
 {
     FILE *fp;
-    int len;
     if((fp = fopen(initrd_path, "r")) == NULL)
     {
         printf("open file %s error.\n",initrd_path);
@@ -35,72 +56,100 @@ static void load_initrd(const char *initrd_path)
     
     InitrdSize = file_len(fp); 
     uint64_t initrd_addr_max = INITRD_ADDR_MAX;
-    if(initrd_addr_max  > get_ram_end()) {
-        initrd_addr_max = get_ram_end();
+    uint64_t low_ram_end = get_ram_end() < get_gap_start() ? get_ram_end() : get_gap_start();
+    if(initrd_addr_max  > low_ram_end) {
+        initrd_addr_max = low_ram_end;
+    }
+    if (InitrdSize > initrd_addr_max - KernelEnd ||
+        ((initrd_addr_max - InitrdSize) & ~(uint64_t)0xfff) < KernelEnd) {
+        fprintf(stderr, "initrd of %lu bytes does not fit between the kernel and 0x%lx\n",
+                InitrdSize, initrd_addr_max);
+        fclose(fp);
+        return -1;
     }
     InitrdAddr = (initrd_addr_max - InitrdSize) & ~(uint64_t)0xfff;
     
-    fread((uint8_t *)get_userspace_addr(InitrdAddr), InitrdSize, 1, fp);
+    if (load_file(fp, InitrdAddr, InitrdSize) < 0) {
+        fprintf(stderr, "read initrd %s failed\n", initrd_path);
+        fclose(fp);
+        return -1;
+    }
     fprintf(stderr, "load initrd at 0x%lx size: 0x%lx\n", InitrdAddr, InitrdSize);
     fclose(fp);
+    return 0;
 }
 
-static void load_kernel(const char *vmlinux_path)
+static int load_kernel(const char *vmlinux_path)
 {
     FILE *fp;
-    int len;
+    long len;
     if((fp = fopen(vmlinux_path, "r")) == NULL)
     {
         printf("open file %s error.\n",vmlinux_path);
         exit(0);
     }
     len = file_len(fp);
-    fread((uint8_t *)get_userspace_addr(VMLINUX_START), len, 1, fp);
+    if (load_file(fp, VMLINUX_START, len) < 0) {
+        fprintf(stderr, "read kernel %s failed\n", vmlinux_path);
+        fclose(fp);
+        return -1;
+    }
+    KernelEnd = VMLINUX_START + len;
     fprintf(stderr, "load kernel at 0x%lx size: 0x%lx\n", VMLINUX_START, len);
     fclose(fp);
+    return 0;
 }
 
+/*
+ * Low memory below VMLINUX_RAM_START is fixed, the rest is one entry per
+ * run of contiguous ram slots. The virtio-mem region is left out, the
+ * guest only learns about it from the device.
+ */
 static void setup_e820(struct boot_params *boot_params)
 {
-    boot_params->e820_entries = 0;
+    struct boot_e820_entry *e820 = boot_params->e820_table;
+    uint64_t gpa, size, hotplug_gpa, hotplug_size;
+    int node, n;
 
-    boot_params->e820_table[0] = (struct boot_e820_entry)
+    e820[0] = (struct boot_e820_entry)
                 { .addr = REAL_MODE_IVT_START,
                   .size = MPTABLE_START - REAL_MODE_IVT_START,
                   .type = E820_RAM
                 };
-    boot_params->e820_table[1] = (struct boot_e820_entry)
+    e820[1] = (struct boot_e820_entry)
                 { .addr = MPTABLE_START,
                   .size = VGA_RAM_START - MPTABLE_START,
                   .type = E820_RESERVED
                 };
-    boot_params->e820_table[2] = (struct boot_e820_entry)
+    e820[2] = (struct boot_e820_entry)
                 { .addr = MB_BIOS_START,
                   .size = 0,
                   .type = E820_RESERVED
                 };
-
-    if(get_ram_end() <= get_gap_end()) {
-        boot_params->e820_table[3] = (struct boot_e820_entry)
-                { .addr = VMLINUX_RAM_START,
-                  .size = get_ram_end() - VMLINUX_RAM_START,
-                  .type = E820_RAM
-                };
-        boot_params->e820_entries = 4;
-    } else {
-        boot_params->e820_table[3] = (struct boot_e820_entry) 
-                { .addr = VMLINUX_RAM_START,
-                  .size = get_gap_start() - VMLINUX_RAM_START,
+    n = 3;
+
+    if (get_hotplug_ram(&hotplug_gpa, &hotplug_size, &node) < 0)
+        hotplug_gpa = 0;
+    for (int i = 0; get_ram_slot(i, &gpa, &size, &node) == 0; i++) {
+        if ((hotplug_gpa && gpa == hotplug_gpa) || gpa + size <= VMLINUX_RAM_START)
+            continue;
+        if (gpa < VMLINUX_RAM_START) {
+            size -= VMLINUX_RAM_START - gpa;
+            gpa = VMLINUX_RAM_START;
+        }
+        if (n > 3 && e820[n - 1].addr + e820[n - 1].size == gpa) {
+            e820[n - 1].size += size;
+            continue;
+        }
+        if (n == E820_MAX_ENTRIES_ZEROPAGE)
+            break;
+        e820[n++] = (struct boot_e820_entry)
+                { .addr = gpa,
+                  .size = size,
                   .type = E820_RAM
                 };
-        boot_params->e820_table[4] = (struct boot_e820_entry) 
-                { .addr = get_gap_end(),
-                  .size = get_ram_end() - get_gap_end(),
-                  .type = E820_RAM
-                };
-        boot_params->e820_entries = 5;
-
     }
+    boot_params->e820_entries = n;
 }
 
 static void setup_header_ramdisk(struct boot_params *boot_params)
@@ -120,14 +169,15 @@ void setup_cmdline()
     write_userspace_memory((void *)CMDLINE, CMDLINE_START, sizeof(CMDLINE) - 1);
 }
 
-void setup_boot_params(const char *vmlinux_path, const char *initrd_path)
+int setup_boot_params(const char *vmlinux_path, const char *initrd_path)
 {
     struct boot_params *boot_params = (struct boot_params *)get_userspace_addr(ZERO_PAGE_START);
     memset(boot_params, 0, sizeof(struct boot_params));
-    load_kernel(vmlinux_path);
-    load_initrd(initrd_path);
+    if (load_kernel(vmlinux_path) < 0 || load_initrd(initrd_path) < 0)
+        return -1;
     setup_e820(boot_params);
     setup_header_ramdisk(boot_params);
+    return 0;
 }
 
 void _test_boot_params()
@@ -96,7 +96,7 @@ struct boot_params {
 } __attribute__((packed));;
 
 void setup_cmdline();
-void setup_boot_params(const char *vmlinux_path, const char *initrd_path);
+int setup_boot_params(const char *vmlinux_path, const char *initrd_path);
 void _test_boot_params();
 
 #endif  /* MICROV_BOOTPARAM_H */
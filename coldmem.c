@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "thread.h"
+#include "uffd.h"
+#include "lz.h"
+#include "coldmem.h"
+
+/*
+ * Cold page tier. kvm dirty logging ages every guest page, one age step
+ * per scan without a write. Pages that reach COLD_AGE are compressed
+ * into a pool inside the process and dropped, the next access faults
+ * through userfaultfd and gets the page back.
+ *
+ * A page is write protected while it is compressed, so a write from a
+ * vcpu or a device thread in that window cancels the eviction instead
+ * of being lost.
+ */
+#define COLD_PAGE_SIZE	0x1000
+#define COLD_AGE	8
+#define COLD_BATCH	16384				//pages evicted per scan at most
+#define COLD_MAX_LEN	(COLD_PAGE_SIZE * 3 / 4)	//worse ratios stay resident
+#define COLD_SECS_DEFAULT	300
+
+enum ColdState {
+    ColdResident = 0,
+    ColdCompressing,
+    ColdCompressed,
+};
+
+struct cold_page {
+    uint16_t len;
+    uint8_t data[];
+};
+
+struct cold_slot {
+    uint64_t gpa;
+    uint64_t pages;
+    uint8_t *host;
+    uint8_t *age;
+    uint8_t *state;
+    struct cold_page **pool;
+    uint64_t *dirty;
+    unsigned char *incore;
+};
+
+struct cold_stats {
+    uint64_t compressed;    //pages in the pool, zero pages included
+    uint64_t zero;
+    uint64_t pool_bytes;
+    uint64_t evicted;
+    uint64_t faults;
+    uint64_t aborted;
+    uint64_t incompressible;
+    uint64_t scans;
+};
+
+int cold_tier_secs;
+
+//every all-zero page points here, it costs no pool memory
+static struct cold_page cold_zero;
+
+static struct cold_slot *cold_slots;
+static int nr_cold_slots;
+static struct uffd cold_uffd;
+static bool cold_registered;
+static pthread_mutex_t cold_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cold_stats cold_stats;
+
+//"" or seconds
+int parse_cold_tier(const char *arg)
+{
+    cold_tier_secs = arg ? atoi(arg) : COLD_SECS_DEFAULT;
+    if (cold_tier_secs <= 0) {
+        fprintf(stderr, "invalid cold tier age %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+static struct cold_slot *cold_find(uint64_t addr, uint64_t *idx)
+{
+    for (int i = 0; i < nr_cold_slots; i++) {
+        struct cold_slot *cs = &cold_slots[i];
+        uint64_t host = (uint64_t)cs->host;
+
+        if (addr >= host && addr < host + cs->pages * COLD_PAGE_SIZE) {
+            *idx = (addr - host) / COLD_PAGE_SIZE;
+            return cs;
+        }
+    }
+    return NULL;
+}
+
+static void cold_pool_free(struct cold_page *page)
+{
+    cold_stats.compressed--;
+    if (page == &cold_zero) {
+        cold_stats.zero--;
+        return;
+    }
+    cold_stats.pool_bytes -= page->len;
+    free(page);
+}
+
+//fill a missing page, a write fault gets a private page right away
+static void cold_fill(uint64_t addr, const void *src, uint64_t flags)
+{
+    static uint8_t zero[COLD_PAGE_SIZE];
+    int ret;
+
+    if (!src && !(flags & UFFD_PAGEFAULT_FLAG_WRITE))
+        ret = uffd_zeropage(&cold_uffd, addr, COLD_PAGE_SIZE);
+    else
+        ret = uffd_copy(&cold_uffd, addr, src ? src : zero, COLD_PAGE_SIZE);
+    if (ret < 0)
+        fprintf(stderr, "cold tier can not fill page at %p\n", (void *)addr);
+}
+
+static void cold_fault(void *opaque, uint64_t addr, uint64_t flags)
+{
+    static uint8_t buf[COLD_PAGE_SIZE];
+    struct cold_slot *cs;
+    struct cold_page *page;
+    uint64_t idx;
+
+    pthread_mutex_lock(&cold_lock);
+    cs = cold_find(addr, &idx);
+    if (cs && cs->state[idx] == ColdCompressed) {
+        page = cs->pool[idx];
+        if (page == &cold_zero) {
+            cold_fill(addr, NULL, flags);
+        } else if (lz_decompress(page->data, page->len, buf, COLD_PAGE_SIZE) == COLD_PAGE_SIZE) {
+            cold_fill(addr, buf, flags);
+        } else {
+            //the pool is process memory, this is a bug, not guest input
+            fprintf(stderr, "cold tier page at %p is corrupt\n", (void *)addr);
+            abort();
+        }
+        cold_pool_free(page);
+        cs->pool[idx] = NULL;
+        cs->state[idx] = ColdResident;
+        cs->age[idx] = 0;
+        cold_stats.faults++;
+    } else {
+        if (cs && cs->state[idx] == ColdCompressing) {
+            cs->state[idx] = ColdResident;
+            cs->age[idx] = 0;
+            cold_stats.aborted++;
+        }
+        if (flags & UFFD_PAGEFAULT_FLAG_WP)
+            uffd_writeprotect(&cold_uffd, addr, COLD_PAGE_SIZE, false);
+        else
+            cold_fill(addr, NULL, flags);
+    }
+    pthread_mutex_unlock(&cold_lock);
+}
+
+//NULL if the page does not compress well enough to be worth it
+static struct cold_page *cold_compress(const uint8_t *src)
+{
+    static uint8_t buf[COLD_MAX_LEN];
+    struct cold_page *page;
+    int len;
+
+    for (len = 0; len < COLD_PAGE_SIZE && !src[len]; len++)
+        ;
+    if (len == COLD_PAGE_SIZE)
+        return &cold_zero;
+
+    len = lz_compress(src, COLD_PAGE_SIZE, buf, sizeof(buf));
+    if (len < 0)
+        return NULL;
+    page = malloc(sizeof(*page) + len);
+    if (!page)
+        return NULL;
+    page->len = len;
+    memcpy(page->data, buf, len);
+    return page;
+}
+
+static void cold_evict(struct cold_slot *cs, uint64_t idx)
+{
+    uint8_t *host = cs->host + idx * COLD_PAGE_SIZE;
+    struct cold_page *page;
+
+    pthread_mutex_lock(&cold_lock);
+    cs->state[idx] = ColdCompressing;
+    pthread_mutex_unlock(&cold_lock);
+
+    if (uffd_writeprotect(&cold_uffd, (uint64_t)host, COLD_PAGE_SIZE, true) < 0) {
+        pthread_mutex_lock(&cold_lock);
+        cs->state[idx] = ColdResident;
+        pthread_mutex_unlock(&cold_lock);
+        return;
+    }
+    page = cold_compress(host);
+
+    pthread_mutex_lock(&cold_lock);
+    if (cs->state[idx] != ColdCompressing) {
+        //written meanwhile, the fault handler already let the writer go
+        if (page && page != &cold_zero)
+            free(page);
+    } else if (!page) {
+        cs->state[idx] = ColdResident;
+        cs->age[idx] = 0;
+        cold_stats.incompressible++;
+        uffd_writeprotect(&cold_uffd, (uint64_t)host, COLD_PAGE_SIZE, false);
+    } else {
+        madvise(host, COLD_PAGE_SIZE, MADV_DONTNEED);
+        cs->pool[idx] = page;
+        cs->state[idx] = ColdCompressed;
+        cold_stats.compressed++;
+        cold_stats.evicted++;
+        if (page == &cold_zero)
+            cold_stats.zero++;
+        else
+            cold_stats.pool_bytes += page->len;
+    }
+    pthread_mutex_unlock(&cold_lock);
+}
+
+static void cold_scan_slot(int slot, uint64_t *budget)
+{
+    struct cold_slot *cs = &cold_slots[slot];
+
+    if (get_ram_dirty_log(slot, cs->dirty) < 0 ||
+        mincore(cs->host, cs->pages * COLD_PAGE_SIZE, cs->incore) < 0)
+        return;
+
+    for (uint64_t i = 0; i < cs->pages; i++) {
+        if (cs->dirty[i / 64] & (1ULL << (i % 64))) {
+            cs->age[i] = 0;
+            continue;
+        }
+        if (cs->age[i] < COLD_AGE) {
+            cs->age[i]++;
+            continue;
+        }
+        if (*budget && cs->state[i] == ColdResident && (cs->incore[i] & 1)) {
+            cold_evict(cs, i);
+            (*budget)--;
+        }
+    }
+}
+
+//registration makes first touches fault to us too, so wait until boot is long done
+static int cold_register()
+{
+    uint64_t mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+
+    for (int i = 0; i < nr_cold_slots; i++) {
+        if (uffd_register(&cold_uffd, cold_slots[i].host,
+                          cold_slots[i].pages * COLD_PAGE_SIZE, mode) < 0)
+            return -1;
+    }
+    cold_registered = true;
+    return 0;
+}
+
+static void *cold_thread_fn(void *arg)
+{
+    int period = cold_tier_secs / COLD_AGE;
+
+    if (period < 1)
+        period = 1;
+    for (;;) {
+        uint64_t budget = COLD_BATCH;
+
+        sleep(period);
+        if (!cold_registered && cold_stats.scans >= COLD_AGE && cold_register() < 0) {
+            fprintf(stderr, "cold tier disabled\n");
+            return NULL;
+        }
+        for (int i = 0; i < nr_cold_slots; i++) {
+            if (!cold_registered) {
+                //age only, nothing is evicted before registration
+                uint64_t none = 0;
+                cold_scan_slot(i, &none);
+            } else {
+                cold_scan_slot(i, &budget);
+            }
+        }
+        cold_stats.scans++;
+    }
+    return NULL;
+}
+
+int coldmem_init()
+{
+    uint64_t gpa, size;
+    pthread_t thread;
+    int node;
+
+    if (!cold_tier_secs)
+        return 0;
+    if (mem_opts.backend != MemBackendAnon && mem_opts.backend != MemBackendThp) {
+        fprintf(stderr, "the cold tier needs the anon or thp memory backend\n");
+        return -1;
+    }
+    if (mem_opts.lock) {
+        fprintf(stderr, "the cold tier can not evict --mlock memory\n");
+        return -1;
+    }
+
+    while (get_ram_slot(nr_cold_slots, &gpa, &size, &node) == 0)
+        nr_cold_slots++;
+    cold_slots = calloc(nr_cold_slots, sizeof(*cold_slots));
+    if (!cold_slots) {
+        fprintf(stderr, "cold tier tables allocation failed\n");
+        return -1;
+    }
+    for (int i = 0; i < nr_cold_slots; i++) {
+        struct cold_slot *cs = &cold_slots[i];
+
+        get_ram_slot(i, &gpa, &size, &node);
+        cs->gpa = gpa;
+        cs->pages = size / COLD_PAGE_SIZE;
+        cs->host = get_userspace_ptr(gpa, size);
+        cs->age = calloc(cs->pages, 1);
+        cs->state = calloc(cs->pages, 1);
+        cs->pool = calloc(cs->pages, sizeof(*cs->pool));
+        cs->dirty = calloc((cs->pages + 63) / 64, sizeof(uint64_t));
+        cs->incore = calloc(cs->pages, 1);
+        if (!cs->age || !cs->state || !cs->pool || !cs->dirty || !cs->incore) {
+            fprintf(stderr, "cold tier tables allocation failed\n");
+            return -1;
+        }
+    }
+
+    if (set_ram_dirty_log(true) < 0)
+        return -1;
+    if (uffd_open(&cold_uffd, UFFD_FEATURE_PAGEFAULT_FLAG_WP, cold_fault, NULL) < 0)
+        return -1;
+    if (thread_create(&thread, ThreadIo, 0, cold_thread_fn, NULL) != 0) {
+        fprintf(stderr, "can not create cold tier thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+//a page dropped from the mapping whose data only the pool holds
+bool coldmem_holds(void *host)
+{
+    struct cold_slot *cs;
+    uint64_t idx;
+    bool held;
+
+    if (!cold_tier_secs)
+        return false;
+    pthread_mutex_lock(&cold_lock);
+    cs = cold_find((uint64_t)host, &idx);
+    held = cs && cs->state[idx] == ColdCompressed && cs->pool[idx] != &cold_zero;
+    pthread_mutex_unlock(&cold_lock);
+    return held;
+}
+
+/*
+ * The guest gave [host, host + len) back (balloon, free page reporting,
+ * virtio-mem unplug). Compressed copies go with it, the next touch must
+ * read zeros; a page being compressed is cancelled like on a write.
+ * Runs before the mapping is dropped, so nothing can fault back the old
+ * data in between.
+ */
+void coldmem_discard(void *host, uint64_t len)
+{
+    uint64_t addr = (uint64_t)host & ~(uint64_t)(COLD_PAGE_SIZE - 1);
+    uint64_t end = (uint64_t)host + len;
+
+    if (!cold_tier_secs)
+        return;
+    pthread_mutex_lock(&cold_lock);
+    for (; addr < end; addr += COLD_PAGE_SIZE) {
+        struct cold_slot *cs;
+        uint64_t idx;
+
+        cs = cold_find(addr, &idx);
+        if (!cs)
+            continue;
+        if (cs->state[idx] == ColdCompressed) {
+            cold_pool_free(cs->pool[idx]);
+            cs->pool[idx] = NULL;
+        }
+        cs->state[idx] = ColdResident;
+        cs->age[idx] = 0;
+    }
+    pthread_mutex_unlock(&cold_lock);
+}
+
+void coldmem_dump(FILE *out)
+{
+    struct cold_stats s;
+
+    if (!cold_tier_secs)
+        return;
+    pthread_mutex_lock(&cold_lock);
+    s = cold_stats;
+    pthread_mutex_unlock(&cold_lock);
+
+    fprintf(out, "cold pages:         %llu (%llu zero)\n",
+            (unsigned long long)s.compressed, (unsigned long long)s.zero);
+    fprintf(out, "cold pool:          %llu KiB for %llu KiB of pages\n",
+            (unsigned long long)s.pool_bytes >> 10,
+            (unsigned long long)s.compressed * COLD_PAGE_SIZE >> 10);
+    fprintf(out, "cold evicted:       %llu\n", (unsigned long long)s.evicted);
+    fprintf(out, "cold faults:        %llu\n", (unsigned long long)s.faults);
+    fprintf(out, "cold aborted:       %llu\n", (unsigned long long)s.aborted);
+    fprintf(out, "cold incompressible: %llu\n", (unsigned long long)s.incompressible);
+    fprintf(out, "cold scans:         %llu\n", (unsigned long long)s.scans);
+}
@@ -0,0 +1,17 @@
+#ifndef MICROV_COLDMEM_H
+#define MICROV_COLDMEM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+//seconds a page must go unwritten before it is compressed, 0 disables the tier
+extern int cold_tier_secs;
+
+int parse_cold_tier(const char *arg);
+int coldmem_init();
+bool coldmem_holds(void *host);
+void coldmem_discard(void *host, uint64_t len);
+void coldmem_dump(FILE *out);
+
+#endif /* MICROV_COLDMEM_H */
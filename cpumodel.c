@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <string.h>
+#include <linux/kvm.h>
+
+#include "vcpu.h"
+#include "cpumodel.h"
+
+#define X86_FEATURE_X2APIC		21
+#define X86_FEATURE_TSC_DEADLINE_TIMER	24
+#define X86_FEATURE_INVARIANT_TSC	8
+
+//xsave components 0 and 1 (x87, sse) live in the 512 byte legacy area
+#define XSAVE_LEGACY_SIZE	576
+
+struct cpuid_mask {
+    uint32_t function;
+    uint32_t index;
+    uint32_t eax, ebx, ecx, edx;
+};
+
+#define ALL 0xffffffff
+
+/*
+ * Leaves not listed here are left as kvm reports them: cache and
+ * topology leaves are rewritten in setup_cpuid, brand and address size
+ * leaves do not change what the guest runs.
+ */
+static const struct cpuid_mask baseline_masks[] = {
+    {1,          0, ALL,        ALL, 0xfffa3203, 0x0789fbfd},
+    {6,          0, 0x00000004, 0,   0,          0},
+    {7,          0, ALL,        0x009c07ab, 0,   0},
+    {7,          1, 0,          0,   0,          0},
+    {0xd,        0, 0x00000007, ALL, ALL,        0},
+    {0xd,        1, 0x00000001, 0,   0,          0},
+    {0x80000001, 0, ALL,        ALL, 0x00000121, 0x2c100800},
+    {0x80000007, 0, 0,          0,   0,          1 << X86_FEATURE_INVARIANT_TSC},
+    {0x80000008, 0, ALL,        0,   ALL,        0},
+};
+
+static const struct cpuid_mask minimal_masks[] = {
+    {1,          0, ALL,        ALL, 0x8db82201, 0x0789fbfd},
+    {6,          0, 0x00000004, 0,   0,          0},
+    {7,          0, ALL,        0,   0,          0},
+    {7,          1, 0,          0,   0,          0},
+    {0xd,        0, 0x00000003, ALL, ALL,        0},
+    {0xd,        1, 0,          0,   0,          0},
+    {0x80000001, 0, ALL,        ALL, 0x00000001, 0x24100800},
+    {0x80000007, 0, 0,          0,   0,          1 << X86_FEATURE_INVARIANT_TSC},
+    {0x80000008, 0, ALL,        0,   ALL,        0},
+};
+
+//speculation control bits, a guest without them runs unmitigated
+static const struct cpuid_mask passthrough_masks[] = {
+    {7,          0, 0,          0,   0,          0xbc000400},
+    {0x80000008, 0, 0,          0x0300d000, 0,   0},
+};
+
+struct cpu_model {
+    const char *name;
+    const struct cpuid_mask *masks;
+    int nmasks;
+};
+
+#define MASKS(m) m, sizeof(m) / sizeof(m[0])
+
+static const struct cpu_model cpu_models[CpuModelEnd] = {
+    [CpuModelHost]     = {"host", NULL, 0},
+    [CpuModelBaseline] = {"baseline", MASKS(baseline_masks)},
+    [CpuModelMinimal]  = {"minimal", MASKS(minimal_masks)},
+};
+
+int parse_cpu_model(const char *name)
+{
+    for (int i = 0; i < CpuModelEnd; i++) {
+        if (!strcmp(name, cpu_models[i].name)) {
+            cpu_opts.model = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "unknown cpu model %s\n", name);
+    return -1;
+}
+
+const char *cpu_model_name(enum CpuModel model)
+{
+    return cpu_models[model].name;
+}
+
+static const struct cpuid_mask *find_mask(const struct cpuid_mask *masks, int n,
+                                          uint32_t function, uint32_t index)
+{
+    for (int i = 0; i < n; i++) {
+        if (masks[i].function == function && masks[i].index == index)
+            return &masks[i];
+    }
+    return NULL;
+}
+
+static void apply_mask(struct kvm_cpuid_entry2 *entry,
+                       const struct cpuid_mask *mask,
+                       const struct cpuid_mask *pass,
+                       bool report)
+{
+    uint32_t *regs[4] = {&entry->eax, &entry->ebx, &entry->ecx, &entry->edx};
+    uint32_t want[4] = {mask->eax, mask->ebx, mask->ecx, mask->edx};
+    uint32_t extra[4] = {0, 0, 0, 0};
+    static const char reg_names[4][4] = {"eax", "ebx", "ecx", "edx"};
+
+    if (pass) {
+        extra[0] = pass->eax;
+        extra[1] = pass->ebx;
+        extra[2] = pass->ecx;
+        extra[3] = pass->edx;
+    }
+
+    for (int r = 0; r < 4; r++) {
+
+        //a missing feature bit makes the model differ from host to host
+        if (report && want[r] != ALL && (*regs[r] & want[r]) != want[r]) {
+            fprintf(stderr, "cpu model lacks leaf 0x%x.%u %s bits 0x%08x on this host\n",
+                    entry->function, entry->index, reg_names[r],
+                    want[r] & ~*regs[r]);
+        }
+        *regs[r] &= want[r] | extra[r];
+    }
+}
+
+//drop the state components the model does not offer and resize the area
+static void fixup_xsave(struct kvm_cpuid2 *cpuid, uint32_t max)
+{
+    struct kvm_cpuid_entry2 *leaf0, *entry;
+    uint32_t size = XSAVE_LEGACY_SIZE;
+
+    leaf0 = cpuid_entry(cpuid, max, 0xd, 0, false);
+    if (!leaf0)
+        return;
+
+    for (int i = 0; i < cpuid->nent; i++) {
+        entry = &cpuid->entries[i];
+        if (entry->function != 0xd || entry->index < 2)
+            continue;
+        if (entry->index >= 32 || !(leaf0->eax & (1u << entry->index))) {
+            entry->eax = entry->ebx = entry->ecx = entry->edx = 0;
+            continue;
+        }
+        if (entry->ebx + entry->eax > size)
+            size = entry->ebx + entry->eax;
+    }
+    leaf0->ecx = size;
+}
+
+void cpu_model_apply(struct kvm_cpuid2 *cpuid, uint32_t max, bool report)
+{
+    const struct cpu_model *model = &cpu_models[cpu_opts.model];
+    struct kvm_cpuid_entry2 *entry;
+
+    for (int i = 0; i < cpuid->nent; i++) {
+        const struct cpuid_mask *mask, *pass;
+
+        entry = &cpuid->entries[i];
+        mask = find_mask(model->masks, model->nmasks, entry->function, entry->index);
+        if (!mask)
+            continue;
+        pass = find_mask(passthrough_masks,
+                         sizeof(passthrough_masks) / sizeof(passthrough_masks[0]),
+                         entry->function, entry->index);
+        apply_mask(entry, mask, pass, report);
+    }
+    if (model->masks) {
+        fixup_xsave(cpuid, max);
+    }
+
+    //every model gets the in-kernel x2apic and the deadline timer
+    entry = cpuid_entry(cpuid, max, 1, 0, false);
+    if (entry) {
+        entry->ecx |= 1 << X86_FEATURE_X2APIC;
+        entry->ecx |= 1 << X86_FEATURE_TSC_DEADLINE_TIMER;
+    }
+}
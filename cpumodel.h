@@ -0,0 +1,18 @@
+#ifndef MICROV_CPUMODEL_H
+#define MICROV_CPUMODEL_H
+
+#include <stdbool.h>
+#include <linux/kvm.h>
+
+enum CpuModel {
+    CpuModelHost,       //everything kvm supports on this host
+    CpuModelBaseline,   //fixed haswell class set, stable across hosts
+    CpuModelMinimal,    //what a 64-bit kernel needs to boot
+    CpuModelEnd,
+};
+
+int parse_cpu_model(const char *name);
+const char *cpu_model_name(enum CpuModel model);
+void cpu_model_apply(struct kvm_cpuid2 *cpuid, uint32_t max, bool report);
+
+#endif /* MICROV_CPUMODEL_H */
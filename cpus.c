@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/kvm.h>
+
+#include "global.h"
+#include "iobus.h"
+#include "vcpu.h"
+#include "cpus.h"
+#include "topology.h"
+#include "profile.h"
+#include "thread.h"
+#include "exitstat.h"
+#include "snapshot.h"
+
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stderr, fmt, ## __VA_ARGS__); } while (0)
+
+//kicks a vcpu thread out of KVM_RUN, see cpus_kick()
+#define SIG_VCPU_KICK SIGUSR2
+
+static int kvm_fd;
+static int vm_fd;
+static int nr_vcpus;
+static struct VCPUState *vcpus;
+static sem_t vcpu_exit_sem;
+
+/*
+ * Pause protocol: the controller raises pause_requested and kicks every
+ * vcpu, each vcpu parks on pause_cond once KVM_RUN returns EINTR and the
+ * controller waits on parked_cond until all running vcpus are parked.
+ * While parked a vcpu is outside KVM_RUN, so its state can be read or
+ * written from any thread.
+ */
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t parked_cond = PTHREAD_COND_INITIALIZER;
+static bool pause_requested;
+static bool stop_requested;
+static int nr_running;
+static int nr_parked;
+
+static int init_vcpu(struct VCPUState *vcpu, int cpu_index)
+{
+    long mmap_size;
+
+    vcpu->cpu_index = cpu_index;
+    //kvm takes the vcpu id as the initial apic id
+    vcpu->vcpu_fd = ioctl(vm_fd, KVM_CREATE_VCPU, topology_apic_id(cpu_index));
+    if (vcpu->vcpu_fd < 0) {
+        fprintf(stderr, "kvm_create_vcpu %d failed\n", cpu_index);
+        return -1;
+    }
+    mmap_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (mmap_size < 0) {
+        fprintf(stderr, "KVM_GET_VCPU_MMAP_SIZE failed\n");
+        return -1;
+    }
+    vcpu->kvm_run = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        vcpu->vcpu_fd, 0);
+    if (vcpu->kvm_run == MAP_FAILED) {
+        fprintf(stderr, "mmap'ing vcpu state failed\n");
+        return -1;
+    }
+    if (exit_stats_enabled) {
+        vcpu->exit_stats = exit_stats_alloc();
+    }
+    return 0;
+}
+
+static int destroy_vcpu(struct VCPUState *vcpu)
+{
+    int ret = 0;
+    long mmap_size;
+
+    mmap_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (mmap_size < 0) {
+        fprintf(stderr, "KVM_GET_VCPU_MMAP_SIZE failed\n");
+    }
+    ret = munmap(vcpu->kvm_run, mmap_size);
+    if (ret < 0) {
+        fprintf(stderr, "munmap vcpu state failed\n");
+    }
+    return ret;
+}
+
+static void vcpu_kick_handler(int sig)
+{
+}
+
+//returns true if the vcpu must leave its run loop
+static bool vcpu_park(struct VCPUState *vcpu)
+{
+    bool stop;
+
+    vcpu->kvm_run->immediate_exit = 0;
+    if (__atomic_exchange_n(&vcpu->sample_pending, false, __ATOMIC_ACQ_REL))
+        profile_sample(vcpu);
+
+    pthread_mutex_lock(&pause_lock);
+    if (pause_requested && !stop_requested) {
+        nr_parked++;
+        pthread_cond_broadcast(&parked_cond);
+        while (pause_requested && !stop_requested)
+            pthread_cond_wait(&pause_cond, &pause_lock);
+        nr_parked--;
+    }
+    stop = stop_requested;
+    pthread_mutex_unlock(&pause_lock);
+    return stop;
+}
+
+static int vcpu_exec(struct VCPUState *vcpu)
+{
+    struct kvm_run *run = vcpu->kvm_run;
+    struct ExitStats *stats = vcpu->exit_stats;
+    uint64_t exit_ns = 0;
+    int ret = 0, run_ret;
+    do{
+        run_ret = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
+        if (run_ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+            if (vcpu_park(vcpu))
+                break;
+            continue;
+        }
+        if (run_ret < 0) {
+            fprintf(stderr, "error: vcpu %d kvm run failed %s\n",
+                    vcpu->cpu_index, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (stats) {
+            exit_ns = now_ns();
+        }
+        iobus_coalesced_flush();
+        switch (run->exit_reason) {
+        case KVM_EXIT_HLT:
+	    DPRINTF("hlt\n");
+            ret = 1;
+            break;
+        case KVM_EXIT_INTR:
+            ret = vcpu_park(vcpu) ? -1 : 0;
+            break;
+        case KVM_EXIT_IO:
+            iobus_handle_pio(run);
+            ret = 0;
+            break;
+        case KVM_EXIT_MMIO:
+            iobus_handle_mmio(run);
+            ret = 0;
+            break;
+        case KVM_EXIT_IRQ_WINDOW_OPEN:
+            DPRINTF("irq_window_open\n");
+            ret = -1;
+            break;
+        case KVM_EXIT_SHUTDOWN:
+            DPRINTF("shutdown\n");
+            ret = -1;
+            break;
+        case KVM_EXIT_UNKNOWN:
+            fprintf(stderr, "KVM: unknown exit, hardware reason  %" PRIx64 "\n",
+                    (uint64_t)run->hw.hardware_exit_reason);
+            ret = -1;
+            break;
+        case KVM_EXIT_INTERNAL_ERROR:
+            DPRINTF("internal_error\n");
+            break;
+        case KVM_EXIT_SYSTEM_EVENT:
+            DPRINTF("system_event\n");
+            break;
+        default:
+            DPRINTF("kvm_arch_handle_exit:%d\n",run->exit_reason);
+            break;
+        }
+        if (stats) {
+            exit_stats_record(stats, run, now_ns() - exit_ns);
+        }
+    }while (ret == 0);
+    return ret > 0 ? 0 : ret;
+}
+
+static void *vcpu_thread_fn(void *arg)
+{
+    struct VCPUState *cpu = arg;
+    vcpu_exec(cpu);
+
+    pthread_mutex_lock(&pause_lock);
+    cpu->running = false;
+    nr_running--;
+    pthread_cond_broadcast(&parked_cond);
+    pthread_mutex_unlock(&pause_lock);
+
+    sem_post(&vcpu_exit_sem);
+    return NULL;
+}
+
+/*
+ * Must run before the first vcpu is created. Exits the host cannot
+ * disable are dropped from cpu_opts so cpuid only advertises what the
+ * guest really gets.
+ */
+static int cpus_disable_exits()
+{
+    struct kvm_enable_cap cap = { .cap = KVM_CAP_X86_DISABLE_EXITS };
+    int supported;
+
+    supported = ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+    if (supported < 0)
+        supported = 0;
+    if (cpu_opts.disable_exits & ~supported) {
+        fprintf(stderr, "kvm can not disable exits 0x%x, they stay enabled\n",
+                cpu_opts.disable_exits & ~supported);
+        cpu_opts.disable_exits &= supported;
+    }
+    if (!cpu_opts.disable_exits)
+        return 0;
+
+    cap.args[0] = cpu_opts.disable_exits;
+    if (ioctl(vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        fprintf(stderr, "disable exits failed\n");
+        cpu_opts.disable_exits = 0;
+        return -1;
+    }
+    return 0;
+}
+
+struct vcpu_init_work {
+    struct VCPUState *vcpu;
+    int cpu_index;
+    int ret;
+    uint64_t ns;
+};
+
+static void *vcpu_init_fn(void *arg)
+{
+    struct vcpu_init_work *work = arg;
+    uint64_t start = now_ns();
+
+    if (work->cpu_index > 0 && init_vcpu(work->vcpu, work->cpu_index) < 0) {
+        work->ret = -1;
+        return NULL;
+    }
+    setup_vcpu(kvm_fd, work->vcpu, nr_vcpus);
+    reset_vcpu(kvm_fd, work->vcpu, nr_vcpus);
+    work->ns = now_ns() - start;
+    return NULL;
+}
+
+/*
+ * Create and initialize the vcpus in parallel, each on the host cpu it
+ * will later run on. The sum of the per vcpu times is what a serial loop
+ * would have taken.
+ */
+static int cpus_setup()
+{
+    struct vcpu_init_work work[VCPU_MAX];
+    pthread_t threads[VCPU_MAX];
+    bool threaded[VCPU_MAX];
+    uint64_t start, wall, serial = 0;
+    int ret = 0;
+    //a single host cpu only adds the thread spawns on top
+    bool parallel = nr_vcpus > 1 && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+    start = now_ns();
+    for (int i = 0; i < nr_vcpus; i++) {
+        work[i] = (struct vcpu_init_work){ .vcpu = &vcpus[i], .cpu_index = i };
+        threaded[i] = parallel &&
+                      thread_create(&threads[i], ThreadVcpu, i,
+                                    vcpu_init_fn, &work[i]) == 0;
+        if (!threaded[i]) {
+            vcpu_init_fn(&work[i]);
+        }
+    }
+    for (int i = 0; i < nr_vcpus; i++) {
+        if (threaded[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (work[i].ret < 0) {
+            ret = -1;
+        }
+        serial += work[i].ns;
+    }
+    wall = now_ns() - start;
+    if (ret < 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "vcpus: %d ready in %" PRIu64 " us, serial %" PRIu64 " us, saved %" PRId64 " us per vcpu\n",
+           nr_vcpus, wall / 1000, serial / 1000,
+           ((int64_t)serial - (int64_t)wall) / 1000 / nr_vcpus);
+    return 0;
+}
+
+//drop kvm's pmu emulation unless the guest asked for one, before any vcpu exists
+static void cpus_disable_pmu()
+{
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_PMU_CAPABILITY,
+        .args[0] = KVM_PMU_CAP_DISABLE,
+    };
+    int supported;
+
+    supported = ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_PMU_CAPABILITY);
+    if (supported <= 0 || !(supported & KVM_PMU_CAP_DISABLE))
+        return;
+    if (ioctl(vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        fprintf(stderr, "disable pmu failed\n");
+    }
+}
+
+//one vcpu_snapshot per vcpu, read off parked or not yet started vcpus
+static int cpus_save(void *opaque, FILE *fp)
+{
+    struct vcpu_snapshot *s = malloc(sizeof(*s));
+    uint32_t n = nr_vcpus;
+    int ret = 0;
+
+    if (!s)
+        return -1;
+    ret = snapshot_write(fp, &n, sizeof(n));
+    for (int i = 0; i < nr_vcpus && ret == 0; i++) {
+        ret = vcpu_save_state(kvm_fd, &vcpus[i], s);
+        if (ret == 0)
+            ret = snapshot_write(fp, s, sizeof(*s));
+    }
+    free(s);
+    return ret;
+}
+
+static int cpus_load(void *opaque, FILE *fp, uint64_t len)
+{
+    struct vcpu_snapshot *s;
+    uint32_t n;
+    int ret = 0;
+
+    if (snapshot_read(fp, &n, sizeof(n)) < 0)
+        return -1;
+    if (n != nr_vcpus || len != sizeof(n) + n * sizeof(*s)) {
+        fprintf(stderr, "snapshot has %u vcpus, restore with -s %u\n", n, n);
+        return -1;
+    }
+    s = malloc(sizeof(*s));
+    if (!s)
+        return -1;
+    for (int i = 0; i < nr_vcpus && ret == 0; i++) {
+        ret = snapshot_read(fp, s, sizeof(*s));
+        if (ret == 0)
+            ret = vcpu_load_state(&vcpus[i], s);
+    }
+    free(s);
+    return ret;
+}
+
+int cpus_init(int kvmfd, int vmfd, int vcpu_count)
+{
+    int max_vcpus, max_vcpu_id;
+    //KVM_RUN still returns EINTR, other syscalls of the vcpu thread (serial output) restart
+    struct sigaction sa = {
+        .sa_handler = vcpu_kick_handler,
+        .sa_flags = SA_RESTART,
+    };
+
+    kvm_fd = kvmfd;
+    vm_fd = vmfd;
+
+    max_vcpus = ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+    if (max_vcpus <= 0) {
+        max_vcpus = ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
+    }
+    if (max_vcpus > VCPU_MAX) {
+        max_vcpus = VCPU_MAX;
+    }
+    if (vcpu_count < 1 || vcpu_count > max_vcpus) {
+        fprintf(stderr, "invalid vcpu count %d, kvm supports 1-%d\n",
+                vcpu_count, max_vcpus);
+        return -1;
+    }
+
+    max_vcpu_id = ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPU_ID);
+    if (max_vcpu_id <= 0) {
+        max_vcpu_id = max_vcpus;
+    }
+    if (topology_max_apic_id(vcpu_count) >= max_vcpu_id) {
+        fprintf(stderr, "apic id %u is above the kvm limit %d\n",
+                topology_max_apic_id(vcpu_count), max_vcpu_id - 1);
+        return -1;
+    }
+    topology_check_pinning(vcpu_count);
+
+    vcpus = calloc(vcpu_count, sizeof(struct VCPUState));
+    if (!vcpus) {
+        fprintf(stderr, "malloc vcpus failed\n");
+        return -1;
+    }
+    nr_vcpus = vcpu_count;
+    sem_init(&vcpu_exit_sem, 0, 0);
+    if (cpu_opts.disable_exits && cpus_disable_exits() < 0) {
+        return -1;
+    }
+    if (!cpu_opts.pmu) {
+        cpus_disable_pmu();
+    }
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIG_VCPU_KICK, &sa, NULL);
+
+    //the bsp comes first, the state every vcpu starts from is read off it
+    if (init_vcpu(&vcpus[0], 0) < 0 ||
+        setup_vcpu_template(kvm_fd, &vcpus[0]) < 0) {
+        return -1;
+    }
+    snapshot_register("cpus", cpus_save, cpus_load, NULL);
+    return cpus_setup();
+}
+
+int cpus_start()
+{
+    for (int i = 0; i < nr_vcpus; i++) {
+        pthread_mutex_lock(&pause_lock);
+        nr_running++;
+        vcpus[i].running = true;
+        pthread_mutex_unlock(&pause_lock);
+        if (thread_create(&(vcpus[i].thread), ThreadVcpu, i,
+                          vcpu_thread_fn, &vcpus[i]) != 0) {
+            fprintf(stderr, "can not create kvm cpu thread %d\n", i);
+            pthread_mutex_lock(&pause_lock);
+            nr_running--;
+            vcpus[i].running = false;
+            pthread_mutex_unlock(&pause_lock);
+            return -1;
+        }
+        vcpus[i].started = true;
+    }
+    return 0;
+}
+
+/*
+ * immediate_exit covers a vcpu that is about to enter KVM_RUN, the
+ * signal one that is already inside it. Caller holds pause_lock.
+ */
+static void vcpu_kick_locked(struct VCPUState *vcpu)
+{
+    if (!vcpu->started || !vcpu->running)
+        return;
+    vcpu->kvm_run->immediate_exit = 1;
+    pthread_kill(vcpu->thread, SIG_VCPU_KICK);
+}
+
+static void cpus_kick_locked()
+{
+    for (int i = 0; i < nr_vcpus; i++)
+        vcpu_kick_locked(&vcpus[i]);
+}
+
+//force one vcpu out of KVM_RUN, it looks at sample_pending before resuming
+void cpus_kick(int cpu_index)
+{
+    pthread_mutex_lock(&pause_lock);
+    if (cpu_index >= 0 && cpu_index < nr_vcpus)
+        vcpu_kick_locked(&vcpus[cpu_index]);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+void cpus_pause()
+{
+    pthread_mutex_lock(&pause_lock);
+    if (!pause_requested) {
+        pause_requested = true;
+        cpus_kick_locked();
+    }
+    while (nr_parked < nr_running && !stop_requested)
+        pthread_cond_wait(&parked_cond, &pause_lock);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+void cpus_resume()
+{
+    pthread_mutex_lock(&pause_lock);
+    pause_requested = false;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+bool cpus_paused()
+{
+    bool paused;
+
+    pthread_mutex_lock(&pause_lock);
+    paused = pause_requested;
+    pthread_mutex_unlock(&pause_lock);
+    return paused;
+}
+
+//kick every vcpu out of the guest for good and wait for the threads
+void cpus_stop()
+{
+    pthread_mutex_lock(&pause_lock);
+    stop_requested = true;
+    pthread_cond_broadcast(&pause_cond);
+    cpus_kick_locked();
+    pthread_mutex_unlock(&pause_lock);
+
+    for (int i = 0; i < nr_vcpus; i++) {
+        if (vcpus[i].started)
+            pthread_join(vcpus[i].thread, NULL);
+        vcpus[i].started = false;
+    }
+}
+
+/*
+ * Returns once any vcpu has left its run loop; a shutdown or triple
+ * fault on one cpu ends the whole vm.
+ */
+void cpus_wait()
+{
+    while (sem_wait(&vcpu_exit_sem) < 0 && errno == EINTR)
+        ;
+}
+
+void cpus_exit()
+{
+    cpus_stop();
+    for (int i = 0; i < nr_vcpus; i++) {
+        destroy_vcpu(&vcpus[i]);
+        close(vcpus[i].vcpu_fd);
+        free(vcpus[i].exit_stats);
+        free(vcpus[i].env.cpuid);
+    }
+    free(vcpus);
+    vcpus = NULL;
+    nr_vcpus = 0;
+}
+
+int get_vcpu_count()
+{
+    return nr_vcpus;
+}
+
+struct VCPUState *get_vcpu(int cpu_index)
+{
+    if (cpu_index < 0 || cpu_index >= nr_vcpus)
+        return NULL;
+    return &vcpus[cpu_index];
+}
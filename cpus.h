@@ -0,0 +1,18 @@
+#ifndef MICROV_CPUS_H
+#define MICROV_CPUS_H
+
+#include "vcpu.h"
+
+int cpus_init(int kvm_fd, int vmfd, int vcpu_count);
+int cpus_start();
+void cpus_wait();
+void cpus_pause();
+void cpus_resume();
+bool cpus_paused();
+void cpus_stop();
+void cpus_kick(int cpu_index);
+void cpus_exit();
+int get_vcpu_count();
+struct VCPUState *get_vcpu(int cpu_index);
+
+#endif /* MICROV_CPUS_H */
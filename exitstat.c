@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "iobus.h"
+#include "cpus.h"
+#include "thread.h"
+#include "exitstat.h"
+
+#define EXIT_SITE_TOP		16
+
+/*
+ * Per-vcpu exit accounting. Each vcpu thread only writes its own
+ * ExitStats, the dump reads them unlocked, so a dump taken while the
+ * guest runs may be off by the exits in flight. exit_stats_lock only
+ * keeps dumps away from the vcpu teardown.
+ */
+bool exit_stats_enabled;
+
+static pthread_mutex_t exit_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool exit_stats_stopped;
+
+extern struct bus pio_bus;
+extern struct bus mmio_bus;
+
+static const char *exit_reason_names[EXIT_REASON_MAX] = {
+    [KVM_EXIT_UNKNOWN]          = "unknown",
+    [KVM_EXIT_EXCEPTION]        = "exception",
+    [KVM_EXIT_IO]               = "io",
+    [KVM_EXIT_HYPERCALL]        = "hypercall",
+    [KVM_EXIT_DEBUG]            = "debug",
+    [KVM_EXIT_HLT]              = "hlt",
+    [KVM_EXIT_MMIO]             = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN]  = "irq_window_open",
+    [KVM_EXIT_SHUTDOWN]         = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY]       = "fail_entry",
+    [KVM_EXIT_INTR]             = "intr",
+    [KVM_EXIT_SET_TPR]          = "set_tpr",
+    [KVM_EXIT_TPR_ACCESS]       = "tpr_access",
+    [KVM_EXIT_NMI]              = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR]   = "internal_error",
+    [KVM_EXIT_SYSTEM_EVENT]     = "system_event",
+    [KVM_EXIT_IOAPIC_EOI]       = "ioapic_eoi",
+    [KVM_EXIT_X86_RDMSR]        = "rdmsr",
+    [KVM_EXIT_X86_WRMSR]        = "wrmsr",
+    [KVM_EXIT_X86_BUS_LOCK]     = "bus_lock",
+};
+
+//bucket i holds exits that took [2^i, 2^(i+1)) ns
+static int hist_bucket(uint64_t ns)
+{
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    return b < EXIT_HIST_BUCKETS ? b : EXIT_HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t count, int pct)
+{
+    uint64_t want = (count * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < EXIT_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= want && seen > 0)
+            return 2ULL << i;
+    }
+    return 0;
+}
+
+static struct exit_site *find_site(struct ExitStats *stats, uint32_t reason,
+                                   uint64_t addr, uint8_t is_write)
+{
+    uint64_t key = (addr << 2) ^ (reason << 1) ^ is_write;
+    uint32_t h = (key * 0x9e3779b97f4a7c15ULL) >> 56;
+
+    for (int i = 0; i < EXIT_SITE_MAX; i++) {
+        struct exit_site *site = &stats->sites[(h + i) % EXIT_SITE_MAX];
+
+        //a dump may look at the site as soon as it is used
+        if (!site->used) {
+            site->addr = addr;
+            site->reason = reason;
+            site->is_write = is_write;
+            __atomic_store_n(&site->used, 1, __ATOMIC_RELEASE);
+            return site;
+        }
+        if (site->addr == addr && site->reason == reason &&
+            site->is_write == is_write)
+            return site;
+    }
+    return NULL;
+}
+
+struct ExitStats *exit_stats_alloc()
+{
+    return calloc(1, sizeof(struct ExitStats));
+}
+
+void exit_stats_record(struct ExitStats *stats, struct kvm_run *run, uint64_t ns)
+{
+    uint32_t reason = run->exit_reason < EXIT_REASON_MAX ?
+                      run->exit_reason : KVM_EXIT_UNKNOWN;
+    struct exit_reason_stat *rs = &stats->reasons[reason];
+    struct exit_site *site = NULL;
+    int b = hist_bucket(ns);
+
+    rs->count++;
+    rs->total_ns += ns;
+    if (ns > rs->max_ns)
+        rs->max_ns = ns;
+    rs->hist[b]++;
+
+    if (reason == KVM_EXIT_IO) {
+        site = find_site(stats, reason, run->io.port,
+                         run->io.direction == KVM_EXIT_IO_OUT);
+    } else if (reason == KVM_EXIT_MMIO) {
+        site = find_site(stats, reason, run->mmio.phys_addr,
+                         run->mmio.is_write);
+    } else {
+        return;
+    }
+
+    if (!site) {
+        stats->sites_dropped++;
+        return;
+    }
+    site->count++;
+    site->total_ns += ns;
+    site->hist[b]++;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+    const struct exit_site *x = *(const struct exit_site **)a;
+    const struct exit_site *y = *(const struct exit_site **)b;
+
+    if (x->total_ns == y->total_ns)
+        return 0;
+    return x->total_ns < y->total_ns ? 1 : -1;
+}
+
+static void dump_vcpu(FILE *out, int cpu_index, struct ExitStats *stats)
+{
+    struct exit_site *top[EXIT_SITE_MAX];
+    int n = 0;
+
+    fprintf(out, "vcpu %d exits:\n", cpu_index);
+    fprintf(out, "  %-16s %12s %12s %10s %10s %10s %10s\n",
+            "reason", "count", "total_us", "avg_ns", "p50_ns", "p99_ns", "max_ns");
+    for (int i = 0; i < EXIT_REASON_MAX; i++) {
+        struct exit_reason_stat *rs = &stats->reasons[i];
+        uint64_t count = __atomic_load_n(&rs->count, __ATOMIC_RELAXED);
+        const char *name = exit_reason_names[i];
+        char buf[16];
+
+        if (!count)
+            continue;
+        if (!name) {
+            snprintf(buf, sizeof(buf), "exit_%d", i);
+            name = buf;
+        }
+        fprintf(out, "  %-16s %12lu %12lu %10lu %10lu %10lu %10lu\n",
+                name, count, rs->total_ns / 1000, rs->total_ns / count,
+                hist_percentile(rs->hist, count, 50),
+                hist_percentile(rs->hist, count, 99), rs->max_ns);
+    }
+
+    //a fresh site is used before its first exit is counted
+    for (int i = 0; i < EXIT_SITE_MAX; i++) {
+        if (__atomic_load_n(&stats->sites[i].used, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&stats->sites[i].count, __ATOMIC_RELAXED))
+            top[n++] = &stats->sites[i];
+    }
+    if (!n)
+        return;
+    qsort(top, n, sizeof(top[0]), site_cmp);
+
+    fprintf(out, "  %-4s %-5s %-18s %-18s %12s %12s %10s %10s\n",
+            "type", "dir", "addr", "region", "count", "total_us", "avg_ns", "p99_ns");
+    for (int i = 0; i < n && i < EXIT_SITE_TOP; i++) {
+        struct exit_site *site = top[i];
+        uint64_t count = __atomic_load_n(&site->count, __ATOMIC_RELAXED);
+        bool pio = site->reason == KVM_EXIT_IO;
+        struct region *region = iobus_find_region(pio ? &pio_bus : &mmio_bus,
+                                                  site->addr);
+
+        fprintf(out, "  %-4s %-5s 0x%-16lx 0x%-16lx %12lu %12lu %10lu %10lu\n",
+                pio ? "pio" : "mmio", site->is_write ? "write" : "read",
+                site->addr, region ? region->base : 0,
+                count, site->total_ns / 1000, site->total_ns / count,
+                hist_percentile(site->hist, count, 99));
+    }
+    if (stats->sites_dropped)
+        fprintf(out, "  %lu exits from untracked sites\n", stats->sites_dropped);
+}
+
+void exit_stats_dump(FILE *out)
+{
+    if (!exit_stats_enabled)
+        return;
+
+    pthread_mutex_lock(&exit_stats_lock);
+    for (int i = 0; !exit_stats_stopped && i < get_vcpu_count(); i++) {
+        struct VCPUState *vcpu = get_vcpu(i);
+
+        if (vcpu->exit_stats)
+            dump_vcpu(out, i, vcpu->exit_stats);
+    }
+    fflush(out);
+    pthread_mutex_unlock(&exit_stats_lock);
+}
+
+//before the vcpus go away; a SIGUSR1 or monitor dump after it prints nothing
+void exit_stats_exit()
+{
+    pthread_mutex_lock(&exit_stats_lock);
+    exit_stats_stopped = true;
+    pthread_mutex_unlock(&exit_stats_lock);
+}
+
+static void *exit_stats_signal_fn(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+
+    for (;;) {
+        if (sigwait(set, &sig) == 0)
+            exit_stats_dump(stderr);
+    }
+    return NULL;
+}
+
+/*
+ * SIGUSR1 dumps the counters. Must run before any other thread is
+ * created so every thread inherits the blocked mask and the signal is
+ * only ever taken by the dump thread.
+ */
+int exit_stats_init()
+{
+    static sigset_t set;
+    pthread_t thread;
+
+    exit_stats_enabled = true;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (thread_create(&thread, ThreadIo, 0, exit_stats_signal_fn, &set) != 0) {
+        fprintf(stderr, "can not create exit stats thread\n");
+        return -1;
+    }
+    return 0;
+}
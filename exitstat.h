@@ -0,0 +1,45 @@
+#ifndef MICROV_EXITSTAT_H
+#define MICROV_EXITSTAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/kvm.h>
+
+#define EXIT_REASON_MAX		64
+#define EXIT_HIST_BUCKETS	32
+#define EXIT_SITE_MAX		256
+
+//one guest access point: a pio port or mmio gpa, split by direction
+struct exit_site {
+    uint64_t addr;
+    uint32_t reason;
+    uint8_t is_write;
+    uint8_t used;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t hist[EXIT_HIST_BUCKETS];
+};
+
+struct exit_reason_stat {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[EXIT_HIST_BUCKETS];
+};
+
+struct ExitStats {
+    struct exit_reason_stat reasons[EXIT_REASON_MAX];
+    struct exit_site sites[EXIT_SITE_MAX];
+    uint64_t sites_dropped;
+};
+
+extern bool exit_stats_enabled;
+
+int exit_stats_init();
+struct ExitStats *exit_stats_alloc();
+void exit_stats_record(struct ExitStats *stats, struct kvm_run *run, uint64_t ns);
+void exit_stats_dump(FILE *out);
+void exit_stats_exit();
+
+#endif /* MICROV_EXITSTAT_H */
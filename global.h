@@ -5,6 +5,9 @@
 
 #define RAM_SIZE 			0x20000000
 
+//the mp table lives in the 1k below VGA_RAM_START, which bounds the cpu entries
+#define VCPU_MAX			32
+
 #define INITRD_ADDR_MAX        	 	0x37ffffff
 
 #define APIC_DEFAULT_PHYS_BASE		0xfee00000
@@ -13,9 +16,12 @@
 #define VMLINUX_START   		0x01000000
 #define VMLINUX_RAM_START       	0x00100000
 #define MB_BIOS_START           	0x000f0000
+#define ACPI_START			0x000e0000
 #define VGA_RAM_START           	0x000a0000
 #define MPTABLE_START			0x0009fc00
 #define CMDLINE_START           	0x00020000
+//boot page tables, pml4 then pdpt pages, pd pages only without 1G pages
+#define PAGE_TABLE_END			0x0000f000
 #define PDE_START         		0x0000b000
 #define PDPTE_START			0x0000a000
 #define PML4_START        		0x00009000
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+
+#include "cpus.h"
+#include "thread.h"
+#include "kvmstats.h"
+#include "haltpoll.h"
+
+#define HALT_POLL_PERIOD_US	100000
+#define HALT_POLL_MIN_NS	10000
+
+enum HaltStat
+{
+    HaltSuccessfulPoll = 0,
+    HaltAttemptedPoll,
+    HaltPollInvalid,
+    HaltWakeup,
+    HaltPollSuccessNs,
+    HaltPollFailNs,
+    HaltStatEnd
+};
+
+static const char *halt_stat_names[HaltStatEnd] = {
+    "halt_successful_poll",
+    "halt_attempted_poll",
+    "halt_poll_invalid",
+    "halt_wakeup",
+    "halt_poll_success_ns",
+    "halt_poll_fail_ns",
+};
+
+struct HaltPollVcpu {
+    struct kvm_stats stats;
+    int offsets[HaltStatEnd];
+};
+
+static int halt_vmfd = -1;
+static uint64_t halt_max_ns;
+static uint64_t halt_cur_ns;
+static struct HaltPollVcpu *halt_vcpus;
+static int halt_nr_vcpus;
+
+static int halt_poll_set(uint64_t ns)
+{
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_HALT_POLL,
+        .args[0] = ns,
+    };
+
+    if (ioctl(halt_vmfd, KVM_ENABLE_CAP, &cap) < 0) {
+        fprintf(stderr, "set halt poll %lu ns failed\n", ns);
+        return -1;
+    }
+    halt_cur_ns = ns;
+    return 0;
+}
+
+static void halt_poll_sum(uint64_t *sum)
+{
+    memset(sum, 0, sizeof(uint64_t) * HaltStatEnd);
+    for (int i = 0; i < halt_nr_vcpus; i++) {
+        struct HaltPollVcpu *hv = &halt_vcpus[i];
+
+        for (int s = 0; s < HaltStatEnd; s++)
+            sum[s] += kvm_stats_read(&hv->stats, hv->offsets[s]);
+    }
+}
+
+/*
+ * The kernel already grows and shrinks each vcpu's poll window up to
+ * the vm limit; this moves the limit itself. Polls that mostly succeed
+ * earn a larger window, polls whose failed spinning outweighs the
+ * successful ones give cpu back, bounded by HALT_POLL_MIN_NS and the
+ * configured maximum.
+ */
+static void *halt_poll_adaptive_fn(void *arg)
+{
+    uint64_t last[HaltStatEnd], now[HaltStatEnd], delta[HaltStatEnd];
+
+    halt_poll_sum(last);
+    for (;;) {
+        uint64_t next = halt_cur_ns;
+
+        usleep(HALT_POLL_PERIOD_US);
+        halt_poll_sum(now);
+        for (int s = 0; s < HaltStatEnd; s++)
+            delta[s] = now[s] - last[s];
+        memcpy(last, now, sizeof(last));
+
+        if (!delta[HaltAttemptedPoll])
+            continue;
+
+        if (delta[HaltSuccessfulPoll] * 2 >= delta[HaltAttemptedPoll]) {
+            next = halt_cur_ns * 2;
+        } else if (delta[HaltPollFailNs] > delta[HaltPollSuccessNs] * 2 &&
+                   delta[HaltSuccessfulPoll] * 4 < delta[HaltAttemptedPoll]) {
+            next = halt_cur_ns / 2;
+        }
+        if (next > halt_max_ns)
+            next = halt_max_ns;
+        if (next < HALT_POLL_MIN_NS)
+            next = HALT_POLL_MIN_NS;
+        if (next != halt_cur_ns)
+            halt_poll_set(next);
+    }
+    return NULL;
+}
+
+int halt_poll_init(int vmfd, uint64_t max_ns, bool adaptive)
+{
+    pthread_t thread;
+
+    halt_vmfd = vmfd;
+    if (ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0) {
+        fprintf(stderr, "kvm not support per vm halt poll\n");
+        return -1;
+    }
+    halt_max_ns = max_ns;
+    if (halt_poll_set(adaptive && max_ns > HALT_POLL_MIN_NS ?
+                      HALT_POLL_MIN_NS : max_ns) < 0)
+        return -1;
+
+    halt_nr_vcpus = get_vcpu_count();
+    halt_vcpus = calloc(halt_nr_vcpus, sizeof(struct HaltPollVcpu));
+    if (!halt_vcpus)
+        return -1;
+    for (int i = 0; i < halt_nr_vcpus; i++) {
+        struct HaltPollVcpu *hv = &halt_vcpus[i];
+
+        if (kvm_stats_open(&hv->stats, get_vcpu(i)->vcpu_fd) < 0) {
+            fprintf(stderr, "halt poll stats not available for vcpu %d\n", i);
+        }
+        for (int s = 0; s < HaltStatEnd; s++)
+            hv->offsets[s] = kvm_stats_find(&hv->stats, halt_stat_names[s]);
+    }
+
+    if (adaptive &&
+        thread_create(&thread, ThreadIo, 0, halt_poll_adaptive_fn, NULL) != 0) {
+        fprintf(stderr, "can not create halt poll thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+void halt_poll_dump(FILE *out)
+{
+    if (!halt_vcpus)
+        return;
+
+    fprintf(out, "halt poll: limit %lu ns (max %lu ns)\n", halt_cur_ns, halt_max_ns);
+    fprintf(out, "  %-5s %12s %12s %12s %12s %14s %14s\n", "vcpu",
+            "poll_ok", "poll_fail", "invalid", "wakeup", "ok_us", "fail_us");
+    for (int i = 0; i < halt_nr_vcpus; i++) {
+        struct HaltPollVcpu *hv = &halt_vcpus[i];
+        uint64_t v[HaltStatEnd];
+
+        for (int s = 0; s < HaltStatEnd; s++)
+            v[s] = kvm_stats_read(&hv->stats, hv->offsets[s]);
+        fprintf(out, "  %-5d %12lu %12lu %12lu %12lu %14lu %14lu\n", i,
+                v[HaltSuccessfulPoll],
+                v[HaltAttemptedPoll] - v[HaltSuccessfulPoll],
+                v[HaltPollInvalid], v[HaltWakeup],
+                v[HaltPollSuccessNs] / 1000, v[HaltPollFailNs] / 1000);
+    }
+    fflush(out);
+}
@@ -0,0 +1,11 @@
+#ifndef MICROV_HALTPOLL_H
+#define MICROV_HALTPOLL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+int halt_poll_init(int vmfd, uint64_t max_ns, bool adaptive);
+void halt_poll_dump(FILE *out);
+
+#endif /* MICROV_HALTPOLL_H */
@@ -1,13 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "global.h"
 #include "iobus.h"
+#include "thread.h"
+
+#define COALESCED_RING_PAGE_SIZE 4096
+#define COALESCED_RING_MAX \
+    ((COALESCED_RING_PAGE_SIZE - sizeof(struct kvm_coalesced_mmio_ring)) / \
+     sizeof(struct kvm_coalesced_mmio))
 
 struct bus pio_bus;
 struct bus mmio_bus;
 
+static int bus_vmfd = -1;
+
+/*
+ * Coalesced io: KVM appends guest writes to registered zones to a ring
+ * shared with userspace instead of exiting. The ring is drained before
+ * every exit is handled, so a later read of the device still observes
+ * all earlier writes in order, and by a helper thread so a guest that
+ * rarely exits still sees its writes land.
+ */
+static struct kvm_coalesced_mmio_ring *coalesced_ring;
+static bool coalesced_pio;
+static pthread_mutex_t coalesced_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct region *iobus_find_region(struct bus *bus, uint64_t addr)
 {
     struct region **p;
@@ -22,6 +45,30 @@ struct region *iobus_find_region(struct bus *bus, uint64_t addr)
     return NULL;
 }
 
+static void region_coalesced_zone(struct region *region, unsigned long req)
+{
+    struct kvm_coalesced_mmio_zone zone;
+    bool pio = region->bus == &pio_bus;
+
+    if (!coalesced_ring || !region->coalesced_len)
+        return;
+    if (region->bus != &pio_bus && region->bus != &mmio_bus)
+        return;
+    if (pio && !coalesced_pio)
+        return;
+
+    zone = (struct kvm_coalesced_mmio_zone) {
+        .addr = region->base + region->coalesced_offset,
+        .size = region->coalesced_len,
+        .pio  = pio,
+    };
+    if (ioctl(bus_vmfd, req, &zone) < 0) {
+        fprintf(stderr, "%s coalesced zone 0x%llx failed\n",
+                req == KVM_REGISTER_COALESCED_MMIO ? "register" : "unregister",
+                zone.addr);
+    }
+}
+
 void iobus_register_region(struct bus *bus, struct region *region)
 {
     struct bus *p = bus;
@@ -31,6 +78,7 @@ void iobus_register_region(struct bus *bus, struct region *region)
     p->region_count++;
 
     region->bus = p;
+    region_coalesced_zone(region, KVM_REGISTER_COALESCED_MMIO);
 }
 
 void iobus_deregister_region(struct region *region)
@@ -45,12 +93,18 @@ void iobus_deregister_region(struct region *region)
         p = &(*p)->next;
     }
 
-    if (*p)
+    if (*p) {
+        //pending writes must reach the device before its zone goes away
+        iobus_coalesced_flush();
+        region_coalesced_zone(region, KVM_UNREGISTER_COALESCED_MMIO);
         *p = (*p)->next;
+        region->bus = NULL;
+    }
 }
 
-void iobus_init()
+void iobus_init(int vmfd)
 {
+    bus_vmfd = vmfd;
     pio_bus.region_count = 0;
     pio_bus.head = NULL;
     mmio_bus.region_count = 0;
@@ -68,9 +122,22 @@ void region_init(struct region *region,
     region->len = len;
     region->owner = owner;
     region->handle_io = handle_io;
+    region->coalesced_offset = 0;
+    region->coalesced_len = 0;
     region->next = NULL;
 }
 
+/*
+ * Only registers whose writes have no side effect the guest can observe
+ * without a later read may be coalesced, e.g. a uart THR or a config
+ * window that is always read back.
+ */
+void region_set_coalesced(struct region *region, uint64_t offset, uint64_t len)
+{
+    region->coalesced_offset = offset;
+    region->coalesced_len = len;
+}
+
 static void bus_handle_io(struct bus *bus,
                           uint64_t addr,
                           uint8_t size,
@@ -84,6 +151,77 @@ static void bus_handle_io(struct bus *bus,
     }
 }
 
+void iobus_coalesced_flush()
+{
+    struct kvm_coalesced_mmio_ring *ring = coalesced_ring;
+
+    if (!ring || ring->first == ring->last)
+        return;
+
+    pthread_mutex_lock(&coalesced_lock);
+    while (ring->first != ring->last) {
+        struct kvm_coalesced_mmio *ent = &ring->coalesced_mmio[ring->first];
+
+        bus_handle_io(ent->pio ? &pio_bus : &mmio_bus,
+                      ent->phys_addr, ent->len, ent->data, 1);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        ring->first = (ring->first + 1) % COALESCED_RING_MAX;
+    }
+    pthread_mutex_unlock(&coalesced_lock);
+}
+
+static void *coalesced_flush_fn(void *arg)
+{
+    unsigned int flush_us = *(unsigned int *)arg;
+
+    for (;;) {
+        usleep(flush_us);
+        iobus_coalesced_flush();
+    }
+    return NULL;
+}
+
+/*
+ * The ring page follows kvm_run in every vcpu mapping, at the page
+ * offset KVM_CAP_COALESCED_MMIO returns. Zones are per vm, so any vcpu
+ * fd reaches the same ring; it gets its own mapping here so it outlives
+ * the vcpu's kvm_run. Must be called before regions that want
+ * coalescing are registered.
+ */
+int iobus_coalesced_init(int vcpu_fd, unsigned int flush_us)
+{
+    void *ring;
+    static unsigned int period;
+    pthread_t thread;
+    int offset;
+
+    offset = ioctl(bus_vmfd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (offset <= 0) {
+        fprintf(stderr, "kvm not support coalesced mmio\n");
+        return -1;
+    }
+    coalesced_pio = ioctl(bus_vmfd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) > 0;
+    if (!coalesced_pio) {
+        fprintf(stderr, "kvm not support coalesced pio, pio regions will exit\n");
+    }
+    ring = mmap(NULL, COALESCED_RING_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_SHARED, vcpu_fd, (off_t)offset * COALESCED_RING_PAGE_SIZE);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "mmap coalesced ring failed\n");
+        return -1;
+    }
+    coalesced_ring = ring;
+
+    if (flush_us) {
+        period = flush_us;
+        if (thread_create(&thread, ThreadIo, 0, coalesced_flush_fn, &period) != 0) {
+            fprintf(stderr, "can not create coalesced flush thread\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void iobus_handle_pio(struct kvm_run *run)
 {
     void *data = (void *) run + run->io.data_offset;
@@ -107,4 +245,3 @@ void iobus_handle_mmio(struct kvm_run *run)
                   run->mmio.data,
                   run->mmio.is_write);
 }
-
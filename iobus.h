@@ -17,6 +17,9 @@ struct region {
     uint64_t len;
     void *owner;
     region_io_fn handle_io;
+    //write-only window KVM may queue in the coalesced ring, len 0 if none
+    uint64_t coalesced_offset;
+    uint64_t coalesced_len;
     struct region *next;
 };
 
@@ -28,9 +31,12 @@ struct bus {
 struct region *iobus_find_region(struct bus *bus, uint64_t addr);
 void iobus_register_region(struct bus *bus, struct region *region);
 void iobus_deregister_region(struct region *region);
-void iobus_init();
+void iobus_init(int vmfd);
 void region_init(struct region *region, uint64_t base,
                  uint64_t len, void *owner, region_io_fn do_io);
+void region_set_coalesced(struct region *region, uint64_t offset, uint64_t len);
+int iobus_coalesced_init(int vcpu_fd, unsigned int flush_us);
+void iobus_coalesced_flush();
 void iobus_handle_pio(struct kvm_run *run);
 void iobus_handle_mmio(struct kvm_run *run);
 
@@ -9,6 +9,7 @@
 #include <linux/kvm.h>
 
 #include "ioeventfd.h"
+#include "thread.h"
 
 #define IOEVENTFD_MAX_EVENTS 32
 
@@ -16,6 +17,8 @@ static int init_ioeventfd = 0;
 static int epoll_fd, epoll_stop_fd;
 static struct epoll_event event_sets[IOEVENTFD_MAX_EVENTS];
 static LIST_HEAD(used_ioevents);
+//held around each batch of callbacks, see ioeventfd_pause()
+static pthread_mutex_t ioevent_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void *ioeventfd_thread(void *param)
 {
@@ -24,10 +27,12 @@ static void *ioeventfd_thread(void *param)
     
     for (;;) {
         nfds = epoll_wait(epoll_fd, event_sets, IOEVENTFD_MAX_EVENTS, -1);
+        pthread_mutex_lock(&ioevent_lock);
     	for (i = 0; i < nfds; i++) {
     	    struct ioevent *ioevent;
     
     	    if (event_sets[i].data.fd == epoll_stop_fd) {
+                pthread_mutex_unlock(&ioevent_lock);
                 write(epoll_stop_fd, &tmp, sizeof(tmp));
                 return NULL;
     	    }
@@ -39,6 +44,7 @@ static void *ioeventfd_thread(void *param)
 
     	    ioevent->fn(ioevent->fn_ptr);
     	}
+        pthread_mutex_unlock(&ioevent_lock);
     }
 
     return NULL;
@@ -90,6 +96,21 @@ cleanup:
     return ret;
 }
 
+/*
+ * Keep the io thread out of the device handlers, no virtqueue is left
+ * halfway through a request. Kicks that arrive meanwhile stay in their
+ * eventfds and are handled on resume.
+ */
+void ioeventfd_pause()
+{
+    pthread_mutex_lock(&ioevent_lock);
+}
+
+void ioeventfd_resume()
+{
+    pthread_mutex_unlock(&ioevent_lock);
+}
+
 int ioeventfd_init(int vmfd)
 {
     int ret;
@@ -114,7 +135,7 @@ int ioeventfd_init(int vmfd)
     if (ret < 0)
     	goto epoll_err;
     
-    ret = pthread_create(&thread, NULL, ioeventfd_thread, NULL);
+    ret = thread_create(&thread, ThreadIo, 0, ioeventfd_thread, NULL);
     if (ret < 0)
         goto epoll_err;
     
@@ -13,6 +13,8 @@ struct ioevent {
 
 int ioeventfd_add_event(int vmfd, struct ioevent *ioevent);
 int ioeventfd_init();
+void ioeventfd_pause();
+void ioeventfd_resume();
 int ioeventfd_exit();
 
 #endif /* MICROV_IOEVENTFD_H */
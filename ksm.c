@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "memory.h"
+#include "ksm.h"
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE	67
+#endif
+
+#define KSM_PAGE_SIZE	0x1000
+
+enum KsmMode ksm_mode = KsmOff;
+
+//"" or "process"
+int parse_ksm(const char *arg)
+{
+    if (!arg) {
+        ksm_mode = KsmRegions;
+        return 0;
+    }
+    if (!strcmp(arg, "process")) {
+        ksm_mode = KsmProcess;
+        return 0;
+    }
+    fprintf(stderr, "unknown ksm mode %s\n", arg);
+    return -1;
+}
+
+static long ksm_read_long(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    long val = -1;
+
+    if (!f)
+        return -1;
+    if (fscanf(f, "%ld", &val) != 1)
+        val = -1;
+    fclose(f);
+    return val;
+}
+
+/*
+ * ksmd merges only private anonymous pages, shared and hugetlb backed
+ * ram is never scanned. THP is split on merge.
+ */
+int ksm_init()
+{
+    uint64_t gpa, size;
+    int node;
+
+    if (ksm_mode == KsmOff)
+        return 0;
+    if (mem_opts.backend != MemBackendAnon && mem_opts.backend != MemBackendThp) {
+        fprintf(stderr, "ksm needs the anon or thp memory backend\n");
+        return -1;
+    }
+
+    for (int i = 0; get_ram_slot(i, &gpa, &size, &node) == 0; i++) {
+        if (madvise(get_userspace_ptr(gpa, size), size, MADV_MERGEABLE) < 0) {
+            fprintf(stderr, "madvise mergeable failed, kernel without CONFIG_KSM?\n");
+            return -1;
+        }
+    }
+    //later mappings too: device buffers, the profiler, anything anonymous
+    if (ksm_mode == KsmProcess && prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0) {
+        fprintf(stderr, "PR_SET_MEMORY_MERGE failed, needs linux 6.4\n");
+        return -1;
+    }
+    if (ksm_read_long("/sys/kernel/mm/ksm/run") != 1)
+        fprintf(stderr, "ksmd is not running, echo 1 > /sys/kernel/mm/ksm/run\n");
+    return 0;
+}
+
+//guest pages the host has populated, merged or not
+static uint64_t ksm_guest_resident()
+{
+    uint64_t gpa, size, resident = 0;
+    int node;
+
+    for (int i = 0; get_ram_slot(i, &gpa, &size, &node) == 0; i++) {
+        uint64_t pages = size / KSM_PAGE_SIZE;
+        unsigned char *vec = malloc(pages);
+
+        if (!vec)
+            continue;
+        if (mincore(get_userspace_ptr(gpa, size), size, vec) == 0) {
+            for (uint64_t p = 0; p < pages; p++)
+                resident += vec[p] & 1;
+        }
+        free(vec);
+    }
+    return resident;
+}
+
+/*
+ * Per vm numbers come from /proc/self/ksm_stat: merging pages are guest
+ * (or, in process mode, other) pages backed by a shared ksm page, the
+ * rest of the resident guest pages are still private.
+ */
+void ksm_dump(FILE *out)
+{
+    long merging = -1, zero = 0, profit = 0;
+    bool has_profit = false;
+    uint64_t resident;
+    char line[128];
+    FILE *f;
+
+    if (ksm_mode == KsmOff)
+        return;
+
+    f = fopen("/proc/self/ksm_stat", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "ksm_merging_pages %ld", &merging);
+        sscanf(line, "ksm_zero_pages %ld", &zero);
+        if (sscanf(line, "ksm_process_profit %ld", &profit) == 1)
+            has_profit = true;
+    }
+    if (f)
+        fclose(f);
+    if (merging < 0)
+        merging = ksm_read_long("/proc/self/ksm_merging_pages");
+
+    resident = ksm_guest_resident();
+    fprintf(out, "ksm guest resident: %llu pages\n", (unsigned long long)resident);
+    if (merging < 0) {
+        fprintf(out, "ksm per-process stats need linux 5.19\n");
+    } else {
+        fprintf(out, "ksm shared:         %ld pages (%ld zero)\n", merging, zero);
+        fprintf(out, "ksm unshared:       %lld pages\n",
+                resident > merging + zero ? (long long)(resident - merging - zero) : 0LL);
+    }
+    //saved memory minus ksm's own metadata, negative until merging pays off
+    if (has_profit)
+        fprintf(out, "ksm profit:         %ld KiB\n", profit / 1024);
+    fprintf(out, "ksm host shared:    %ld pages, sharing %ld\n",
+            ksm_read_long("/sys/kernel/mm/ksm/pages_shared"),
+            ksm_read_long("/sys/kernel/mm/ksm/pages_sharing"));
+}
@@ -0,0 +1,18 @@
+#ifndef MICROV_KSM_H
+#define MICROV_KSM_H
+
+#include <stdio.h>
+
+enum KsmMode {
+    KsmOff = 0,
+    KsmRegions,     //MADV_MERGEABLE on guest ram
+    KsmProcess,     //and PR_SET_MEMORY_MERGE for the whole process
+};
+
+extern enum KsmMode ksm_mode;
+
+int parse_ksm(const char *arg);
+int ksm_init();
+void ksm_dump(FILE *out);
+
+#endif /* MICROV_KSM_H */
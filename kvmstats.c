@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+
+#include "kvmstats.h"
+
+/*
+ * Reader for the binary stats fd of a vm or vcpu (KVM_GET_STATS_FD).
+ * The descriptors never change for the life of the fd, so they are
+ * read once and a stat is afterwards one pread of its data offset.
+ */
+int kvm_stats_open(struct kvm_stats *stats, int kvm_obj_fd)
+{
+    struct kvm_stats_header header;
+    size_t size;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->fd = ioctl(kvm_obj_fd, KVM_GET_STATS_FD, NULL);
+    if (stats->fd < 0) {
+        fprintf(stderr, "get kvm stats fd failed\n");
+        return -1;
+    }
+    if (pread(stats->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(stderr, "read kvm stats header failed\n");
+        goto err;
+    }
+
+    stats->data_offset = header.data_offset;
+    stats->num_desc = header.num_desc;
+    stats->desc_size = sizeof(struct kvm_stats_desc) + header.name_size;
+    size = (size_t)stats->desc_size * stats->num_desc;
+    stats->descs = malloc(size);
+    if (!stats->descs)
+        goto err;
+    if (pread(stats->fd, stats->descs, size, header.desc_offset) != size) {
+        fprintf(stderr, "read kvm stats descriptors failed\n");
+        free(stats->descs);
+        goto err;
+    }
+    return 0;
+
+err:
+    close(stats->fd);
+    stats->fd = -1;
+    return -1;
+}
+
+void kvm_stats_close(struct kvm_stats *stats)
+{
+    if (stats->fd >= 0)
+        close(stats->fd);
+    free(stats->descs);
+    stats->fd = -1;
+    stats->descs = NULL;
+}
+
+//returns the data offset of a stat, or -1 if this kernel does not have it
+int kvm_stats_find(struct kvm_stats *stats, const char *name)
+{
+    for (uint32_t i = 0; i < stats->num_desc; i++) {
+        struct kvm_stats_desc *desc = stats->descs + i * stats->desc_size;
+
+        if (!strcmp(desc->name, name))
+            return stats->data_offset + desc->offset;
+    }
+    return -1;
+}
+
+uint64_t kvm_stats_read(struct kvm_stats *stats, int offset)
+{
+    uint64_t value = 0;
+
+    if (offset < 0 || stats->fd < 0)
+        return 0;
+    if (pread(stats->fd, &value, sizeof(value), offset) != sizeof(value))
+        return 0;
+    return value;
+}
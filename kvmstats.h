@@ -0,0 +1,19 @@
+#ifndef MICROV_KVMSTATS_H
+#define MICROV_KVMSTATS_H
+
+#include <stdint.h>
+
+struct kvm_stats {
+    int fd;
+    uint32_t data_offset;
+    uint32_t num_desc;
+    uint32_t desc_size;
+    void *descs;
+};
+
+int kvm_stats_open(struct kvm_stats *stats, int kvm_obj_fd);
+void kvm_stats_close(struct kvm_stats *stats);
+int kvm_stats_find(struct kvm_stats *stats, const char *name);
+uint64_t kvm_stats_read(struct kvm_stats *stats, int offset);
+
+#endif /* MICROV_KVMSTATS_H */
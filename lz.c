@@ -0,0 +1,155 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	12
+#define LZ_LAST_LITERALS	5	//the format ends every block with literals
+#define LZ_MATCH_LIMIT	12	//no match may start this close to the end
+#define LZ_MAX_OFFSET	65535
+
+static inline uint32_t lz_load32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, int len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+//one sequence: literals, then a match of mlen >= LZ_MIN_MATCH unless this is the last
+static uint8_t *lz_emit(uint8_t *op, uint8_t *oend, const uint8_t *lit, int nlit,
+                        int offset, int mlen)
+{
+    uint8_t *token = op++;
+    int mcode = mlen - LZ_MIN_MATCH;
+
+    //worst case: both length tails, literals, offset
+    if (oend - op < nlit + nlit / 255 + mcode / 255 + 4)
+        return NULL;
+
+    *token = (nlit >= 15 ? 15 : nlit) << 4;
+    if (nlit >= 15)
+        op = lz_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+    *token |= mcode >= 15 ? 15 : mcode;
+    if (mcode >= 15)
+        op = lz_put_len(op, mcode - 15);
+    return op;
+}
+
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+    uint16_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    if (len > LZ_MAX_OFFSET + 1)
+        return -1;
+    memset(table, 0, sizeof(table));
+
+    while (len > LZ_MATCH_LIMIT && ip < end - LZ_MATCH_LIMIT) {
+        uint32_t seq = lz_load32(ip);
+        uint32_t h = lz_hash(seq);
+        const uint8_t *ref = src + table[h];
+        const uint8_t *mp, *rp;
+
+        table[h] = ip - src;
+        if (ref >= ip || lz_load32(ref) != seq) {
+            ip++;
+            continue;
+        }
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        mp = ip + LZ_MIN_MATCH;
+        rp = ref + LZ_MIN_MATCH;
+        while (mp < end - LZ_LAST_LITERALS && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        op = lz_emit(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+        if (!op)
+            return -1;
+        ip = anchor = mp;
+    }
+
+    op = lz_emit(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - dst : -1;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, int len)
+{
+    uint8_t b;
+
+    if (len != 15)
+        return len;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        int nlit = lz_get_len(&ip, iend, token >> 4);
+        int offset, mlen;
+
+        if (nlit < 0 || nlit > iend - ip || nlit > oend - op)
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend)
+            return op - dst;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        mlen = lz_get_len(&ip, iend, token & 15);
+        if (!offset || offset > op - dst || mlen < 0)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (mlen > oend - op)
+            return -1;
+        //overlapping matches repeat the last offset bytes
+        if (offset >= mlen) {
+            memcpy(op, op - offset, mlen);
+            op += mlen;
+        } else {
+            for (uint8_t *ref = op - offset; mlen--; )
+                *op++ = *ref++;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,14 @@
+#ifndef MICROV_LZ_H
+#define MICROV_LZ_H
+
+#include <stdint.h>
+
+/*
+ * Small LZ77 block codec in the lz4 block format, sized for single
+ * pages: inputs up to 64K. Both return the output length, -1 when the
+ * output does not fit or the input is corrupt.
+ */
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap);
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+#endif /* MICROV_LZ_H */
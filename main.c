@@ -17,146 +17,145 @@
 #include "mptable.h"
 #include "bootparams.h"
 #include "gdt.h"
-#include "vcpu.h"
+#include "cpus.h"
 #include "ioeventfd.h"
 #include "iobus.h"
 #include "serial.h"
 #include "pci.h"
 #include "virtio-blk.h"
+#include "virtio-balloon.h"
+#include "virtio-mem.h"
+#include "thread.h"
+#include "exitstat.h"
+#include "haltpoll.h"
+#include "monitor.h"
+#include "topology.h"
+#include "profile.h"
+#include "numa.h"
+#include "acpi.h"
+#include "memshare.h"
+#include "ksm.h"
+#include "coldmem.h"
+#include "prefault.h"
+#include "snapshot.h"
 
 #define KVM_API_VERSION 12
-#define VCPU_ID 0
-#define VCPU_COUNT 1
 
-#define DPRINTF(fmt, ...) \
-    do { fprintf(stderr, fmt, ## __VA_ARGS__); } while (0)
+//long-only options
+enum {
+    OPT_VCPU_AFFINITY = 256,
+    OPT_IO_AFFINITY,
+    OPT_VCPU_RT_PRIO,
+    OPT_IO_RT_PRIO,
+    OPT_MLOCK,
+    OPT_MEM_BACKEND,
+    OPT_MEM_PATH,
+    OPT_EXIT_STATS,
+    OPT_COALESCED_IO,
+    OPT_HALT_POLL_NS,
+    OPT_HALT_POLL_ADAPTIVE,
+    OPT_MONITOR,
+    OPT_KVM_PV,
+    OPT_DEDICATED,
+    OPT_CPU,
+    OPT_PROFILE,
+    OPT_PMU,
+    OPT_PROFILE_HZ,
+    OPT_PROFILE_SYMBOLS,
+    OPT_NUMA,
+    OPT_MEM_SEAL,
+    OPT_MEM_SHARE,
+    OPT_BALLOON,
+    OPT_KSM,
+    OPT_COLD_TIER,
+    OPT_MEM_HOTPLUG,
+    OPT_PREFAULT,
+    OPT_RESTORE,
+    OPT_RESTORE_LAZY,
+};
 
 struct KVMState {
     int fd;
     int vmfd;
     struct diskimg diskimg;
     struct virtio_blk_dev virtio_blk_dev;
+    struct virtio_balloon_dev virtio_balloon_dev;
+    struct virtio_mem_dev virtio_mem_dev;
 };
 
-typedef struct VCPUState {
-    int vcpu_fd;
-    struct kvm_run *kvm_run;
-} X86VCPUState;
-
 struct KVMState *kvm_state;
 
 char *kernel_file=NULL;
 char *initrd_file=NULL;
 char *disk_file = NULL;
-
-static void init_vcpu(struct VCPUState *vcpu)
-{
-    long mmap_size;
-
-    vcpu->vcpu_fd = ioctl(kvm_state->vmfd, KVM_CREATE_VCPU, VCPU_ID);
-    if (vcpu->vcpu_fd < 0) {
-        fprintf(stderr, "kvm_create_vcpu failed\n");
-    }
-    mmap_size = ioctl(kvm_state->fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (mmap_size < 0) {
-        fprintf(stderr, "KVM_GET_VCPU_MMAP_SIZE failed\n");
-    }
-    vcpu->kvm_run = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                        vcpu->vcpu_fd, 0);
-    if (vcpu->kvm_run == MAP_FAILED) {
-        fprintf(stderr, "mmap'ing vcpu state failed\n");
-    }
-}
-
-static int destroy_vcpu(struct VCPUState *vcpu)
+int vcpu_count = 1;
+int coalesced_io = 0;
+unsigned int coalesced_flush_us = 1000;
+long long halt_poll_ns = -1;
+bool halt_poll_adaptive = false;
+char *monitor_path = NULL;
+char *mem_share_path = NULL;
+char *restore_path = NULL;
+
+/*
+ * Identity map for the 64-bit entry. With 1G pages a pdpt page covers
+ * 512G and all of ram is mapped, otherwise 2M pages map the first 4G,
+ * which holds the kernel, initrd and boot structures. The kernel
+ * switches to its own tables early either way.
+ */
+static int setup_pagetable()
 {
-    int ret = 0;
-    long mmap_size;
-
-    mmap_size = ioctl(kvm_state->fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (mmap_size < 0) {
-        fprintf(stderr, "KVM_GET_VCPU_MMAP_SIZE failed\n");
+    uint64_t *pml4 = get_userspace_ptr(PML4_START, PAGE_TABLE_END - PML4_START);
+    uint64_t *pdpt = pml4 + (PDPTE_START - PML4_START) / 8;
+    uint64_t *pde = pml4 + (PDE_START - PML4_START) / 8;
+    uint64_t end = get_ram_end() > get_gap_end() ? get_ram_end() : get_gap_end();
+    uint64_t top = end, gbs, pdpts, hotplug_gpa, hotplug_size;
+    int node;
+
+    if (get_hotplug_ram(&hotplug_gpa, &hotplug_size, &node) == 0)
+        top = hotplug_gpa + hotplug_size;
+    if (top > 1ULL << vcpu_phys_bits()) {
+        fprintf(stderr, "guest ram ends above the %d-bit guest physical address space\n",
+                vcpu_phys_bits());
+        return -1;
     }
-    ret = munmap(vcpu->kvm_run, mmap_size);
-    if (ret < 0) {
-        fprintf(stderr, "munmap vcpu state failed\n");
+    memset(pml4, 0, PAGE_TABLE_END - PML4_START);
+
+    if (!vcpu_has_gbpages()) {
+        *pml4 = PDPTE_START | 0x03;
+        for (uint64_t i = 0; i < 4; i++)
+            pdpt[i] = (PDE_START + i * 0x1000) | 0x03;
+        for (uint64_t i = 0; i < 4 * 512; i++)
+            pde[i] = (i << 21) | 0x83;
+        return 0;
     }
-}
 
-static int vcpu_exec(struct VCPUState *vcpu)
-{
-    struct kvm_run *run = vcpu->kvm_run;
-    int ret, run_ret;
-    do{
-        //sleep(1);
-        run_ret = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
-        if (run_ret < 0) {
-            fprintf(stderr, "error: kvm run failed %s\n",
-                    strerror(-run_ret));
-            ret = -1;
-            break;
-        }
-        switch (run->exit_reason) {
-        case KVM_EXIT_HLT:
-	    DPRINTF("hlt\n");
-            return 0;
-        case KVM_EXIT_IO:
-            iobus_handle_pio(run);
-            ret = 0;
-            break;
-        case KVM_EXIT_MMIO:
-            iobus_handle_mmio(run);
-            ret = 0;
-            break;
-        case KVM_EXIT_IRQ_WINDOW_OPEN:
-            DPRINTF("irq_window_open\n");
-            ret = -1;
-            break;
-        case KVM_EXIT_SHUTDOWN:
-            DPRINTF("shutdown\n");
-            ret = -1;
-            break;
-        case KVM_EXIT_UNKNOWN:
-            fprintf(stderr, "KVM: unknown exit, hardware reason  %" PRIx64 "\n",
-                    (uint64_t)run->hw.hardware_exit_reason);
-            ret = -1;
-            break;
-        case KVM_EXIT_INTERNAL_ERROR:
-            DPRINTF("internal_error\n");
-            break;
-        case KVM_EXIT_SYSTEM_EVENT:
-            DPRINTF("system_event\n");
-            break;
-        default:
-            DPRINTF("kvm_arch_handle_exit:%d\n",run->exit_reason);
-            break;
-        }
-    }while (ret == 0);
-    return ret;
-}
-
-static void *vcpu_thread_fn(void *arg)
-{
-    struct VCPUState *cpu = arg;
-    vcpu_exec(cpu);
-    destroy_vcpu(cpu);
-}
-
-static void setup_pagetable() { 
-    *(uint64_t *)get_userspace_addr(PML4_START) = PDPTE_START | 0x03;
-    *(uint64_t *)get_userspace_addr(PDPTE_START) = PDE_START | 0x03;
-    for (int i=0;i<512;i++) {
-        *(uint64_t *)get_userspace_addr(PDE_START + i * 8) = (i << 21) + 0x83;
+    gbs = (end + (1ULL << 30) - 1) >> 30;
+    pdpts = (gbs + 511) / 512;
+    if (pdpts > (PAGE_TABLE_END - PDPTE_START) / 0x1000) {
+        fprintf(stderr, "guest ram too large for the boot page tables\n");
+        return -1;
     }
+    for (uint64_t i = 0; i < pdpts; i++)
+        pml4[i] = (PDPTE_START + i * 0x1000) | 0x03;
+    //the pdpt pages are contiguous, entry i maps the i-th 1G
+    for (uint64_t i = 0; i < gbs; i++)
+        pdpt[i] = (i << 30) | 0x83;
+    return 0;
 }
 
-static void init_linux_boot() { 
-    setup_pagetable();
-    setup_mptable(VCPU_COUNT);
+static int init_linux_boot() {
+    if (setup_pagetable() < 0)
+        return -1;
+    setup_mptable(vcpu_count);
     setup_cmdline();
-    setup_boot_params(kernel_file, initrd_file);
+    if (setup_boot_params(kernel_file, initrd_file) < 0)
+        return -1;
+    if (numa_enabled())
+        setup_acpi(vcpu_count);
     setup_gdt();
     setup_idt();
+    return 0;
 }
 
 static void create_base_dev()
@@ -192,14 +191,44 @@ static void usage(const char *execpath)
     print_option("-k, --kernel kernel_file", "input the kernel file\n");
     print_option("-i, --initrd initrd_file", "input the initrd file\n");
     print_option("-d, --disk disk_file", "input the disk file\n");
+    print_option("-s, --smp num[,sockets=s,cores=c,threads=t]", "number of vcpus and their topology, default 1\n");
+    print_option("--vcpu-affinity cpulist", "pin vcpu N to the N-th host cpu of the list, e.g. 2-5\n");
+    print_option("--io-affinity cpulist", "run ioeventfd and serial threads on these host cpus\n");
+    print_option("--vcpu-rt-prio prio", "run vcpu threads under SCHED_FIFO with this priority\n");
+    print_option("--io-rt-prio prio", "run io threads under SCHED_FIFO with this priority\n");
+    print_option("-m, --memory size", "guest ram, K/M/G suffixes, default 512M\n");
+    print_option("--mem-backend type", "anon, thp, hugetlb-2M, hugetlb-1G or memfd, default anon\n");
+    print_option("--mem-path dir", "hugetlbfs mount for the hugetlb backends, anonymous huge pages without it\n");
+    print_option("--numa mem=size[,cpus=list][,host-node=n]", "add a guest numa node, repeat per node; mem is bound to host node n\n");
+    print_option("--mem-seal", "seal the memfd size so sharers can not shrink or grow it\n");
+    print_option("--mem-share socket_path", "hand guest ram fds and layout to helpers connecting to a unix socket\n");
+    print_option("--mem-hotplug size[,block=size][,node=n]", "virtio-mem region above ram, grown and shrunk with the monitor mem command\n");
+    print_option("--balloon[=lazy]", "virtio balloon with stats and free page reporting, lazy frees with MADV_FREE\n");
+    print_option("--ksm[=process]", "let ksm merge identical guest pages, process also merges all other anonymous memory\n");
+    print_option("--cold-tier[=seconds]", "compress guest pages unwritten for seconds (default 300), fault them back on access\n");
+    print_option("--prefault[=threads]", "populate guest ram with threads (default one per host cpu) while the kernel loads\n");
+    print_option("--mlock", "lock guest memory, it is never paged out\n");
+    print_option("--exit-stats", "count and time vcpu exits, dumped on SIGUSR1 and at exit\n");
+    print_option("--coalesced-io[=usec]", "batch serial THR and virtio common cfg writes, flushed every usec (default 1000)\n");
+    print_option("--halt-poll-ns ns", "max time a halted vcpu polls before sleeping, 0 disables\n");
+    print_option("--halt-poll-adaptive", "tune the poll limit up to --halt-poll-ns from poll success\n");
+    print_option("--kvm-pv features", "kvm pv features offered to the guest: all (default), none or a list of\n"
+                 "                 clock,steal,eoi,tlbflush,yield,asyncpf,ipi,unhalt,nopiodelay\n");
+    print_option("--cpu model", "cpuid template: host, baseline or minimal, default host\n");
+    print_option("--pmu[=counters]", "expose a virtual pmu for in-guest perf, off by default\n");
+    print_option("--dedicated[=exits]", "vcpus own their host cores: hlt,pause,mwait,cstate stay in the guest (default all)\n");
+    print_option("--profile file", "sample guest stacks, write folded stacks to file at exit\n");
+    print_option("--profile-hz hz", "samples per second and vcpu, default 99\n");
+    print_option("--profile-symbols file", "System.map or vmlinux to symbolize guest stacks\n");
+    print_option("--restore path", "resume the snapshot at path instead of booting, with the options it was taken with\n");
+    print_option("--restore-lazy[=threads]", "run the restored guest at once, fault ram in from the snapshot, prefetch threads (0 for none) fill the rest\n");
+    print_option("--monitor socket_path", "accept control commands (pause, resume, stats, ...) on a unix socket\n");
     print_option("-h, --help", "Print help\n");
 }
 
 int main(int argc, char **argv) {
     int ret;
     kvm_state = malloc(sizeof(struct KVMState));
-    struct VCPUState *vcpu = malloc(sizeof(struct VCPUState));
-    pthread_t vcpu_thread;
 
     int c;
     int option_index = 0;
@@ -207,9 +236,41 @@ int main(int argc, char **argv) {
         {"kernel", required_argument, NULL, 'k'},
         {"initrd", required_argument, NULL, 'i'},
         {"disk", required_argument, NULL, 'd'},
+        {"smp", required_argument, NULL, 's'},
+        {"vcpu-affinity", required_argument, NULL, OPT_VCPU_AFFINITY},
+        {"io-affinity", required_argument, NULL, OPT_IO_AFFINITY},
+        {"vcpu-rt-prio", required_argument, NULL, OPT_VCPU_RT_PRIO},
+        {"io-rt-prio", required_argument, NULL, OPT_IO_RT_PRIO},
+        {"mlock", no_argument, NULL, OPT_MLOCK},
+        {"memory", required_argument, NULL, 'm'},
+        {"mem-backend", required_argument, NULL, OPT_MEM_BACKEND},
+        {"mem-path", required_argument, NULL, OPT_MEM_PATH},
+        {"exit-stats", no_argument, NULL, OPT_EXIT_STATS},
+        {"coalesced-io", optional_argument, NULL, OPT_COALESCED_IO},
+        {"halt-poll-ns", required_argument, NULL, OPT_HALT_POLL_NS},
+        {"halt-poll-adaptive", no_argument, NULL, OPT_HALT_POLL_ADAPTIVE},
+        {"monitor", required_argument, NULL, OPT_MONITOR},
+        {"kvm-pv", required_argument, NULL, OPT_KVM_PV},
+        {"dedicated", optional_argument, NULL, OPT_DEDICATED},
+        {"cpu", required_argument, NULL, OPT_CPU},
+        {"profile", required_argument, NULL, OPT_PROFILE},
+        {"pmu", optional_argument, NULL, OPT_PMU},
+        {"profile-hz", required_argument, NULL, OPT_PROFILE_HZ},
+        {"profile-symbols", required_argument, NULL, OPT_PROFILE_SYMBOLS},
+        {"numa", required_argument, NULL, OPT_NUMA},
+        {"mem-seal", no_argument, NULL, OPT_MEM_SEAL},
+        {"mem-share", required_argument, NULL, OPT_MEM_SHARE},
+        {"balloon", optional_argument, NULL, OPT_BALLOON},
+        {"ksm", optional_argument, NULL, OPT_KSM},
+        {"cold-tier", optional_argument, NULL, OPT_COLD_TIER},
+        {"mem-hotplug", required_argument, NULL, OPT_MEM_HOTPLUG},
+        {"prefault", optional_argument, NULL, OPT_PREFAULT},
+        {"restore", required_argument, NULL, OPT_RESTORE},
+        {"restore-lazy", optional_argument, NULL, OPT_RESTORE_LAZY},
         {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
     };
-    while ((c = getopt_long(argc, argv, "k:i:d:h", opts, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "k:i:d:s:m:h", opts, &option_index)) != -1) {
         switch (c) {
         case 'k':
             kernel_file = optarg;
@@ -220,6 +281,125 @@ int main(int argc, char **argv) {
         case 'd':
             disk_file = optarg;
             break;
+        case 's':
+            vcpu_count = parse_smp(optarg);
+            if (vcpu_count < 0)
+                return -1;
+            break;
+        case OPT_VCPU_AFFINITY:
+            if (thread_set_affinity(ThreadVcpu, optarg) < 0)
+                return -1;
+            break;
+        case OPT_IO_AFFINITY:
+            if (thread_set_affinity(ThreadIo, optarg) < 0)
+                return -1;
+            break;
+        case OPT_VCPU_RT_PRIO:
+            if (thread_set_rt_prio(ThreadVcpu, atoi(optarg)) < 0)
+                return -1;
+            break;
+        case OPT_IO_RT_PRIO:
+            if (thread_set_rt_prio(ThreadIo, atoi(optarg)) < 0)
+                return -1;
+            break;
+        case OPT_MLOCK:
+            mem_opts.lock = true;
+            break;
+        case 'm':
+            if (parse_mem_size(optarg) < 0)
+                return -1;
+            break;
+        case OPT_MEM_BACKEND:
+            if (parse_mem_backend(optarg) < 0)
+                return -1;
+            break;
+        case OPT_MEM_PATH:
+            mem_opts.path = optarg;
+            break;
+        case OPT_EXIT_STATS:
+            exit_stats_enabled = true;
+            break;
+        case OPT_COALESCED_IO:
+            coalesced_io = 1;
+            //without the flush thread a queued THR write holds back its THRE irq until some other exit
+            if (optarg && atoi(optarg) <= 0) {
+                fprintf(stderr, "--coalesced-io needs a flush period above 0 usec\n");
+                return -1;
+            }
+            if (optarg)
+                coalesced_flush_us = atoi(optarg);
+            break;
+        case OPT_HALT_POLL_NS:
+            halt_poll_ns = atoll(optarg);
+            break;
+        case OPT_HALT_POLL_ADAPTIVE:
+            halt_poll_adaptive = true;
+            break;
+        case OPT_MONITOR:
+            monitor_path = optarg;
+            break;
+        case OPT_KVM_PV:
+            if (parse_kvm_pv_features(optarg) < 0)
+                return -1;
+            break;
+        case OPT_DEDICATED:
+            if (parse_disable_exits(optarg) < 0)
+                return -1;
+            break;
+        case OPT_CPU:
+            if (parse_cpu_model(optarg) < 0)
+                return -1;
+            break;
+        case OPT_PMU:
+            if (parse_pmu(optarg) < 0)
+                return -1;
+            break;
+        case OPT_PROFILE:
+            profile_opts.path = optarg;
+            break;
+        case OPT_PROFILE_HZ:
+            profile_opts.hz = atoi(optarg);
+            break;
+        case OPT_PROFILE_SYMBOLS:
+            profile_opts.symbols = optarg;
+            break;
+        case OPT_MEM_SEAL:
+            mem_opts.seal = true;
+            break;
+        case OPT_MEM_SHARE:
+            mem_share_path = optarg;
+            break;
+        case OPT_BALLOON:
+            if (parse_balloon(optarg) < 0)
+                return -1;
+            break;
+        case OPT_KSM:
+            if (parse_ksm(optarg) < 0)
+                return -1;
+            break;
+        case OPT_COLD_TIER:
+            if (parse_cold_tier(optarg) < 0)
+                return -1;
+            break;
+        case OPT_MEM_HOTPLUG:
+            if (parse_mem_hotplug(optarg) < 0)
+                return -1;
+            break;
+        case OPT_PREFAULT:
+            if (parse_prefault(optarg) < 0)
+                return -1;
+            break;
+        case OPT_RESTORE:
+            restore_path = optarg;
+            break;
+        case OPT_RESTORE_LAZY:
+            if (parse_restore_lazy(optarg) < 0)
+                return -1;
+            break;
+        case OPT_NUMA:
+            if (parse_numa(optarg) < 0)
+                return -1;
+            break;
         case 'h':
             usage(argv[0]);
             exit(1);
@@ -227,11 +407,37 @@ int main(int argc, char **argv) {
             break;
         }
     }
-    if(!kernel_file || !initrd_file) {
+    if (halt_poll_adaptive && halt_poll_ns <= 0) {
+        fprintf(stderr, "--halt-poll-adaptive needs --halt-poll-ns\n");
+        return -1;
+    }
+    if (thread_check_vcpu_affinity(vcpu_count) < 0)
+        return -1;
+    if (balloon_opts.enabled && mem_opts.lock) {
+        fprintf(stderr, "--balloon can not free --mlock memory\n");
+        return -1;
+    }
+    if (restore_opts.lazy && !restore_path) {
+        fprintf(stderr, "--restore-lazy needs --restore\n");
+        return -1;
+    }
+    if (restore_opts.lazy && (mem_opts.lock || prefault_threads || cold_tier_secs)) {
+        fprintf(stderr, "--restore-lazy can not be combined with --mlock, --prefault or --cold-tier\n");
+        return -1;
+    }
+    if (!restore_path && (!kernel_file || !initrd_file)) {
         fprintf(stderr, "Must input kernel and initrd file\n");
         return -1;
     }
 
+    if (numa_init(vcpu_count) < 0) {
+        return -1;
+    }
+
+    if (exit_stats_enabled && exit_stats_init() < 0) {
+        return -1;
+    }
+
     //open kvm device
     kvm_state->fd = open("/dev/kvm", O_RDWR);
     if (kvm_state->fd < 0) {
@@ -258,21 +464,49 @@ int main(int argc, char **argv) {
 
     //Init kvm_based vm devices
     create_base_dev();
+    snapshot_init(kvm_state->vmfd);
 
     //init ram
-    init_memory_map(kvm_state->vmfd, RAM_SIZE);
+    if (init_memory_map(kvm_state->vmfd, mem_opts.size) < 0) {
+        return -1;
+    }
+    if (mem_share_path && memshare_init(mem_share_path) < 0) {
+        return -1;
+    }
+    if (ksm_init() < 0) {
+        return -1;
+    }
+    if (coldmem_init() < 0) {
+        return -1;
+    }
+    //runs in the background until the vcpus start
+    if (prefault_start() < 0) {
+        return -1;
+    }
 
     //init vcpu
-    init_vcpu(vcpu);
+    if (cpus_init(kvm_state->fd, kvm_state->vmfd, vcpu_count) < 0) {
+        return -1;
+    }
+    if (halt_poll_ns >= 0 &&
+        halt_poll_init(kvm_state->vmfd, halt_poll_ns, halt_poll_adaptive) < 0) {
+        return -1;
+    }
 
-    //run linux boot
-    init_linux_boot();
+    //run linux boot, a restored guest finds everything in its ram
+    if (!restore_path && init_linux_boot() < 0) {
+        return -1;
+    }
 
     //ioevent
     ioeventfd_init(kvm_state->vmfd);
 
     //ioregion
-    iobus_init();
+    iobus_init(kvm_state->vmfd);
+    if (coalesced_io &&
+        iobus_coalesced_init(get_vcpu(0)->vcpu_fd, coalesced_flush_us) < 0) {
+        return -1;
+    }
     pcibus_init();
 
     //create serial dev
@@ -289,22 +523,43 @@ int main(int argc, char **argv) {
                             &kvm_state->virtio_blk_dev,
                             &kvm_state->diskimg);
     }
+    if (balloon_opts.enabled) {
+        virtio_balloon_init_pci(kvm_state->vmfd, &kvm_state->virtio_balloon_dev);
+    }
+    if (mem_opts.hotplug_size &&
+        virtio_mem_init_pci(kvm_state->vmfd, &kvm_state->virtio_mem_dev) < 0) {
+        return -1;
+    }
+
+    if (restore_path && snapshot_restore(restore_path) < 0) {
+        return -1;
+    }
 
     //vcpu run
-    setup_vcpu(kvm_state->fd, vcpu->vcpu_fd, VCPU_COUNT, VCPU_ID);
-    reset_vcpu(kvm_state->fd, vcpu->vcpu_fd, VCPU_COUNT, VCPU_ID);
-    if (pthread_create(&(vcpu_thread), (const pthread_attr_t *)NULL,
-                        vcpu_thread_fn, vcpu) != 0) {
-        fprintf(stderr, "can not create kvm cpu thread");
+    if (profile_init() < 0) {
+        exit(1);
+    }
+    prefault_wait();
+    if (cpus_start() < 0) {
+        exit(1);
+    }
+    if (monitor_path && monitor_init(monitor_path) < 0) {
         exit(1);
     }
-    pthread_join(vcpu_thread, NULL);
+    cpus_wait();
+    exit_stats_dump(stderr);
+    halt_poll_dump(stderr);
+    ksm_dump(stderr);
+    coldmem_dump(stderr);
+    virtio_mem_dump(stderr);
+    snapshot_dump(stderr);
+    profile_exit();
 
     //exit
-    close(vcpu->vcpu_fd);
+    exit_stats_exit();
+    cpus_exit();
     close(kvm_state->vmfd);
     close(kvm_state->fd);
-    free(vcpu);
     free(kvm_state);
 }
 
@@ -1,24 +1,23 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/vfs.h>
 #include <linux/kvm.h>
+#include <linux/magic.h>
 
 #include "global.h"
 #include "memory.h"
 #include "string.h"
-
-typedef struct KVMSlot
-{
-    uint64_t start_addr;
-    uint64_t memory_size;
-    void *ram;
-    int slot;
-    int flags;
-} KVMSlot;
+#include "numa.h"
+#include "coldmem.h"
 
 enum MemLayoutType
 {
@@ -38,53 +37,552 @@ const uint64_t MemLayout[MemLayoutEnd][2] = {
     {0x100000000,                 0x8000000000  }   // MemAbove4g
 };
 
+//kernel, initrd and boot structures all sit in the first 64M
+#define RAM_SIZE_MIN	0x4000000
+#define HPAGE_2M	0x200000ULL
+#define HPAGE_1G	0x40000000ULL
+
+//see kernel include/uapi/asm-generic/hugetlb_encode.h
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB	(21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB	(30 << MAP_HUGE_SHIFT)
+#endif
+
+struct mem_opts mem_opts = {
+    .size = RAM_SIZE,
+};
+
+static const struct {
+    const char *name;
+    uint64_t page_size;
+} mem_backends[MemBackendEnd] = {
+    [MemBackendAnon]      = {"anon",       0},
+    [MemBackendThp]       = {"thp",        HPAGE_2M},
+    [MemBackendHugetlb2M] = {"hugetlb-2M", HPAGE_2M},
+    [MemBackendHugetlb1G] = {"hugetlb-1G", HPAGE_1G},
+    [MemBackendMemfd]     = {"memfd",      0},
+};
+
+//"512M", "4G", "1048576K" or plain bytes
+int parse_size(const char *arg, uint64_t *size)
+{
+    char *end;
+
+    *size = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'G': case 'g':
+        *size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        *size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        *size <<= 10;
+        end++;
+        break;
+    }
+    return (*end || end == arg) ? -1 : 0;
+}
+
+int parse_mem_size(const char *arg)
+{
+    uint64_t size;
+
+    if (parse_size(arg, &size) < 0 || size < RAM_SIZE_MIN) {
+        fprintf(stderr, "invalid memory size %s, minimum is %dM\n",
+                arg, RAM_SIZE_MIN >> 20);
+        return -1;
+    }
+    mem_opts.size = size;
+    return 0;
+}
+
+int parse_mem_backend(const char *name)
+{
+    for (int i = 0; i < MemBackendEnd; i++) {
+        if (!strcmp(name, mem_backends[i].name)) {
+            mem_opts.backend = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "unknown memory backend %s\n", name);
+    return -1;
+}
+
+//"4G,block=2M,node=1", the hotplug region size and where it plugs
+int parse_mem_hotplug(const char *arg)
+{
+    char buf[256];
+    char *save = NULL;
+    char *tok;
+
+    if (strlen(arg) >= sizeof(buf))
+        goto err;
+    strcpy(buf, arg);
+
+    tok = strtok_r(buf, ",", &save);
+    if (!tok || parse_size(tok, &mem_opts.hotplug_size) < 0 || !mem_opts.hotplug_size)
+        goto err;
+    while ((tok = strtok_r(NULL, ",", &save))) {
+        char *val = strchr(tok, '=');
+        char *end;
+
+        if (!val)
+            goto err;
+        *val++ = '\0';
+        if (!strcmp(tok, "block")) {
+            if (parse_size(val, &mem_opts.hotplug_block) < 0)
+                goto err;
+        } else if (!strcmp(tok, "node")) {
+            mem_opts.hotplug_node = strtol(val, &end, 10);
+            if (*end || mem_opts.hotplug_node < 0)
+                goto err;
+        } else {
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    fprintf(stderr, "invalid memory hotplug region %s\n", arg);
+    return -1;
+}
+
+//an unlinked file on the hugetlbfs mount, it goes away with the last fd and mapping
+static void *alloc_hugetlb_file(uint64_t size, uint64_t page_size, int *ram_fd)
+{
+    char path[4096];
+    struct statfs fs;
+    void *ram;
+    int fd;
+
+    if (statfs(mem_opts.path, &fs) < 0 || fs.f_type != HUGETLBFS_MAGIC) {
+        fprintf(stderr, "%s is not a hugetlbfs mount\n", mem_opts.path);
+        return MAP_FAILED;
+    }
+    if (fs.f_bsize != page_size) {
+        fprintf(stderr, "%s has %ldK pages, want %lluK\n", mem_opts.path,
+                (long)fs.f_bsize >> 10, (unsigned long long)page_size >> 10);
+        return MAP_FAILED;
+    }
+
+    snprintf(path, sizeof(path), "%s/microv-XXXXXX", mem_opts.path);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "create %s failed\n", path);
+        return MAP_FAILED;
+    }
+    unlink(path);
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "size hugetlb file failed\n");
+        close(fd);
+        return MAP_FAILED;
+    }
+    ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED)
+        close(fd);
+    else
+        *ram_fd = fd;
+    return ram;
+}
+
+/*
+ * Shared memory with no name in any filesystem, other processes get at it
+ * only through the fd. Sealed, neither side can resize it under the
+ * other's mappings.
+ */
+static void *alloc_memfd(uint64_t size, int *ram_fd)
+{
+    void *ram;
+    int fd;
+
+    fd = memfd_create("microv-ram", MFD_CLOEXEC | (mem_opts.seal ? MFD_ALLOW_SEALING : 0));
+    if (fd < 0) {
+        fprintf(stderr, "memfd_create failed\n");
+        return MAP_FAILED;
+    }
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "size memfd failed\n");
+        close(fd);
+        return MAP_FAILED;
+    }
+    if (mem_opts.seal &&
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        fprintf(stderr, "seal memfd failed\n");
+        close(fd);
+        return MAP_FAILED;
+    }
+    ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (ram == MAP_FAILED)
+        close(fd);
+    else
+        *ram_fd = fd;
+    return ram;
+}
+
+/*
+ * Backing for one slot. Huge pages only help if guest physical and host
+ * virtual addresses agree modulo the page size. Slots start at 0, 4G or
+ * a numa node boundary, and numa_init keeps node sizes whole backend
+ * pages, so aligning the host side is enough.
+ */
+static void *alloc_guest_ram(uint64_t size, int *ram_fd)
+{
+    uint64_t page_size = mem_backends[mem_opts.backend].page_size;
+    int huge_flag = 0;
+    uint8_t *ram, *aligned;
+
+    switch (mem_opts.backend) {
+    case MemBackendThp:
+        ram = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ram == MAP_FAILED)
+            return MAP_FAILED;
+        aligned = (uint8_t *)(((uint64_t)ram + page_size - 1) & ~(page_size - 1));
+        if (aligned > ram)
+            munmap(ram, aligned - ram);
+        munmap(aligned + size, ram + page_size - aligned);
+        if (madvise(aligned, size, MADV_HUGEPAGE) < 0)
+            fprintf(stderr, "madvise hugepage failed, check transparent_hugepage\n");
+        return aligned;
+    case MemBackendHugetlb2M:
+    case MemBackendHugetlb1G:
+        if (mem_opts.path)
+            return alloc_hugetlb_file(size, page_size, ram_fd);
+        huge_flag = MAP_HUGETLB |
+                    (mem_opts.backend == MemBackendHugetlb1G ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+        return mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | huge_flag, -1, 0);
+    case MemBackendMemfd:
+        return alloc_memfd(size, ram_fd);
+    default:
+        return mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+}
+
+/*
+ * Guest memory map, sorted by guest physical address. Lookups try the
+ * slot the calling thread hit last before bisecting, device threads
+ * walk one buffer at a time and mostly stay inside one slot. Slots are
+ * only added at setup, before any vcpu or device thread looks them up.
+ */
+struct mem_slot {
+    struct kvm_userspace_memory_region region;
+    int node;
+    int fd;         //backing file from offset 0, -1 for private anonymous ram
+};
+
 static uint64_t RamSize;
-static struct kvm_userspace_memory_region MemMapper[2];
+static int VmFd = -1;
+static struct mem_slot *MemMapper;
+static int NrSlots;
+static int MaxSlots;
+static __thread int LastSlot;
+static uint64_t HotplugGpa;
+
+struct ram_range {
+    uint64_t gpa;
+    uint64_t size;
+    int node;
+};
+
+//one range per numa node, plus one for the node split by the pci hole
+#define RAM_RANGES_MAX	(NUMA_NODES_MAX + 1)
+
+/*
+ * Lay guest ram out from gpa 0 in node order, skipping the 32-bit pci
+ * hole. Every node gets its own slots so it can be bound on its own, a
+ * node straddling the hole takes one slot on each side.
+ */
+static int split_ram(uint64_t ram_size, struct ram_range *ranges)
+{
+    uint64_t gap_start = MemLayout[MemBelow4g][0] + MemLayout[MemBelow4g][1];
+    uint64_t gap_end = MemLayout[MemAbove4g][0];
+    uint64_t offset = 0;
+    int n = 0;
+    int nodes = nr_numa_nodes ? nr_numa_nodes : 1;
+
+    for (int node = 0; node < nodes; node++) {
+        uint64_t left = nr_numa_nodes ? numa_nodes[node].size : ram_size;
+
+        while (left) {
+            uint64_t chunk = left;
+
+            if (offset < gap_start && chunk > gap_start - offset)
+                chunk = gap_start - offset;
+            ranges[n].gpa = offset < gap_start ? offset : offset - gap_start + gap_end;
+            ranges[n].size = chunk;
+            ranges[n].node = node;
+            n++;
+            offset += chunk;
+            left -= chunk;
+        }
+    }
+    return n;
+}
+
+//register [gpa, gpa + size) at host with kvm, keeping the map sorted
+static int add_mem_slot(uint64_t gpa, uint64_t size, void *host, int fd, int node)
+{
+    struct mem_slot *slots;
+    int i;
+
+    if (!MaxSlots) {
+        MaxSlots = ioctl(VmFd, KVM_CHECK_EXTENSION, KVM_CAP_NR_MEMSLOTS);
+        if (MaxSlots <= 0)
+            MaxSlots = 32;      //the oldest kvm limit
+    }
+    if (NrSlots == MaxSlots) {
+        fprintf(stderr, "kvm supports %d memory slots only\n", MaxSlots);
+        return -1;
+    }
+    slots = realloc(MemMapper, (NrSlots + 1) * sizeof(*slots));
+    if (!slots) {
+        fprintf(stderr, "memory slot allocation failed\n");
+        return -1;
+    }
+    MemMapper = slots;
+
+    for (i = NrSlots; i > 0 && slots[i - 1].region.guest_phys_addr > gpa; i--)
+        slots[i] = slots[i - 1];
+    slots[i] = (struct mem_slot) {
+        .region = {
+            .slot = NrSlots,
+            .guest_phys_addr = gpa,
+            .memory_size = size,
+            .userspace_addr = (uint64_t)host,
+        },
+        .node = node,
+        .fd = fd,
+    };
+    NrSlots++;
+    if (ioctl(VmFd, KVM_SET_USER_MEMORY_REGION, &slots[i].region) < 0) {
+        fprintf(stderr, "set user memory region failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The virtio-mem region, one slot 1G aligned above ram and the pci hole.
+ * It is registered whole up front, nothing is faulted in before the
+ * guest plugs and touches a block.
+ */
+static int init_hotplug_ram()
+{
+    uint64_t page_size = mem_backends[mem_opts.backend].page_size;
+    uint64_t block = mem_opts.hotplug_block;
+    uint64_t size = mem_opts.hotplug_size;
+    int node = mem_opts.hotplug_node;
+    int fd = -1;
+    void *ram;
+
+    if (!block)
+        block = page_size > HPAGE_2M ? page_size : HPAGE_2M;
+    if ((block & (block - 1)) || block < page_size || block < 0x1000 || (size & (block - 1))) {
+        fprintf(stderr, "hotplug region must be whole blocks, of a power of two no smaller than the page\n");
+        return -1;
+    }
+    if (node >= (nr_numa_nodes ? nr_numa_nodes : 1)) {
+        fprintf(stderr, "hotplug region node %d does not exist\n", node);
+        return -1;
+    }
+    if (mem_opts.lock) {
+        fprintf(stderr, "--mem-hotplug can not unplug --mlock memory\n");
+        return -1;
+    }
+    mem_opts.hotplug_block = block;
+
+    HotplugGpa = get_ram_end() > get_gap_end() ? get_ram_end() : get_gap_end();
+    HotplugGpa = (HotplugGpa + HPAGE_1G - 1) & ~(HPAGE_1G - 1);
+    ram = alloc_guest_ram(size, &fd);
+    if (ram == MAP_FAILED) {
+        fprintf(stderr, "mmap hotplug ram failed, %s backend\n",
+                mem_backends[mem_opts.backend].name);
+        return -1;
+    }
+    if (numa_bind(ram, size, node) < 0)
+        return -1;
+    return add_mem_slot(HotplugGpa, size, ram, fd, node);
+}
 
 int init_memory_map(int vmfd, uint64_t ram_size)
 {
-    int ret;
     RamSize = ram_size;
-    uint64_t rams[2][2] = {0};
-    uint64_t gap_start = MemLayout[MemBelow4g][0] + MemLayout[MemBelow4g][1];
+    VmFd = vmfd;
+    struct ram_range rams[RAM_RANGES_MAX];
+    uint64_t page_size = mem_backends[mem_opts.backend].page_size;
+    int nr_rams;
 
-    rams[0][0] = 0;
-    if(ram_size <= gap_start) {
-        rams[0][1] = ram_size;
+    if ((mem_opts.backend == MemBackendHugetlb2M || mem_opts.backend == MemBackendHugetlb1G) &&
+        (ram_size & (page_size - 1))) {
+        fprintf(stderr, "memory size must be a multiple of the %s page\n",
+                mem_backends[mem_opts.backend].name);
+        return -1;
     }
-    else {
-        uint64_t gap_end = MemLayout[MemAbove4g][0];
-        rams[0][1] = gap_start;
-        rams[1][0] = gap_end;
-        rams[1][1] = ram_size - gap_start;
-    }
-
-    for(int i=0;i<2;i++) {
-        if(rams[i][1]<=0) continue;
-        struct KVMSlot *slot = malloc(sizeof(struct KVMSlot));
-        slot->memory_size = rams[i][1];
-        slot->start_addr = rams[i][0];
-        slot->slot = i;
-        slot->flags = 0;
-        slot->ram = mmap(NULL, slot->memory_size, PROT_READ | PROT_WRITE,
-                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
-                                  -1, 0);
-        if ((void *)slot->ram == MAP_FAILED) {
-            fprintf(stderr, "mmap vm ram failed\n");
+    if (mem_opts.seal && mem_opts.backend != MemBackendMemfd) {
+        fprintf(stderr, "--mem-seal needs the memfd backend\n");
+        return -1;
+    }
+
+    nr_rams = split_ram(ram_size, rams);
+    for(int i=0;i<nr_rams;i++) {
+        int fd = -1;
+        void *ram = alloc_guest_ram(rams[i].size, &fd);
+
+        if (ram == MAP_FAILED) {
+            fprintf(stderr, "mmap vm ram failed, %s backend\n",
+                    mem_backends[mem_opts.backend].name);
             return -1;
         }
+        if (numa_bind(ram, rams[i].size, rams[i].node) < 0) {
+            return -1;
+        }
+        //fault in and pin the whole slot, the guest never takes a host page fault
+        if (mem_opts.lock && mlock(ram, rams[i].size) < 0) {
+            fprintf(stderr, "mlock vm ram failed, check RLIMIT_MEMLOCK\n");
+            return -1;
+        }
+        if (add_mem_slot(rams[i].gpa, rams[i].size, ram, fd, rams[i].node) < 0)
+            return -1;
+    }
+    if (mem_opts.hotplug_size && init_hotplug_ram() < 0)
+        return -1;
+    return 0;
+}
+
+//guest ram slot i in gpa order, -1 past the last one
+int get_ram_slot(int i, uint64_t *gpa, uint64_t *size, int *node)
+{
+    if (i < 0 || i >= NrSlots)
+        return -1;
+    *gpa = MemMapper[i].region.guest_phys_addr;
+    *size = MemMapper[i].region.memory_size;
+    *node = MemMapper[i].node;
+    return 0;
+}
+
+//fd backing slot i from offset 0, -1 for private anonymous ram
+int get_ram_slot_fd(int i)
+{
+    if (i < 0 || i >= NrSlots)
+        return -1;
+    return MemMapper[i].fd;
+}
 
-        MemMapper[i].flags = slot->flags;
-        MemMapper[i].slot = slot->slot;
-        MemMapper[i].guest_phys_addr =  slot->start_addr;
-        MemMapper[i].memory_size = slot->memory_size;
-        MemMapper[i].userspace_addr = (uint64_t)slot->ram;
-        ret = ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &(MemMapper[i]));
-        if (ret < 0) {
-            fprintf(stderr, "set user memory region failed\n");
+//the virtio-mem region, -1 without one
+int get_hotplug_ram(uint64_t *gpa, uint64_t *size, int *node)
+{
+    if (!HotplugGpa)
+        return -1;
+    *gpa = HotplugGpa;
+    *size = mem_opts.hotplug_size;
+    *node = mem_opts.hotplug_node;
+    return 0;
+}
+
+//kvm tracks guest writes per 4k page on every ram slot
+int set_ram_dirty_log(bool enable)
+{
+    for (int i = 0; i < NrSlots; i++) {
+        struct kvm_userspace_memory_region *region = &MemMapper[i].region;
+
+        if (enable)
+            region->flags |= KVM_MEM_LOG_DIRTY_PAGES;
+        else
+            region->flags &= ~KVM_MEM_LOG_DIRTY_PAGES;
+        if (ioctl(VmFd, KVM_SET_USER_MEMORY_REGION, region) < 0) {
+            fprintf(stderr, "set dirty logging failed\n");
             return -1;
         }
     }
+    return 0;
+}
+
+//pages of slot i written since the last call, one bit per 4k page
+int get_ram_dirty_log(int i, uint64_t *bitmap)
+{
+    struct kvm_dirty_log log = {
+        .dirty_bitmap = bitmap,
+    };
+
+    if (i < 0 || i >= NrSlots)
+        return -1;
+    log.slot = MemMapper[i].region.slot;
+    return ioctl(VmFd, KVM_GET_DIRTY_LOG, &log);
+}
+
+//index of the slot backing gpa, -1 if none does
+static int find_slot(uint64_t gpa)
+{
+    int lo = 0, hi = NrSlots - 1;
+    int last = LastSlot;
+
+    if (last < NrSlots &&
+        gpa - MemMapper[last].region.guest_phys_addr < MemMapper[last].region.memory_size)
+        return last;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        struct kvm_userspace_memory_region *region = &MemMapper[mid].region;
+
+        if (gpa < region->guest_phys_addr) {
+            hi = mid - 1;
+        } else if (gpa - region->guest_phys_addr >= region->memory_size) {
+            lo = mid + 1;
+        } else {
+            LastSlot = mid;
+            return mid;
+        }
+    }
+    return -1;
+}
+
+//smallest unit the host maps guest ram in, thp can always split to 4k
+uint64_t get_ram_page_size()
+{
+    uint64_t page_size = mem_backends[mem_opts.backend].page_size;
+
+    if (!page_size || mem_opts.backend == MemBackendThp)
+        return 0x1000;
+    return page_size;
+}
+
+/*
+ * Give the host pages behind [gpa, gpa + len) back, the guest reads zeros
+ * there afterwards. Only whole backend pages go, shared backends punch a
+ * hole in the file since unmapping alone frees nothing. lazy leaves
+ * anonymous pages in place until the host runs short (MADV_FREE).
+ */
+int discard_guest_ram(uint64_t gpa, uint64_t len, bool lazy)
+{
+    uint64_t page_size = get_ram_page_size();
+    struct mem_slot *slot;
+    uint64_t start, end, offset;
+    int i;
+
+    start = (gpa + page_size - 1) & ~(page_size - 1);
+    end = (gpa + len) & ~(page_size - 1);
+    if (start >= end)
+        return 0;
+
+    i = find_slot(start);
+    if (i < 0)
+        return -1;
+    slot = &MemMapper[i];
+    offset = start - slot->region.guest_phys_addr;
+    if (end - start > slot->region.memory_size - offset)
+        return -1;
+
+    if (slot->fd >= 0)
+        return fallocate(slot->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         offset, end - start);
+    coldmem_discard((void *)(slot->region.userspace_addr + offset), end - start);
+    if (lazy && page_size == 0x1000 &&
+        madvise((void *)(slot->region.userspace_addr + offset), end - start, MADV_FREE) == 0)
+        return 0;
+    return madvise((void *)(slot->region.userspace_addr + offset), end - start, MADV_DONTNEED);
 }
 
 uint64_t get_gap_start()
@@ -109,29 +607,98 @@ uint64_t get_ram_end()
     }
 }
 
-static int find_mapper_index(uint64_t guest_addr)
+/*
+ * Host view of [gpa, gpa + len), one iovec per slot it touches. Returns
+ * the number of iovecs used, -1 if part of the range is not ram or it
+ * needs more than max_iov of them.
+ */
+int gpa_to_iovec(uint64_t gpa, uint64_t len, struct iovec *iov, int max_iov)
 {
-    for(int i=0;i<2;i++) {
-        if(guest_addr >= MemMapper[i].guest_phys_addr
-                && guest_addr < MemMapper[i].guest_phys_addr + MemMapper[i].memory_size) {
-            return i;
+    int n = 0;
+
+    while (len) {
+        int i = find_slot(gpa);
+        struct kvm_userspace_memory_region *region;
+        uint64_t offset, chunk;
+
+        if (i < 0 || n == max_iov)
+            return -1;
+        region = &MemMapper[i].region;
+        offset = gpa - region->guest_phys_addr;
+        chunk = region->memory_size - offset;
+        if (chunk > len)
+            chunk = len;
+        iov[n].iov_base = (void *)(region->userspace_addr + offset);
+        iov[n].iov_len = chunk;
+        n++;
+        gpa += chunk;
+        len -= chunk;
+    }
+    return n;
+}
+
+//NULL unless [guest_addr, guest_addr + len) is backed by one slot
+void *get_userspace_ptr(uint64_t guest_addr, uint64_t len)
+{
+    int i = find_slot(guest_addr);
+    uint64_t offset;
+
+    if (i < 0)
+        return NULL;
+    offset = guest_addr - MemMapper[i].region.guest_phys_addr;
+    if (len > MemMapper[i].region.memory_size - offset)
+        return NULL;
+    return (void *)(MemMapper[i].region.userspace_addr + offset);
+}
+
+//copy between buf and guest ram, the range may span slots
+static int copy_userspace_memory(void *buf, uint64_t guest_addr, uint64_t len, bool to_guest)
+{
+    uint8_t *p = buf;
+
+    while (len) {
+        int i = find_slot(guest_addr);
+        uint64_t offset, chunk;
+        void *host;
+
+        if (i < 0) {
+            fprintf(stderr, "no memory region at 0x%llx\n", (unsigned long long)guest_addr);
+            return -1;
         }
+        offset = guest_addr - MemMapper[i].region.guest_phys_addr;
+        chunk = MemMapper[i].region.memory_size - offset;
+        if (chunk > len)
+            chunk = len;
+        host = (void *)(MemMapper[i].region.userspace_addr + offset);
+        if (to_guest)
+            memcpy(host, p, chunk);
+        else
+            memcpy(p, host, chunk);
+        p += chunk;
+        guest_addr += chunk;
+        len -= chunk;
     }
-    fprintf(stderr, "get memory region failed\n");
-    return -1;
+    return 0;
 }
 
-void write_userspace_memory(void *src, uint64_t guest_addr, uint64_t len)
+int write_userspace_memory(void *src, uint64_t guest_addr, uint64_t len)
 {
-    int mapper_index = find_mapper_index(guest_addr);
-    uint64_t offset = guest_addr - MemMapper[mapper_index].guest_phys_addr;
-    memcpy((void *)(MemMapper[mapper_index].userspace_addr + offset), src, len);
-  
+    return copy_userspace_memory(src, guest_addr, len, true);
 }
 
+int read_userspace_memory(void *dst, uint64_t guest_addr, uint64_t len)
+{
+    return copy_userspace_memory(dst, guest_addr, len, false);
+}
+
+//0 if guest_addr is not ram
 uint64_t get_userspace_addr(uint64_t guest_addr)
 {
-    int mapper_index = find_mapper_index(guest_addr);
-    uint64_t offset = guest_addr - MemMapper[mapper_index].guest_phys_addr;
-    return MemMapper[mapper_index].userspace_addr + offset;
+    int i = find_slot(guest_addr);
+
+    if (i < 0) {
+        fprintf(stderr, "get memory region failed\n");
+        return 0;
+    }
+    return MemMapper[i].region.userspace_addr + guest_addr - MemMapper[i].region.guest_phys_addr;
 }
@@ -2,12 +2,52 @@
 #define MICROV_MEMORY_H
 
 #include <inttypes.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
+#include "numa.h"
+
+enum MemBackend {
+    MemBackendAnon = 0,     //4k anonymous pages
+    MemBackendThp,          //anonymous, 2M aligned, MADV_HUGEPAGE
+    MemBackendHugetlb2M,
+    MemBackendHugetlb1G,
+    MemBackendMemfd,        //shared memfd, can be handed to other processes
+    MemBackendEnd
+};
+
+struct mem_opts {
+    bool lock;
+    bool seal;              //memfd size sealed once set
+    uint64_t size;
+    enum MemBackend backend;
+    const char *path;       //hugetlbfs mount for the hugetlb backends
+    uint64_t hotplug_size;  //virtio-mem region above ram, 0 for none
+    uint64_t hotplug_block; //plug and unplug granularity
+    int hotplug_node;
+};
+
+extern struct mem_opts mem_opts;
+
+int parse_size(const char *arg, uint64_t *size);
+int parse_mem_size(const char *arg);
+int parse_mem_backend(const char *name);
+int parse_mem_hotplug(const char *arg);
 int init_memory_map(int vmfd, uint64_t ram_size);
+int get_ram_slot(int i, uint64_t *gpa, uint64_t *size, int *node);
+int get_ram_slot_fd(int i);
+int get_hotplug_ram(uint64_t *gpa, uint64_t *size, int *node);
+uint64_t get_ram_page_size();
+int set_ram_dirty_log(bool enable);
+int get_ram_dirty_log(int i, uint64_t *bitmap);
+int discard_guest_ram(uint64_t gpa, uint64_t len, bool lazy);
 uint64_t get_gap_start();
 uint64_t get_gap_end();
 uint64_t get_ram_end();
-void write_userspace_memory(void *src, uint64_t guest_addr, uint64_t len);
+int gpa_to_iovec(uint64_t gpa, uint64_t len, struct iovec *iov, int max_iov);
+int write_userspace_memory(void *src, uint64_t guest_addr, uint64_t len);
+int read_userspace_memory(void *dst, uint64_t guest_addr, uint64_t len);
 uint64_t get_userspace_addr(uint64_t guest_addr);
+void *get_userspace_ptr(uint64_t guest_addr, uint64_t len);
 
 #endif /* MICROV_MEMORY_H */
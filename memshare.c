@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "memory.h"
+#include "thread.h"
+#include "memshare.h"
+
+static int memshare_fd = -1;
+static struct memshare_msg memshare_msg;
+static int memshare_fds[MEMSHARE_REGIONS_MAX];
+
+//layout and fds are fixed once ram is set up, build the message once
+static int memshare_build()
+{
+    uint64_t gpa, size;
+    int node, n = 0;
+
+    while (get_ram_slot(n, &gpa, &size, &node) == 0) {
+        if (n == MEMSHARE_REGIONS_MAX) {
+            fprintf(stderr, "can not share more than %d memory regions\n", MEMSHARE_REGIONS_MAX);
+            return -1;
+        }
+        memshare_fds[n] = get_ram_slot_fd(n);
+        if (memshare_fds[n] < 0) {
+            fprintf(stderr, "shared memory needs the memfd or a hugetlb file backend\n");
+            return -1;
+        }
+        memshare_msg.regions[n] = (struct memshare_region) {
+            .gpa = gpa,
+            .size = size,
+            .offset = 0,
+            .node = node,
+        };
+        n++;
+    }
+    memshare_msg.magic = MEMSHARE_MAGIC;
+    memshare_msg.version = MEMSHARE_VERSION;
+    memshare_msg.nr_regions = n;
+    return 0;
+}
+
+static int memshare_send(int fd)
+{
+    int nr = memshare_msg.nr_regions;
+    char control[CMSG_SPACE(sizeof(memshare_fds))] = {0};
+    struct iovec iov = {
+        .iov_base = &memshare_msg,
+        .iov_len = sizeof(memshare_msg),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(nr * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nr * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), memshare_fds, nr * sizeof(int));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(memshare_msg)) {
+        fprintf(stderr, "send guest memory layout failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void *memshare_thread_fn(void *arg)
+{
+    for (;;) {
+        int fd = accept4(memshare_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0)
+            continue;
+        memshare_send(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int memshare_init(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    pthread_t thread;
+
+    if (memshare_build() < 0)
+        return -1;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "memory share path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    memshare_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (memshare_fd < 0) {
+        fprintf(stderr, "create memory share socket failed\n");
+        return -1;
+    }
+    unlink(path);
+    if (bind(memshare_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(memshare_fd, 4) < 0) {
+        fprintf(stderr, "bind memory share socket %s failed\n", path);
+        close(memshare_fd);
+        return -1;
+    }
+
+    if (thread_create(&thread, ThreadIo, 0, memshare_thread_fn, NULL) != 0) {
+        fprintf(stderr, "can not create memory share thread\n");
+        close(memshare_fd);
+        return -1;
+    }
+    return 0;
+}
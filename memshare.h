@@ -0,0 +1,37 @@
+#ifndef MICROV_MEMSHARE_H
+#define MICROV_MEMSHARE_H
+
+#include <stdint.h>
+
+#include "memory.h"
+
+/*
+ * Guest ram handed to out of process device backends. Every connection
+ * on the socket gets one struct memshare_msg with one fd per region in
+ * SCM_RIGHTS, in region order, and is then closed. The helper maps
+ * region i as mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+ * offset) and translates guest physical addresses with the gpa ranges.
+ */
+#define MEMSHARE_MAGIC		0x6d727663	//"cvrm"
+#define MEMSHARE_VERSION	1
+#define MEMSHARE_REGIONS_MAX	16
+
+struct memshare_region {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t offset;        //into the region's fd
+    int32_t node;           //guest numa node
+    uint32_t reserved;
+};
+
+struct memshare_msg {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nr_regions;
+    uint32_t reserved;
+    struct memshare_region regions[MEMSHARE_REGIONS_MAX];
+};
+
+int memshare_init(const char *path);
+
+#endif /* MICROV_MEMSHARE_H */
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cpus.h"
+#include "thread.h"
+#include "exitstat.h"
+#include "haltpoll.h"
+#include "profile.h"
+#include "memory.h"
+#include "virtio-balloon.h"
+#include "virtio-mem.h"
+#include "ksm.h"
+#include "coldmem.h"
+#include "snapshot.h"
+#include "monitor.h"
+
+#define MONITOR_LINE_MAX	256
+#define MONITOR_ARGS_MAX	8
+
+/*
+ * Line based control socket, one client at a time:
+ *   echo pause | socat - UNIX-CONNECT:/tmp/microv.sock
+ * Every command answers with its output followed by "ok" or "error: ...".
+ */
+struct monitor_cmd {
+    const char *name;
+    const char *help;
+    int (*fn)(FILE *out, int argc, char **argv);
+};
+
+static int monitor_fd = -1;
+
+static int cmd_help(FILE *out, int argc, char **argv);
+
+static int cmd_pause(FILE *out, int argc, char **argv)
+{
+    cpus_pause();
+    return 0;
+}
+
+static int cmd_resume(FILE *out, int argc, char **argv)
+{
+    cpus_resume();
+    return 0;
+}
+
+static int cmd_status(FILE *out, int argc, char **argv)
+{
+    fprintf(out, "%s\n", cpus_paused() ? "paused" : "running");
+    return 0;
+}
+
+//sampled with the vcpus parked so all counters belong to the same instant
+static int cmd_stats(FILE *out, int argc, char **argv)
+{
+    bool paused = cpus_paused();
+
+    if (!paused)
+        cpus_pause();
+    exit_stats_dump(out);
+    halt_poll_dump(out);
+    if (!paused)
+        cpus_resume();
+    return 0;
+}
+
+static int cmd_profile(FILE *out, int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : profile_opts.path;
+
+    if (!path)
+        return -1;
+    return profile_write(path);
+}
+
+static int cmd_ksm(FILE *out, int argc, char **argv)
+{
+    if (ksm_mode == KsmOff)
+        return -1;
+    ksm_dump(out);
+    return 0;
+}
+
+static int cmd_cold(FILE *out, int argc, char **argv)
+{
+    if (!cold_tier_secs)
+        return -1;
+    coldmem_dump(out);
+    return 0;
+}
+
+//"balloon 256M" sets the guest ram target, plain "balloon" reports
+static int cmd_balloon(FILE *out, int argc, char **argv)
+{
+    uint64_t size;
+
+    if (!balloon_opts.enabled)
+        return -1;
+    if (argc > 1) {
+        if (parse_size(argv[1], &size) < 0)
+            return -1;
+        return virtio_balloon_set_target(size);
+    }
+    virtio_balloon_dump(out);
+    return 0;
+}
+
+//"mem 2G" asks the guest to plug that much of the hotplug region
+static int cmd_mem(FILE *out, int argc, char **argv)
+{
+    uint64_t size;
+
+    if (!mem_opts.hotplug_size)
+        return -1;
+    if (argc > 1) {
+        if (parse_size(argv[1], &size) < 0)
+            return -1;
+        return virtio_mem_set_requested(size);
+    }
+    virtio_mem_dump(out);
+    return 0;
+}
+
+//"snapshot path" saves the vm to path and path.mem, it keeps running after
+static int cmd_snapshot(FILE *out, int argc, char **argv)
+{
+    bool paused = cpus_paused();
+    int ret;
+
+    if (argc < 2)
+        return -1;
+    if (!paused)
+        cpus_pause();
+    ret = snapshot_save(argv[1]);
+    if (!paused)
+        cpus_resume();
+    return ret;
+}
+
+static const struct monitor_cmd monitor_cmds[] = {
+    {"help",   "list commands",                   cmd_help},
+    {"pause",  "stop all vcpus",                  cmd_pause},
+    {"resume", "restart paused vcpus",            cmd_resume},
+    {"status", "print running or paused",         cmd_status},
+    {"stats",  "dump exit and halt poll stats",   cmd_stats},
+    {"profile", "write folded guest stacks [path]", cmd_profile},
+    {"balloon", "guest ram target [size] or balloon stats", cmd_balloon},
+    {"ksm",    "guest pages shared and unshared by ksm", cmd_ksm},
+    {"cold",   "cold tier pool and fault counts",  cmd_cold},
+    {"mem",    "hotplug memory requested [size] or plug state", cmd_mem},
+    {"snapshot", "save vm state and ram to path", cmd_snapshot},
+};
+
+#define MONITOR_CMD_NUM (sizeof(monitor_cmds) / sizeof(monitor_cmds[0]))
+
+static int cmd_help(FILE *out, int argc, char **argv)
+{
+    for (int i = 0; i < MONITOR_CMD_NUM; i++)
+        fprintf(out, "%-10s %s\n", monitor_cmds[i].name, monitor_cmds[i].help);
+    return 0;
+}
+
+static void monitor_handle_line(FILE *out, char *line)
+{
+    char *argv[MONITOR_ARGS_MAX];
+    char *save = NULL;
+    int argc = 0;
+
+    for (char *tok = strtok_r(line, " \t\r\n", &save);
+         tok && argc < MONITOR_ARGS_MAX;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        argv[argc++] = tok;
+    }
+    if (!argc)
+        return;
+
+    for (int i = 0; i < MONITOR_CMD_NUM; i++) {
+        if (strcmp(argv[0], monitor_cmds[i].name))
+            continue;
+        if (monitor_cmds[i].fn(out, argc, argv) < 0)
+            fprintf(out, "error: %s failed\n", argv[0]);
+        else
+            fprintf(out, "ok\n");
+        fflush(out);
+        return;
+    }
+    fprintf(out, "error: unknown command %s\n", argv[0]);
+    fflush(out);
+}
+
+static void *monitor_thread_fn(void *arg)
+{
+    char line[MONITOR_LINE_MAX];
+
+    for (;;) {
+        int fd = accept(monitor_fd, NULL, NULL);
+        FILE *in, *out;
+
+        if (fd < 0)
+            continue;
+        in = fdopen(fd, "r");
+        out = fdopen(dup(fd), "w");
+        if (!in || !out) {
+            fprintf(stderr, "monitor fdopen failed\n");
+            if (in)
+                fclose(in);
+            else
+                close(fd);
+            if (out)
+                fclose(out);
+            continue;
+        }
+        while (fgets(line, sizeof(line), in))
+            monitor_handle_line(out, line);
+        fclose(out);
+        fclose(in);
+    }
+    return NULL;
+}
+
+int monitor_init(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    pthread_t thread;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "monitor path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    monitor_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (monitor_fd < 0) {
+        fprintf(stderr, "create monitor socket failed\n");
+        return -1;
+    }
+    unlink(path);
+    if (bind(monitor_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(monitor_fd, 1) < 0) {
+        fprintf(stderr, "bind monitor socket %s failed\n", path);
+        close(monitor_fd);
+        return -1;
+    }
+
+    if (thread_create(&thread, ThreadIo, 0, monitor_thread_fn, NULL) != 0) {
+        fprintf(stderr, "can not create monitor thread\n");
+        close(monitor_fd);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef MICROV_MONITOR_H
+#define MICROV_MONITOR_H
+
+int monitor_init(const char *path);
+
+#endif /* MICROV_MONITOR_H */
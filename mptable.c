@@ -7,6 +7,7 @@
 #include "global.h"
 #include "memory.h"
 #include "string.h"
+#include "topology.h"
 
 #define APIC_VERSION     0x14
 #define MPC_SPEC         0x4
@@ -44,6 +45,8 @@ void setup_mptable(int num_cpus)
     const char smp_magic_ident[] = "_MP_";
     unsigned char checksum = 0;
     int offset = 0;
+    //first id past the (possibly sparse) cpu apic ids
+    int ioapic_id = topology_max_apic_id(num_cpus) + 1;
     int ssize;
     int i;
 
@@ -78,7 +81,7 @@ void setup_mptable(int num_cpus)
         cpu = (struct mpc_cpu *)get_userspace_addr(MPTABLE_START + offset);
         memset(cpu, 0, ssize);
         cpu->type = MP_PROCESSOR;
-        cpu->apicid = i;
+        cpu->apicid = topology_apic_id(i);
         cpu->apicver = APIC_VERSION;
         cpu->cpuflag = CPU_ENABLED;
         if (i == 0) {
@@ -109,7 +112,7 @@ void setup_mptable(int num_cpus)
     ioapic = (struct mpc_ioapic *)get_userspace_addr(MPTABLE_START + offset);
     memset(ioapic, 0, ssize);
     ioapic->type = MP_IOAPIC;
-    ioapic->apicid = num_cpus + 1;
+    ioapic->apicid = ioapic_id;
     ioapic->apicver = APIC_VERSION;
     ioapic->flags = MPC_APIC_USABLE;
     ioapic->apicaddr = IO_APIC_DEFAULT_PHYS_BASE;
@@ -127,7 +130,7 @@ void setup_mptable(int num_cpus)
         intsrc->irqflag = MP_IRQDIR_DEFAULT;
         intsrc->srcbus = 0;
         intsrc->srcbusirq = i;
-        intsrc->dstapic = num_cpus + 1;
+        intsrc->dstapic = ioapic_id;
         intsrc->dstirq = i;
         checksum += mptable_checksum((char *) intsrc, ssize);
         offset += ssize;
@@ -143,7 +146,7 @@ void setup_mptable(int num_cpus)
     lintsrc->irqflag = MP_IRQDIR_DEFAULT;
     lintsrc->srcbusid = 0;
     lintsrc->srcbusirq = 0;
-    lintsrc->destapic = num_cpus + 1;
+    lintsrc->destapic = ioapic_id;
     lintsrc->destapiclint = 0;
     checksum += mptable_checksum((char *) lintsrc, ssize);
 
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "global.h"
+#include "memory.h"
+#include "thread.h"
+#include "numa.h"
+
+struct numa_node numa_nodes[NUMA_NODES_MAX];
+int nr_numa_nodes;
+
+static int host_distance[NUMA_NODES_MAX][NUMA_NODES_MAX];
+
+static int parse_cpus(const char *list, uint64_t *cpus)
+{
+    int idx[VCPU_MAX];
+    int n = parse_cpulist(list, idx, VCPU_MAX);
+
+    if (n <= 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        if (idx[i] >= VCPU_MAX)
+            return -1;
+        *cpus |= 1ULL << idx[i];
+    }
+    return 0;
+}
+
+//"mem=2G,cpus=0-3,cpus=8,host-node=0", one option per node in node order
+int parse_numa(const char *arg)
+{
+    struct numa_node *node;
+    char buf[256];
+    char *save = NULL;
+
+    if (nr_numa_nodes == NUMA_NODES_MAX) {
+        fprintf(stderr, "at most %d numa nodes\n", NUMA_NODES_MAX);
+        return -1;
+    }
+    if (strlen(arg) >= sizeof(buf))
+        goto err;
+    strcpy(buf, arg);
+
+    node = &numa_nodes[nr_numa_nodes];
+    node->host_node = -1;
+    for (char *tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        char *end;
+
+        if (!val)
+            goto err;
+        *val++ = '\0';
+        if (!strcmp(tok, "mem")) {
+            if (parse_size(val, &node->size) < 0)
+                goto err;
+        } else if (!strcmp(tok, "cpus")) {
+            if (parse_cpus(val, &node->cpus) < 0)
+                goto err;
+        } else if (!strcmp(tok, "host-node")) {
+            node->host_node = strtol(val, &end, 10);
+            if (*end || node->host_node < 0)
+                goto err;
+        } else {
+            goto err;
+        }
+    }
+    if (!node->size)
+        goto err;
+    nr_numa_nodes++;
+    return 0;
+
+err:
+    fprintf(stderr, "invalid numa node %s\n", arg);
+    return -1;
+}
+
+bool numa_enabled()
+{
+    return nr_numa_nodes > 1;
+}
+
+int numa_cpu_node(int cpu_index)
+{
+    for (int i = 0; i < nr_numa_nodes; i++) {
+        if (numa_nodes[i].cpus & (1ULL << cpu_index))
+            return i;
+    }
+    return 0;
+}
+
+int numa_distance(int from, int to)
+{
+    return host_distance[from][to];
+}
+
+//0 and the line read from a /sys/devices/system/node file, -1 if it is missing
+static int read_node_file(int node, const char *name, char *buf, int len)
+{
+    char path[128];
+    FILE *f;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/%s", node, name);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fgets(buf, len, f)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        ret = 0;
+    }
+    fclose(f);
+    return ret;
+}
+
+/*
+ * Guest distances follow the host ones between the bound host nodes,
+ * unbound nodes get the usual local/remote pair.
+ */
+static void setup_distances()
+{
+    for (int i = 0; i < nr_numa_nodes; i++) {
+        int from = numa_nodes[i].host_node;
+        char line[256];
+        int dist[64], n = 0;
+
+        if (from >= 0 && read_node_file(from, "distance", line, sizeof(line)) == 0) {
+            char *p = line, *end;
+
+            while (n < 64) {
+                dist[n] = strtol(p, &end, 10);
+                if (end == p)
+                    break;
+                n++;
+                p = end;
+            }
+        }
+        for (int j = 0; j < nr_numa_nodes; j++) {
+            int to = numa_nodes[j].host_node;
+
+            if (i == j)
+                host_distance[i][j] = NUMA_DISTANCE_LOCAL;
+            else if (from >= 0 && to >= 0 && to < n && from != to)
+                host_distance[i][j] = dist[to];
+            else
+                host_distance[i][j] = NUMA_DISTANCE_REMOTE;
+        }
+    }
+}
+
+/*
+ * Check the nodes against the vcpu count, hand unclaimed vcpus to node 0
+ * and size guest ram from the nodes. vcpus of a bound node float over
+ * that host node's cpus unless --vcpu-affinity pins them.
+ */
+int numa_init(int vcpu_count)
+{
+    uint64_t claimed = 0, all = (1ULL << vcpu_count) - 1;
+    uint64_t total = 0;
+    uint64_t page_size = get_ram_page_size();
+
+    if (!nr_numa_nodes)
+        return 0;
+    //node boundaries must not split a huge page, nor a backend page
+    if (page_size < 0x200000)
+        page_size = 0x200000;
+
+    for (int i = 0; i < nr_numa_nodes; i++) {
+        struct numa_node *node = &numa_nodes[i];
+
+        if (node->cpus & ~all) {
+            fprintf(stderr, "numa node %d names vcpus beyond %d\n", i, vcpu_count - 1);
+            return -1;
+        }
+        if (node->cpus & claimed) {
+            fprintf(stderr, "numa node %d shares vcpus with another node\n", i);
+            return -1;
+        }
+        if (node->size & (page_size - 1)) {
+            fprintf(stderr, "numa node %d size is not a multiple of %lluM\n",
+                    i, (unsigned long long)page_size >> 20);
+            return -1;
+        }
+        claimed |= node->cpus;
+        total += node->size;
+    }
+    numa_nodes[0].cpus |= all & ~claimed;
+    mem_opts.size = total;
+
+    for (int i = 0; i < nr_numa_nodes; i++) {
+        char cpulist[256];
+
+        if (numa_nodes[i].host_node < 0)
+            continue;
+        if (read_node_file(numa_nodes[i].host_node, "cpulist", cpulist, sizeof(cpulist)) < 0) {
+            fprintf(stderr, "host numa node %d does not exist\n", numa_nodes[i].host_node);
+            return -1;
+        }
+        for (int cpu = 0; cpu < vcpu_count; cpu++) {
+            if ((numa_nodes[i].cpus & (1ULL << cpu)) &&
+                thread_set_vcpu_cpulist(cpu, cpulist) < 0)
+                return -1;
+        }
+    }
+    setup_distances();
+    return 0;
+}
+
+//place the pages of a guest node on its host node, before they are touched
+int numa_bind(void *addr, uint64_t len, int node)
+{
+    unsigned long mask;
+    int host_node;
+
+    if (node < 0 || node >= nr_numa_nodes || numa_nodes[node].host_node < 0)
+        return 0;
+    host_node = numa_nodes[node].host_node;
+    if (host_node >= sizeof(mask) * 8) {
+        fprintf(stderr, "host numa node %d out of range\n", host_node);
+        return -1;
+    }
+    mask = 1UL << host_node;
+    if (syscall(SYS_mbind, addr, len, MPOL_BIND, &mask, sizeof(mask) * 8 + 1,
+                MPOL_MF_STRICT | MPOL_MF_MOVE) < 0) {
+        fprintf(stderr, "mbind guest node %d to host node %d failed\n", node, host_node);
+        return -1;
+    }
+    return 0;
+}
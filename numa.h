@@ -0,0 +1,31 @@
+#ifndef MICROV_NUMA_H
+#define MICROV_NUMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NUMA_NODES_MAX		8
+#define NUMA_DISTANCE_LOCAL	10
+#define NUMA_DISTANCE_REMOTE	20
+
+/*
+ * One guest node: its share of guest ram, laid out in node order from
+ * gpa 0, the vcpus it owns and the host node backing both.
+ */
+struct numa_node {
+    uint64_t size;
+    uint64_t cpus;      //bitmap of vcpu indexes
+    int host_node;      //-1 when not bound
+};
+
+extern struct numa_node numa_nodes[NUMA_NODES_MAX];
+extern int nr_numa_nodes;
+
+int parse_numa(const char *arg);
+int numa_init(int vcpu_count);
+bool numa_enabled();
+int numa_cpu_node(int cpu_index);
+int numa_distance(int from, int to);
+int numa_bind(void *addr, uint64_t len, int node);
+
+#endif /* MICROV_NUMA_H */
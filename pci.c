@@ -92,8 +92,15 @@ static void pci_bar_config(struct pci_dev *dev, uint8_t bar)
     uint32_t mask = ~(dev->bar_size[bar] - 1);
     uint32_t old_bar = PCI_HDR_READ(dev->hdr, PCI_BAR_OFFSET(bar), 32);
     uint32_t new_bar = (old_bar & mask) | dev->bar_is_io_space[bar];
+    struct bus *bus = dev->bar_region[bar].bus;
+
     PCI_HDR_WRITE(dev->hdr, PCI_BAR_OFFSET(bar), new_bar, 32);
+    //move a live bar through the bus so kvm side state follows it
+    if (bus)
+        iobus_deregister_region(&dev->bar_region[bar]);
     dev->bar_region[bar].base = new_bar;
+    if (bus && new_bar & mask)
+        iobus_register_region(bus, &dev->bar_region[bar]);
 }
 
 static void pci_config_write(struct pci_dev *dev,
@@ -153,3 +160,14 @@ void pci_dev_init(struct pci_dev *dev)
     pcibus_register_dev(dev, pci_config_handle_io);
 }
 
+
+//adopt a saved config space, enabled bars come back at their saved addresses
+void pci_dev_restore(struct pci_dev *dev, const void *cfg_space)
+{
+    memcpy(dev->cfg_space, cfg_space, PCI_CFG_SPACE_SIZE);
+    for (int i = 0; i < PCI_STD_NUM_BARS; i++) {
+        if (dev->bar_size[i])
+            dev->bar_region[i].base = PCI_HDR_READ(dev->hdr, PCI_BAR_OFFSET(i), 32);
+    }
+    pci_bar_command(dev);
+}
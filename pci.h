@@ -43,5 +43,6 @@ void pci_init_bar(struct pci_dev *dev,
                  region_io_fn do_io);
 
 void pci_dev_init(struct pci_dev *dev);
+void pci_dev_restore(struct pci_dev *dev, const void *cfg_space);
 
 #endif /* MICROV_PCI_H */
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "thread.h"
+#include "prefault.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+/*
+ * Fault all of guest ram in before the first vcpu runs. Worker threads
+ * take fixed size chunks off a shared index until none are left, so a
+ * slow node or a small slot does not leave the others idle. This runs
+ * while the kernel and initrd are loaded, populating never changes the
+ * content of a page that is already there.
+ */
+#define PREFAULT_CHUNK		0x4000000	//64M
+#define PREFAULT_THREADS_MAX	16
+
+struct prefault_chunk {
+    void *host;
+    uint64_t len;
+};
+
+int prefault_threads;
+
+static struct prefault_chunk *prefault_chunks;
+static uint64_t nr_prefault_chunks;
+static uint64_t prefault_next;
+static uint64_t prefault_bytes;
+static int prefault_err;
+static pthread_t prefault_tids[PREFAULT_THREADS_MAX];
+static uint64_t prefault_start_ns;
+
+//"" for one thread per host cpu, or a thread count
+int parse_prefault(const char *arg)
+{
+    prefault_threads = arg ? atoi(arg) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (prefault_threads <= 0) {
+        fprintf(stderr, "invalid prefault thread count %s\n", arg);
+        return -1;
+    }
+    if (prefault_threads > PREFAULT_THREADS_MAX)
+        prefault_threads = PREFAULT_THREADS_MAX;
+    return 0;
+}
+
+static void *prefault_thread_fn(void *arg)
+{
+    for (;;) {
+        uint64_t i = __atomic_fetch_add(&prefault_next, 1, __ATOMIC_RELAXED);
+        struct prefault_chunk *chunk;
+
+        if (i >= nr_prefault_chunks || __atomic_load_n(&prefault_err, __ATOMIC_RELAXED))
+            break;
+        chunk = &prefault_chunks[i];
+        if (madvise(chunk->host, chunk->len, MADV_POPULATE_WRITE) < 0) {
+            __atomic_compare_exchange_n(&prefault_err, &(int){0}, errno, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_fetch_add(&prefault_bytes, chunk->len, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+//cut guest ram into chunks, only counting them when chunks is NULL
+static uint64_t prefault_split(struct prefault_chunk *chunks)
+{
+    uint64_t chunk_size = PREFAULT_CHUNK;
+    uint64_t gpa, size, hotplug_gpa, hotplug_size;
+    uint64_t n = 0;
+    int node;
+
+    if (chunk_size < get_ram_page_size())
+        chunk_size = get_ram_page_size();
+    //the guest has not plugged any of the hotplug region yet
+    if (get_hotplug_ram(&hotplug_gpa, &hotplug_size, &node) < 0)
+        hotplug_gpa = 0;
+
+    for (int i = 0; get_ram_slot(i, &gpa, &size, &node) == 0; i++) {
+        uint8_t *host = get_userspace_ptr(gpa, size);
+
+        if (hotplug_gpa && gpa == hotplug_gpa)
+            continue;
+        for (uint64_t off = 0; off < size; off += chunk_size, n++) {
+            if (!chunks)
+                continue;
+            chunks[n].host = host + off;
+            chunks[n].len = size - off < chunk_size ? size - off : chunk_size;
+        }
+    }
+    return n;
+}
+
+int prefault_start()
+{
+    if (!prefault_threads)
+        return 0;
+    nr_prefault_chunks = prefault_split(NULL);
+    prefault_chunks = calloc(nr_prefault_chunks, sizeof(*prefault_chunks));
+    if (!prefault_chunks) {
+        fprintf(stderr, "prefault chunk list allocation failed\n");
+        return -1;
+    }
+    prefault_split(prefault_chunks);
+
+    prefault_start_ns = now_ns();
+    for (int i = 0; i < prefault_threads; i++) {
+        if (thread_create(&prefault_tids[i], ThreadBulk, i, prefault_thread_fn, NULL) != 0) {
+            fprintf(stderr, "can not create prefault thread\n");
+            prefault_threads = i;
+            break;
+        }
+    }
+    if (!prefault_threads)
+        prefault_thread_fn(NULL);
+    return 0;
+}
+
+//a failed prefault only costs the faults it was meant to save, the guest still boots
+void prefault_wait()
+{
+    uint64_t ns;
+    int threads;
+
+    if (!prefault_chunks)
+        return;
+    for (int i = 0; i < prefault_threads; i++)
+        pthread_join(prefault_tids[i], NULL);
+    ns = now_ns() - prefault_start_ns;
+
+    if (prefault_err == EINVAL)
+        fprintf(stderr, "prefault needs MADV_POPULATE_WRITE, linux 5.14 or later\n");
+    else if (prefault_err)
+        fprintf(stderr, "prefault stopped early: %s\n", strerror(prefault_err));
+    threads = prefault_threads ? prefault_threads : 1;
+    fprintf(stderr, "prefault: %llu MiB in %llu ms with %d thread%s\n",
+            (unsigned long long)prefault_bytes >> 20,
+            (unsigned long long)ns / 1000000, threads, threads > 1 ? "s" : "");
+    free(prefault_chunks);
+    prefault_chunks = NULL;
+}
@@ -0,0 +1,10 @@
+#ifndef MICROV_PREFAULT_H
+#define MICROV_PREFAULT_H
+
+extern int prefault_threads;
+
+int parse_prefault(const char *arg);
+int prefault_start();
+void prefault_wait();
+
+#endif /* MICROV_PREFAULT_H */
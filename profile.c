@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/kvm.h>
+
+#include "memory.h"
+#include "cpus.h"
+#include "thread.h"
+#include "profile.h"
+
+/*
+ * Host side sampling of guest code. A timer thread kicks every running
+ * vcpu out of KVM_RUN, the vcpu thread then records its rip and walks
+ * the guest frame pointer chain through KVM_TRANSLATE. Stacks are only
+ * walked in the kernel, a guest built without CONFIG_FRAME_POINTER
+ * yields the leaf function only.
+ */
+struct profile_opts profile_opts = {
+    .hz = PROFILE_DEFAULT_HZ,
+};
+
+struct profile_stack {
+    uint64_t pcs[PROFILE_DEPTH];   //leaf first
+    int depth;
+    int cpu_index;
+    bool user;
+    uint64_t count;
+};
+
+struct symbol {
+    uint64_t addr;
+    char *name;
+};
+
+static struct profile_stack *stacks;
+static uint64_t stacks_dropped;
+static pthread_mutex_t stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct symbol *symbols;
+static int nr_symbols;
+
+static pthread_t profile_thread;
+static bool profile_running;
+
+static int add_symbol(int *cap, uint64_t addr, const char *name)
+{
+    if (nr_symbols == *cap) {
+        int ncap = *cap ? *cap * 2 : 4096;
+        struct symbol *n = realloc(symbols, ncap * sizeof(*n));
+
+        if (!n)
+            return -1;
+        symbols = n;
+        *cap = ncap;
+    }
+    symbols[nr_symbols].addr = addr;
+    symbols[nr_symbols].name = strdup(name);
+    if (!symbols[nr_symbols].name)
+        return -1;
+    nr_symbols++;
+    return 0;
+}
+
+//"ffffffff81000000 T _text" lines, text symbols only
+static int load_system_map(FILE *f)
+{
+    char line[512], name[256];
+    unsigned long long addr;
+    char type;
+    int cap = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%llx %c %255s", &addr, &type, name) != 3)
+            continue;
+        if (type != 'T' && type != 't' && type != 'W' && type != 'w')
+            continue;
+        if (add_symbol(&cap, addr, name) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int load_vmlinux(const char *path)
+{
+    struct stat st;
+    Elf64_Ehdr *ehdr;
+    Elf64_Shdr *shdr;
+    char *base;
+    int fd, cap = 0, ret = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        goto out;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        goto out;
+    }
+
+    ehdr = (Elf64_Ehdr *)base;
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(*shdr) > st.st_size) {
+        fprintf(stderr, "%s is not a 64-bit elf\n", path);
+        goto unmap;
+    }
+    shdr = (Elf64_Shdr *)(base + ehdr->e_shoff);
+
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        Elf64_Sym *sym;
+        const char *strtab;
+
+        if (shdr[i].sh_type != SHT_SYMTAB || shdr[i].sh_link >= ehdr->e_shnum)
+            continue;
+        sym = (Elf64_Sym *)(base + shdr[i].sh_offset);
+        strtab = base + shdr[shdr[i].sh_link].sh_offset;
+        for (int j = 0; j < shdr[i].sh_size / sizeof(*sym); j++) {
+            if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || !sym[j].st_value)
+                continue;
+            if (add_symbol(&cap, sym[j].st_value, strtab + sym[j].st_name) < 0)
+                goto unmap;
+        }
+    }
+    ret = 0;
+unmap:
+    munmap(base, st.st_size);
+out:
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int load_symbols(const char *path)
+{
+    unsigned char magic[SELFMAG];
+    FILE *f;
+    int ret;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
+    }
+    if (fread(magic, 1, SELFMAG, f) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG)) {
+        fclose(f);
+        ret = load_vmlinux(path);
+    } else {
+        rewind(f);
+        ret = load_system_map(f);
+        fclose(f);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "load symbols from %s failed\n", path);
+        return -1;
+    }
+    qsort(symbols, nr_symbols, sizeof(*symbols), symbol_cmp);
+    return 0;
+}
+
+static const char *lookup_symbol(uint64_t pc)
+{
+    int lo = 0, hi = nr_symbols - 1;
+
+    if (!nr_symbols || pc < symbols[0].addr)
+        return NULL;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+
+        if (symbols[mid].addr <= pc)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return symbols[lo].name;
+}
+
+static bool read_guest_u64(int vcpu_fd, uint64_t gva, uint64_t *val)
+{
+    struct kvm_translation tr = { .linear_address = gva };
+    uint64_t *p;
+
+    if (gva & 7)
+        return false;
+    if (ioctl(vcpu_fd, KVM_TRANSLATE, &tr) < 0 || !tr.valid)
+        return false;
+    p = get_userspace_ptr(tr.physical_address, sizeof(*p));
+    if (!p)
+        return false;
+    *val = *p;
+    return true;
+}
+
+static uint32_t stack_hash(struct profile_stack *s)
+{
+    uint64_t h = 1469598103934665603ULL ^ s->cpu_index ^ ((uint64_t)s->user << 8);
+
+    for (int i = 0; i < s->depth; i++) {
+        h ^= s->pcs[i];
+        h *= 1099511628211ULL;
+    }
+    return h ^ (h >> 32);
+}
+
+static void record_stack(struct profile_stack *s)
+{
+    uint32_t idx = stack_hash(s) & (PROFILE_STACKS - 1);
+
+    pthread_mutex_lock(&stacks_lock);
+    for (int probe = 0; probe < PROFILE_STACKS; probe++) {
+        struct profile_stack *slot = &stacks[(idx + probe) & (PROFILE_STACKS - 1)];
+
+        if (!slot->count) {
+            *slot = *s;
+            slot->count = 1;
+            goto out;
+        }
+        if (slot->depth == s->depth && slot->cpu_index == s->cpu_index &&
+            slot->user == s->user &&
+            !memcmp(slot->pcs, s->pcs, s->depth * sizeof(s->pcs[0]))) {
+            slot->count++;
+            goto out;
+        }
+    }
+    stacks_dropped++;
+out:
+    pthread_mutex_unlock(&stacks_lock);
+}
+
+//runs on the vcpu thread while it is out of KVM_RUN
+void profile_sample(struct VCPUState *vcpu)
+{
+    struct profile_stack s = { .cpu_index = vcpu->cpu_index };
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_mp_state mp_state;
+    uint64_t fp;
+
+    if (!stacks)
+        return;
+    //an ap still waiting for its sipi has no code to attribute
+    if (ioctl(vcpu->vcpu_fd, KVM_GET_MP_STATE, &mp_state) < 0 ||
+        mp_state.mp_state == KVM_MP_STATE_UNINITIALIZED ||
+        mp_state.mp_state == KVM_MP_STATE_INIT_RECEIVED)
+        return;
+    if (ioctl(vcpu->vcpu_fd, KVM_GET_REGS, &regs) < 0 ||
+        ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
+        return;
+
+    s.pcs[s.depth++] = regs.rip;
+    s.user = (sregs.cs.selector & 3) != 0;
+    //long mode kernel frames: [fp] = caller fp, [fp + 8] = return address
+    fp = regs.rbp;
+    while (!s.user && s.depth < PROFILE_DEPTH) {
+        uint64_t next_fp, ret;
+
+        if (!read_guest_u64(vcpu->vcpu_fd, fp, &next_fp) ||
+            !read_guest_u64(vcpu->vcpu_fd, fp + 8, &ret) || !ret)
+            break;
+        s.pcs[s.depth++] = ret;
+        //stacks grow down, a frame chain that does not climb is garbage
+        if (next_fp <= fp || next_fp - fp > 0x10000)
+            break;
+        fp = next_fp;
+    }
+    record_stack(&s);
+}
+
+static void format_frame(char *buf, size_t len, uint64_t pc)
+{
+    const char *name = lookup_symbol(pc);
+
+    if (name)
+        snprintf(buf, len, "%s", name);
+    else if (nr_symbols)
+        snprintf(buf, len, "[unknown]");
+    else
+        snprintf(buf, len, "0x%llx", (unsigned long long)pc);
+}
+
+struct folded {
+    char *line;
+    uint64_t count;
+};
+
+static int folded_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct folded *)a)->line, ((const struct folded *)b)->line);
+}
+
+//one "vcpuN;outer;...;leaf count" line per distinct symbolized stack
+int profile_write(const char *path)
+{
+    struct folded *lines;
+    int n = 0;
+    FILE *out;
+
+    if (!stacks)
+        return -1;
+    lines = calloc(PROFILE_STACKS, sizeof(*lines));
+    if (!lines)
+        return -1;
+
+    pthread_mutex_lock(&stacks_lock);
+    for (int i = 0; i < PROFILE_STACKS; i++) {
+        struct profile_stack *s = &stacks[i];
+        char buf[PROFILE_DEPTH * 64 + 32], frame[128];
+        size_t len;
+
+        if (!s->count)
+            continue;
+        len = snprintf(buf, sizeof(buf), "vcpu%d", s->cpu_index);
+        if (s->user) {
+            len += snprintf(buf + len, sizeof(buf) - len, ";[user]");
+        } else {
+            for (int d = s->depth - 1; d >= 0 && len < sizeof(buf); d--) {
+                format_frame(frame, sizeof(frame), s->pcs[d]);
+                len += snprintf(buf + len, sizeof(buf) - len, ";%s", frame);
+            }
+        }
+        lines[n].line = strdup(buf);
+        lines[n].count = s->count;
+        if (lines[n].line)
+            n++;
+    }
+    pthread_mutex_unlock(&stacks_lock);
+
+    out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "open %s failed\n", path);
+    } else {
+        qsort(lines, n, sizeof(*lines), folded_cmp);
+        for (int i = 0; i < n; i++) {
+            uint64_t count = lines[i].count;
+
+            while (i + 1 < n && !strcmp(lines[i].line, lines[i + 1].line))
+                count += lines[++i].count;
+            fprintf(out, "%s %llu\n", lines[i].line, (unsigned long long)count);
+        }
+        fclose(out);
+        if (stacks_dropped)
+            fprintf(stderr, "profile: %llu samples dropped, stack table full\n",
+                    (unsigned long long)stacks_dropped);
+    }
+
+    for (int i = 0; i < n; i++)
+        free(lines[i].line);
+    free(lines);
+    return out ? 0 : -1;
+}
+
+static void *profile_thread_fn(void *arg)
+{
+    struct timespec next;
+    long period_ns = 1000000000L / profile_opts.hz;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (__atomic_load_n(&profile_running, __ATOMIC_ACQUIRE)) {
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        for (int i = 0; i < get_vcpu_count(); i++) {
+            __atomic_store_n(&get_vcpu(i)->sample_pending, true, __ATOMIC_RELEASE);
+            cpus_kick(i);
+        }
+    }
+    return NULL;
+}
+
+int profile_init()
+{
+    if (!profile_opts.path)
+        return 0;
+    if (profile_opts.hz <= 0 || profile_opts.hz > 10000) {
+        fprintf(stderr, "invalid profile rate %d\n", profile_opts.hz);
+        return -1;
+    }
+    if (profile_opts.symbols && load_symbols(profile_opts.symbols) < 0)
+        return -1;
+
+    stacks = calloc(PROFILE_STACKS, sizeof(*stacks));
+    if (!stacks) {
+        fprintf(stderr, "malloc profile stacks failed\n");
+        return -1;
+    }
+    profile_running = true;
+    if (thread_create(&profile_thread, ThreadIo, 0, profile_thread_fn, NULL) != 0) {
+        fprintf(stderr, "create profile thread failed\n");
+        profile_running = false;
+        return -1;
+    }
+    return 0;
+}
+
+//stop sampling before the vcpus go away, then write the folded stacks
+void profile_exit()
+{
+    if (!profile_running)
+        return;
+    __atomic_store_n(&profile_running, false, __ATOMIC_RELEASE);
+    pthread_join(profile_thread, NULL);
+    profile_write(profile_opts.path);
+}
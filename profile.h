@@ -0,0 +1,27 @@
+#ifndef MICROV_PROFILE_H
+#define MICROV_PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROFILE_DEPTH		32
+#define PROFILE_STACKS		4096
+#define PROFILE_DEFAULT_HZ	99
+
+struct VCPUState;
+
+struct profile_opts {
+    const char *path;       //folded stacks output, profiling is off when NULL
+    const char *symbols;    //System.map or vmlinux
+    int hz;
+};
+
+extern struct profile_opts profile_opts;
+
+int profile_init();
+void profile_sample(struct VCPUState *vcpu);
+int profile_write(const char *path);
+void profile_exit();
+
+#endif /* MICROV_PROFILE_H */
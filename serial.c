@@ -40,6 +40,8 @@ Base Address	DLAB	Read/Write	Abr.	Register Name
 #include "global.h"
 #include "iobus.h"
 #include "serial.h"
+#include "thread.h"
+#include "snapshot.h"
 
 #define MMIO_SERIAL_IRQ		4
 #define RECEIVER_BUFF_SIZE	1024
@@ -107,6 +109,8 @@ struct Serial {
 
 extern struct bus pio_bus;
 struct region io_region;
+//vcpus, the coalesced flush thread and the stdin thread all reach the registers
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void fifo_clear()
 {
@@ -166,6 +170,7 @@ static void update_serial_iir()
 
 static void receive_serial_input(uint8_t data)
 {
+    pthread_mutex_lock(&serial_lock);
     if((Serial.mcr & UART_MCR_LOOP) == 0) {
         if(Serial.recv_fifo.count >= UART_FIFO_LENGTH) {
             fprintf(stderr, "Overflow UART_FIFO_LENGTH\n");
@@ -176,6 +181,7 @@ static void receive_serial_input(uint8_t data)
 
         update_serial_iir();
     }
+    pthread_mutex_unlock(&serial_lock);
 }
 
 static void *serial_thread_fn(void *arg)
@@ -322,11 +328,34 @@ static void write_serial_reg(uint64_t port, uint8_t data)
 
 static void serial_handle_io(uint64_t port, uint8_t size, void *data, uint8_t is_write, void *owner)
 {
+    pthread_mutex_lock(&serial_lock);
     if(is_write) {
         write_serial_reg(port, *(uint8_t *)(data));
     } else {
         *(uint8_t *)(data) = read_serial_reg(port);
     }
+    pthread_mutex_unlock(&serial_lock);
+}
+
+static int serial_save(void *opaque, FILE *fp)
+{
+    struct Serial s;
+
+    pthread_mutex_lock(&serial_lock);
+    s = Serial;
+    pthread_mutex_unlock(&serial_lock);
+    return snapshot_write(fp, &s, sizeof(s));
+}
+
+//the registers and fifo come from the snapshot, the irq eventfd stays ours
+static int serial_load(void *opaque, FILE *fp, uint64_t len)
+{
+    uint32_t interrupt_evt = Serial.interrupt_evt;
+
+    if (len != sizeof(Serial) || snapshot_read(fp, &Serial, sizeof(Serial)) < 0)
+        return -1;
+    Serial.interrupt_evt = interrupt_evt;
+    return 0;
 }
 
 void create_serial_dev(int vmfd)
@@ -345,12 +374,19 @@ void create_serial_dev(int vmfd)
     }
 
     region_init(&io_region, IO_SERIAL_START, IO_SERIAL_SIZE, NULL, serial_handle_io);
+    /*
+     * THR writes only queue output. The THRE interrupt an interrupt driven
+     * 8250 driver waits for is raised when the write is replayed, by the
+     * flush thread or the next exit, so --coalesced-io needs a flush period.
+     */
+    region_set_coalesced(&io_region, 0, 1);
     iobus_register_region(&pio_bus, &io_region);
+    snapshot_register("serial", serial_save, serial_load, NULL);
 
     pthread_t serial_thread;
 
-    if (pthread_create(&(serial_thread), (const pthread_attr_t *)NULL,
-                        serial_thread_fn, NULL) != 0) {
+    if (thread_create(&(serial_thread), ThreadIo, 0,
+                      serial_thread_fn, NULL) != 0) {
         fprintf(stderr, "can not create serial thread");
     }
 }
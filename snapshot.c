@@ -0,0 +1,841 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/kvm.h>
+
+#include "memory.h"
+#include "iobus.h"
+#include "ioeventfd.h"
+#include "coldmem.h"
+#include "thread.h"
+#include "uffd.h"
+#include "snapshot.h"
+
+/*
+ * A snapshot is two files. <path> holds the ram layout followed by named
+ * sections of vm, vcpu and device state, each written and read back by
+ * whoever registered the name. <path>.mem holds guest ram at file offset
+ * = guest physical address with all zero pages left as holes, so it can
+ * be mapped as is and only costs the pages the guest wrote.
+ *
+ * Restore needs the same -m, --numa, --mem-hotplug, -s and device
+ * options the snapshot was taken with; the layout and section set are
+ * checked against them.
+ */
+#define SNAPSHOT_MAGIC		0x4e53564f5243494dULL	//"MICROVSN"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_SECTIONS_MAX	16
+#define SNAPSHOT_NAME_LEN	16
+#define SNAPSHOT_SLOTS_MAX	64
+#define SNAPSHOT_PAGE_SIZE	4096
+#define PAGEMAP_BATCH		512
+#define PAGEMAP_PRESENT		(1ULL << 63)
+#define PAGEMAP_SWAPPED		(1ULL << 62)
+
+struct snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nr_slots;
+};
+
+struct snapshot_slot {
+    uint64_t gpa;
+    uint64_t size;
+};
+
+struct snapshot_section_header {
+    char name[SNAPSHOT_NAME_LEN];
+    uint64_t len;
+};
+
+struct snapshot_section {
+    const char *name;
+    snapshot_save_fn save;
+    snapshot_load_fn load;
+    void *opaque;
+    bool loaded;
+};
+
+//in-kernel pic, ioapic, pit and kvmclock
+struct snapshot_vm_state {
+    struct kvm_irqchip chip[3];
+    struct kvm_pit_state2 pit;
+    struct kvm_clock_data clock;
+};
+
+static struct snapshot_section sections[SNAPSHOT_SECTIONS_MAX];
+static int nr_sections;
+static int snapshot_vmfd = -1;
+
+int snapshot_write(FILE *fp, const void *data, uint64_t len)
+{
+    return fwrite(data, 1, len, fp) == len ? 0 : -1;
+}
+
+int snapshot_read(FILE *fp, void *data, uint64_t len)
+{
+    return fread(data, 1, len, fp) == len ? 0 : -1;
+}
+
+//sections are saved in registration order, which is device creation order
+void snapshot_register(const char *name, snapshot_save_fn save,
+                       snapshot_load_fn load, void *opaque)
+{
+    if (nr_sections >= SNAPSHOT_SECTIONS_MAX ||
+        strlen(name) >= SNAPSHOT_NAME_LEN) {
+        fprintf(stderr, "can not register snapshot section %s\n", name);
+        return;
+    }
+    sections[nr_sections++] = (struct snapshot_section) {
+        .name = name,
+        .save = save,
+        .load = load,
+        .opaque = opaque,
+    };
+}
+
+static int snapshot_vm_save(void *opaque, FILE *fp)
+{
+    struct snapshot_vm_state s;
+
+    memset(&s, 0, sizeof(s));
+    for (int i = 0; i < 3; i++) {
+        s.chip[i].chip_id = i;
+        if (ioctl(snapshot_vmfd, KVM_GET_IRQCHIP, &s.chip[i]) < 0) {
+            fprintf(stderr, "get irqchip %d failed\n", i);
+            return -1;
+        }
+    }
+    if (ioctl(snapshot_vmfd, KVM_GET_PIT2, &s.pit) < 0) {
+        fprintf(stderr, "get pit failed\n");
+        return -1;
+    }
+    if (ioctl(snapshot_vmfd, KVM_GET_CLOCK, &s.clock) < 0) {
+        fprintf(stderr, "get kvm clock failed\n");
+        return -1;
+    }
+    return snapshot_write(fp, &s, sizeof(s));
+}
+
+static int snapshot_vm_load(void *opaque, FILE *fp, uint64_t len)
+{
+    struct snapshot_vm_state s;
+
+    if (len != sizeof(s) || snapshot_read(fp, &s, sizeof(s)) < 0)
+        return -1;
+    for (int i = 0; i < 3; i++) {
+        if (ioctl(snapshot_vmfd, KVM_SET_IRQCHIP, &s.chip[i]) < 0) {
+            fprintf(stderr, "set irqchip %d failed\n", i);
+            return -1;
+        }
+    }
+    if (ioctl(snapshot_vmfd, KVM_SET_PIT2, &s.pit) < 0) {
+        fprintf(stderr, "set pit failed\n");
+        return -1;
+    }
+    //guest time goes on from where it stopped, not from the wall clock
+    s.clock.flags = 0;
+    if (ioctl(snapshot_vmfd, KVM_SET_CLOCK, &s.clock) < 0) {
+        fprintf(stderr, "set kvm clock failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_init(int vmfd)
+{
+    snapshot_vmfd = vmfd;
+    snapshot_register("vm", snapshot_vm_save, snapshot_vm_load, NULL);
+    return 0;
+}
+
+static int snapshot_ram_layout(struct snapshot_slot *slots)
+{
+    int n = 0, node;
+
+    while (n < SNAPSHOT_SLOTS_MAX &&
+           get_ram_slot(n, &slots[n].gpa, &slots[n].size, &node) == 0)
+        n++;
+    return n;
+}
+
+static char *snapshot_mem_path(const char *path)
+{
+    char *mem_path = malloc(strlen(path) + sizeof(".mem"));
+
+    if (mem_path)
+        sprintf(mem_path, "%s.mem", path);
+    return mem_path;
+}
+
+static bool page_is_zero(const uint8_t *p)
+{
+    return !*(const uint64_t *)p && !memcmp(p, p + 8, SNAPSHOT_PAGE_SIZE - 8);
+}
+
+static int pwrite_full(int fd, const uint8_t *buf, uint64_t len, uint64_t off)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, uint8_t *buf, uint64_t len, uint64_t off)
+{
+    while (len) {
+        ssize_t n = pread(fd, buf, len, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * Pagemap entries of n host pages. A page neither present nor swapped
+ * was never written, was given back or sits in the cold tier; when
+ * pagemap can not be read every page counts as present.
+ */
+static void snapshot_pagemap(int pagemap_fd, uint8_t *host, uint64_t n, uint64_t *map)
+{
+    uint64_t pos = (uintptr_t)host / SNAPSHOT_PAGE_SIZE * sizeof(uint64_t);
+
+    if (pagemap_fd < 0 ||
+        pread(pagemap_fd, map, n * sizeof(uint64_t), pos) != n * sizeof(uint64_t)) {
+        for (uint64_t i = 0; i < n; i++)
+            map[i] = PAGEMAP_PRESENT;
+    }
+}
+
+/*
+ * Runs of non-zero pages of [start, end) of a slot go out in one write
+ * each. With a pagemap fd, pages that were never mapped are not read at
+ * all, faulting in 4k zero pages is most of the cost for a large guest.
+ */
+static int snapshot_save_range(int fd, int pagemap_fd, uint8_t *host, uint64_t gpa,
+                               uint64_t start, uint64_t end, uint64_t *written)
+{
+    uint64_t map[PAGEMAP_BATCH];
+    uint64_t run = start;
+    bool in_run = false;
+
+    for (uint64_t off = start; off <= end; off += SNAPSHOT_PAGE_SIZE) {
+        uint64_t page = (off - start) / SNAPSHOT_PAGE_SIZE;
+        bool data = off < end;
+
+        if (data && page % PAGEMAP_BATCH == 0) {
+            uint64_t left = (end - off) / SNAPSHOT_PAGE_SIZE;
+
+            snapshot_pagemap(pagemap_fd, host + off,
+                             left < PAGEMAP_BATCH ? left : PAGEMAP_BATCH, map);
+        }
+        data = data && ((map[page % PAGEMAP_BATCH] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) ||
+                        coldmem_holds(host + off)) &&
+               !page_is_zero(host + off);
+
+        if (data && !in_run) {
+            run = off;
+            in_run = true;
+        } else if (!data && in_run) {
+            if (pwrite_full(fd, host + run, off - run, gpa + run) < 0)
+                return -1;
+            *written += off - run;
+            in_run = false;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reading a never touched page of a memfd allocates it, so fd backed
+ * slots are walked by their data extents and only those are scanned.
+ * Anonymous slots go by pagemap, reading a cold page faults it back.
+ */
+static int snapshot_save_slot(int fd, int pagemap_fd, int i, uint64_t *written)
+{
+    uint64_t gpa, size, off = 0;
+    int node, slot_fd = get_ram_slot_fd(i);
+    uint8_t *host;
+
+    if (get_ram_slot(i, &gpa, &size, &node) < 0 ||
+        !(host = get_userspace_ptr(gpa, size)))
+        return -1;
+    while (off < size) {
+        uint64_t end = size;
+
+        if (slot_fd >= 0) {
+            off_t data = lseek(slot_fd, off, SEEK_DATA);
+            off_t hole;
+
+            if (data < 0 && errno == ENXIO)
+                break;
+            if (data < 0) {
+                slot_fd = -1;
+                continue;
+            }
+            hole = lseek(slot_fd, data, SEEK_HOLE);
+            off = data;
+            if (hole > 0 && hole < end)
+                end = hole;
+        }
+        if (off >= size)
+            break;
+        if (snapshot_save_range(fd, slot_fd < 0 ? pagemap_fd : -1,
+                                host, gpa, off, end, written) < 0)
+            return -1;
+        off = end;
+    }
+    return 0;
+}
+
+static int snapshot_save_ram(const char *path, struct snapshot_slot *slots,
+                             int nr_slots, uint64_t *written)
+{
+    char *mem_path = snapshot_mem_path(path);
+    int fd, pagemap_fd, ret = 0;
+
+    if (!mem_path)
+        return -1;
+    fd = open(mem_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "can not create %s: %s\n", mem_path, strerror(errno));
+        free(mem_path);
+        return -1;
+    }
+    pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    for (int i = 0; i < nr_slots && ret == 0; i++)
+        ret = snapshot_save_slot(fd, pagemap_fd, i, written);
+    //the tail of the last slot may be a hole, the size still covers it
+    if (ret == 0 && nr_slots &&
+        ftruncate(fd, slots[nr_slots - 1].gpa + slots[nr_slots - 1].size) < 0)
+        ret = -1;
+    if (ret < 0)
+        fprintf(stderr, "write %s failed: %s\n", mem_path, strerror(errno));
+    if (pagemap_fd >= 0)
+        close(pagemap_fd);
+    close(fd);
+    free(mem_path);
+    return ret;
+}
+
+static int snapshot_save_section(FILE *fp, struct snapshot_section *section)
+{
+    struct snapshot_section_header hdr;
+    long start, end;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.name, section->name, SNAPSHOT_NAME_LEN - 1);
+    if (snapshot_write(fp, &hdr, sizeof(hdr)) < 0)
+        return -1;
+    start = ftell(fp);
+    if (section->save(section->opaque, fp) < 0) {
+        fprintf(stderr, "save snapshot section %s failed\n", section->name);
+        return -1;
+    }
+    end = ftell(fp);
+    //the length is only known once the section is written
+    hdr.len = end - start;
+    if (fseek(fp, start - sizeof(hdr), SEEK_SET) < 0 ||
+        snapshot_write(fp, &hdr, sizeof(hdr)) < 0 ||
+        fseek(fp, end, SEEK_SET) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * The vcpus must be paused. The io thread is held off too, so no
+ * virtqueue is halfway through a request and no queued guest write is
+ * left in the coalesced ring.
+ */
+int snapshot_save(const char *path)
+{
+    struct snapshot_slot slots[SNAPSHOT_SLOTS_MAX];
+    struct snapshot_header hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+    };
+    uint64_t start = now_ns(), written = 0, total = 0;
+    FILE *fp;
+    int ret = 0;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "can not create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ioeventfd_pause();
+    iobus_coalesced_flush();
+
+    hdr.nr_slots = snapshot_ram_layout(slots);
+    for (int i = 0; i < hdr.nr_slots; i++)
+        total += slots[i].size;
+    if (snapshot_write(fp, &hdr, sizeof(hdr)) < 0 ||
+        snapshot_write(fp, slots, hdr.nr_slots * sizeof(slots[0])) < 0)
+        ret = -1;
+    for (int i = 0; i < nr_sections && ret == 0; i++)
+        ret = snapshot_save_section(fp, &sections[i]);
+    if (ret == 0)
+        ret = snapshot_save_ram(path, slots, hdr.nr_slots, &written);
+
+    ioeventfd_resume();
+    if (fclose(fp) != 0)
+        ret = -1;
+    if (ret < 0) {
+        fprintf(stderr, "snapshot to %s failed\n", path);
+        return -1;
+    }
+    fprintf(stderr, "snapshot: %llu KiB of %llu MiB of ram written in %llu ms\n",
+            (unsigned long long)written >> 10, (unsigned long long)total >> 20,
+            (unsigned long long)(now_ns() - start) / 1000000);
+    return 0;
+}
+
+//copy the data extents of the memory file, holes are left as fresh zero pages
+static int snapshot_load_ram(const char *path, struct snapshot_slot *slots,
+                             int nr_slots, uint64_t *loaded)
+{
+    char *mem_path = snapshot_mem_path(path);
+    int fd, ret = 0;
+
+    if (!mem_path)
+        return -1;
+    fd = open(mem_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "can not open %s: %s\n", mem_path, strerror(errno));
+        free(mem_path);
+        return -1;
+    }
+    for (int i = 0; i < nr_slots && ret == 0; i++) {
+        uint64_t off = slots[i].gpa, end = slots[i].gpa + slots[i].size;
+        uint8_t *host = get_userspace_ptr(slots[i].gpa, slots[i].size);
+
+        if (!host) {
+            ret = -1;
+            break;
+        }
+        while (off < end) {
+            off_t data = lseek(fd, off, SEEK_DATA);
+            off_t hole;
+
+            if (data < 0 || data >= end)
+                break;
+            hole = lseek(fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > end)
+                hole = end;
+            if (pread_full(fd, host + (data - slots[i].gpa), hole - data, data) < 0) {
+                ret = -1;
+                break;
+            }
+            *loaded += hole - data;
+            off = hole;
+        }
+    }
+    if (ret < 0)
+        fprintf(stderr, "read %s failed\n", mem_path);
+    close(fd);
+    free(mem_path);
+    return ret;
+}
+
+/*
+ * Lazy restore. Guest ram is registered with userfaultfd and starts out
+ * empty. A fault in a data extent is served from the mapped memory file
+ * together with the rest of its 64K window, a fault in a hole gets the
+ * zero page. Prefetch threads copy the data extents meanwhile, lowest
+ * first; a copy never overwrites a page that is already in. Once all
+ * data is resident ram is unregistered and holes fault in like any
+ * fresh anonymous memory.
+ */
+#define LAZY_CHUNK		0x100000	//1M, one prefetch copy
+#define LAZY_FAULT_AROUND	0x10000
+#define LAZY_THREADS_MAX	16
+
+struct lazy_extent {
+    uint64_t gpa;
+    uint64_t len;
+    uint8_t *host;
+};
+
+struct restore_opts restore_opts;
+
+static struct uffd lazy_uffd;
+static uint8_t *lazy_file;
+static struct snapshot_slot lazy_slots[SNAPSHOT_SLOTS_MAX];
+static uint8_t *lazy_hosts[SNAPSHOT_SLOTS_MAX];
+static int nr_lazy_slots;
+static struct lazy_extent *lazy_extents;
+static uint64_t nr_lazy_extents;
+static uint64_t lazy_next;
+static int lazy_running;
+static int lazy_err;
+static uint64_t lazy_start_ns;
+static uint64_t lazy_bytes;
+static uint64_t lazy_fetched;
+static uint64_t lazy_faults;
+static uint64_t lazy_zero_faults;
+static uint64_t lazy_resident_ns;
+
+//"" for one prefetch thread per host cpu, or a thread count, 0 leaves ram to the faults
+int parse_restore_lazy(const char *arg)
+{
+    restore_opts.lazy = true;
+    restore_opts.threads = arg ? atoi(arg) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (restore_opts.threads < 0) {
+        fprintf(stderr, "invalid prefetch thread count %s\n", arg);
+        return -1;
+    }
+    if (restore_opts.threads > LAZY_THREADS_MAX)
+        restore_opts.threads = LAZY_THREADS_MAX;
+    return 0;
+}
+
+//the extent holding gpa, NULL for a hole
+static struct lazy_extent *lazy_find(uint64_t gpa)
+{
+    uint64_t lo = 0, hi = nr_lazy_extents;
+
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        struct lazy_extent *e = &lazy_extents[mid];
+
+        if (gpa < e->gpa)
+            hi = mid;
+        else if (gpa >= e->gpa + e->len)
+            lo = mid + 1;
+        else
+            return e;
+    }
+    return NULL;
+}
+
+static void lazy_fault(void *opaque, uint64_t addr, uint64_t flags)
+{
+    static uint8_t zero[SNAPSHOT_PAGE_SIZE];
+    struct lazy_extent *e = NULL;
+    uint64_t gpa = 0;
+    int ret;
+
+    for (int i = 0; i < nr_lazy_slots; i++) {
+        uint64_t host = (uint64_t)lazy_hosts[i];
+
+        if (addr >= host && addr < host + lazy_slots[i].size) {
+            gpa = lazy_slots[i].gpa + addr - host;
+            e = lazy_find(gpa);
+            break;
+        }
+    }
+    if (e) {
+        uint64_t start = gpa & ~(LAZY_FAULT_AROUND - 1);
+        uint64_t end = start + LAZY_FAULT_AROUND;
+
+        if (start < e->gpa)
+            start = e->gpa;
+        if (end > e->gpa + e->len)
+            end = e->gpa + e->len;
+        ret = uffd_copy(&lazy_uffd, addr - (gpa - start), lazy_file + start, end - start);
+        __atomic_fetch_add(&lazy_faults, 1, __ATOMIC_RELAXED);
+    } else if (flags & UFFD_PAGEFAULT_FLAG_WRITE) {
+        //a write would fault the zero page right away again
+        ret = uffd_copy(&lazy_uffd, addr, zero, SNAPSHOT_PAGE_SIZE);
+        __atomic_fetch_add(&lazy_zero_faults, 1, __ATOMIC_RELAXED);
+    } else {
+        ret = uffd_zeropage(&lazy_uffd, addr, SNAPSHOT_PAGE_SIZE);
+        __atomic_fetch_add(&lazy_zero_faults, 1, __ATOMIC_RELAXED);
+    }
+    if (ret < 0)
+        fprintf(stderr, "lazy restore can not fill page at %p\n", (void *)addr);
+}
+
+/*
+ * All data is in, holes no longer need the fault thread. The file stays
+ * mapped, a fault that raced with the unregister may still copy from it.
+ */
+static void lazy_finish()
+{
+    for (int i = 0; i < nr_lazy_slots; i++)
+        uffd_unregister(&lazy_uffd, lazy_hosts[i], lazy_slots[i].size);
+    __atomic_store_n(&lazy_resident_ns, now_ns() - lazy_start_ns, __ATOMIC_RELEASE);
+    fprintf(stderr, "restore: ram resident after %llu ms, %llu KiB prefetched, %llu faults\n",
+            (unsigned long long)lazy_resident_ns / 1000000,
+            (unsigned long long)lazy_fetched >> 10,
+            (unsigned long long)lazy_faults + lazy_zero_faults);
+}
+
+static void *lazy_prefetch_fn(void *arg)
+{
+    for (;;) {
+        uint64_t i = __atomic_fetch_add(&lazy_next, 1, __ATOMIC_RELAXED);
+        struct lazy_extent *e;
+
+        if (i >= nr_lazy_extents || __atomic_load_n(&lazy_err, __ATOMIC_RELAXED))
+            break;
+        e = &lazy_extents[i];
+        if (uffd_copy(&lazy_uffd, (uint64_t)e->host, lazy_file + e->gpa, e->len) < 0) {
+            fprintf(stderr, "lazy restore prefetch at 0x%llx failed: %s\n",
+                    (unsigned long long)e->gpa, strerror(errno));
+            __atomic_store_n(&lazy_err, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_fetch_add(&lazy_fetched, e->len, __ATOMIC_RELAXED);
+    }
+    //the last thread out unregisters, unless ram is still missing data
+    if (__atomic_sub_fetch(&lazy_running, 1, __ATOMIC_ACQ_REL) == 0 &&
+        !__atomic_load_n(&lazy_err, __ATOMIC_RELAXED))
+        lazy_finish();
+    return NULL;
+}
+
+static int lazy_add_extent(uint64_t gpa, uint64_t len, uint8_t *host)
+{
+    static uint64_t max_extents;
+
+    if (nr_lazy_extents == max_extents) {
+        uint64_t n = max_extents ? max_extents * 2 : 256;
+        struct lazy_extent *extents = realloc(lazy_extents, n * sizeof(*extents));
+
+        if (!extents)
+            return -1;
+        lazy_extents = extents;
+        max_extents = n;
+    }
+    lazy_extents[nr_lazy_extents++] = (struct lazy_extent) {
+        .gpa = gpa,
+        .len = len,
+        .host = host,
+    };
+    lazy_bytes += len;
+    return 0;
+}
+
+//data extents of the memory file inside the slots, cut into prefetch chunks
+static int lazy_scan_extents(int fd)
+{
+    for (int i = 0; i < nr_lazy_slots; i++) {
+        uint64_t gpa = lazy_slots[i].gpa, end = gpa + lazy_slots[i].size;
+        uint64_t off = gpa;
+
+        while (off < end) {
+            off_t data = lseek(fd, off, SEEK_DATA);
+            off_t hole;
+
+            if (data < 0 || data >= end)
+                break;
+            hole = lseek(fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > end)
+                hole = end;
+            for (off = data; off < hole; off += LAZY_CHUNK) {
+                uint64_t len = hole - off < LAZY_CHUNK ? hole - off : LAZY_CHUNK;
+
+                if (lazy_add_extent(off, len, lazy_hosts[i] + (off - gpa)) < 0)
+                    return -1;
+            }
+            off = hole;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies into ram never overwrite, so anything already in it would
+ * shadow the snapshot; the slots are emptied before they are registered.
+ */
+static int snapshot_lazy_ram(const char *path, struct snapshot_slot *slots, int nr_slots)
+{
+    char *mem_path = snapshot_mem_path(path);
+    struct stat st;
+    int fd, ret = -1;
+
+    if (mem_opts.backend != MemBackendAnon && mem_opts.backend != MemBackendThp) {
+        fprintf(stderr, "lazy restore needs anon or thp guest ram\n");
+        return -1;
+    }
+    if (!mem_path)
+        return -1;
+    fd = open(mem_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "can not open %s: %s\n", mem_path, strerror(errno));
+        goto out;
+    }
+    lazy_file = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (lazy_file == MAP_FAILED) {
+        fprintf(stderr, "can not map %s: %s\n", mem_path, strerror(errno));
+        goto out;
+    }
+
+    nr_lazy_slots = nr_slots;
+    for (int i = 0; i < nr_slots; i++) {
+        lazy_slots[i] = slots[i];
+        lazy_hosts[i] = get_userspace_ptr(slots[i].gpa, slots[i].size);
+        if (!lazy_hosts[i] || slots[i].gpa + slots[i].size > st.st_size)
+            goto out;
+    }
+    if (lazy_scan_extents(fd) < 0 ||
+        uffd_open(&lazy_uffd, 0, lazy_fault, NULL) < 0)
+        goto out;
+    for (int i = 0; i < nr_slots; i++) {
+        if (discard_guest_ram(slots[i].gpa, slots[i].size, false) < 0 ||
+            uffd_register(&lazy_uffd, lazy_hosts[i], slots[i].size,
+                          UFFDIO_REGISTER_MODE_MISSING) < 0)
+            goto out;
+    }
+    ret = 0;
+out:
+    if (fd >= 0)
+        close(fd);
+    free(mem_path);
+    return ret;
+}
+
+static void lazy_start_prefetch()
+{
+    pthread_t thread;
+
+    lazy_running = restore_opts.threads;
+    for (int i = 0; i < restore_opts.threads; i++) {
+        if (thread_create(&thread, ThreadBulk, i, lazy_prefetch_fn, NULL) != 0) {
+            fprintf(stderr, "can not create prefetch thread\n");
+            //what is left is served by faults
+            __atomic_store_n(&lazy_err, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&lazy_running, restore_opts.threads - i, __ATOMIC_ACQ_REL);
+            break;
+        }
+    }
+}
+
+void snapshot_dump(FILE *out)
+{
+    uint64_t resident_ns = __atomic_load_n(&lazy_resident_ns, __ATOMIC_ACQUIRE);
+
+    if (!restore_opts.lazy)
+        return;
+    fprintf(out, "lazy restore data:    %llu KiB\n", (unsigned long long)lazy_bytes >> 10);
+    fprintf(out, "lazy restore fetched: %llu KiB\n", (unsigned long long)lazy_fetched >> 10);
+    fprintf(out, "lazy restore faults:  %llu (%llu zero)\n",
+            (unsigned long long)lazy_faults + lazy_zero_faults,
+            (unsigned long long)lazy_zero_faults);
+    if (resident_ns)
+        fprintf(out, "lazy restore resident after %llu ms\n",
+                (unsigned long long)resident_ns / 1000000);
+    else
+        fprintf(out, "lazy restore not resident yet\n");
+}
+
+static struct snapshot_section *snapshot_find_section(const char *name)
+{
+    for (int i = 0; i < nr_sections; i++) {
+        if (!strcmp(sections[i].name, name))
+            return &sections[i];
+    }
+    return NULL;
+}
+
+static int snapshot_load_sections(FILE *fp)
+{
+    struct snapshot_section_header hdr;
+    struct snapshot_section *section;
+
+    while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+        long start = ftell(fp);
+
+        hdr.name[SNAPSHOT_NAME_LEN - 1] = '\0';
+        section = snapshot_find_section(hdr.name);
+        if (!section) {
+            fprintf(stderr, "snapshot has state for %s, which this vm lacks\n", hdr.name);
+            return -1;
+        }
+        if (section->load(section->opaque, fp, hdr.len) < 0 ||
+            ftell(fp) != start + (long)hdr.len) {
+            fprintf(stderr, "load snapshot section %s failed\n", hdr.name);
+            return -1;
+        }
+        section->loaded = true;
+    }
+    for (int i = 0; i < nr_sections; i++) {
+        if (!sections[i].loaded) {
+            fprintf(stderr, "snapshot has no state for %s\n", sections[i].name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Runs once all devices exist and before the vcpus start. Ram goes
+ * first, restored virtqueues look at their rings; with a lazy restore
+ * those reads already go through the fault thread.
+ */
+int snapshot_restore(const char *path)
+{
+    struct snapshot_slot slots[SNAPSHOT_SLOTS_MAX], saved[SNAPSHOT_SLOTS_MAX];
+    struct snapshot_header hdr;
+    uint64_t start = now_ns(), loaded = 0;
+    int nr_slots = snapshot_ram_layout(slots);
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "can not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (snapshot_read(fp, &hdr, sizeof(hdr)) < 0 ||
+        hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION ||
+        hdr.nr_slots > SNAPSHOT_SLOTS_MAX ||
+        snapshot_read(fp, saved, hdr.nr_slots * sizeof(saved[0])) < 0) {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+        goto err;
+    }
+    if (hdr.nr_slots != nr_slots ||
+        memcmp(saved, slots, nr_slots * sizeof(slots[0]))) {
+        fprintf(stderr, "snapshot ram layout differs, restore with the same memory options\n");
+        goto err;
+    }
+    if (restore_opts.lazy) {
+        lazy_start_ns = start;
+        if (snapshot_lazy_ram(path, slots, nr_slots) < 0)
+            goto err;
+    } else if (snapshot_load_ram(path, slots, nr_slots, &loaded) < 0) {
+        goto err;
+    }
+    if (snapshot_load_sections(fp) < 0)
+        goto err;
+    fclose(fp);
+    if (restore_opts.lazy) {
+        //the vcpus start right after this, it is the time to the first guest instruction
+        fprintf(stderr, "restore: vcpus start after %llu ms, %llu KiB of ram left to fault in\n",
+                (unsigned long long)(now_ns() - start) / 1000000,
+                (unsigned long long)lazy_bytes >> 10);
+        lazy_start_prefetch();
+        return 0;
+    }
+    fprintf(stderr, "restore: %llu KiB of ram loaded in %llu ms\n",
+            (unsigned long long)loaded >> 10,
+            (unsigned long long)(now_ns() - start) / 1000000);
+    return 0;
+
+err:
+    fclose(fp);
+    return -1;
+}
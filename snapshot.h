@@ -0,0 +1,28 @@
+#ifndef MICROV_SNAPSHOT_H
+#define MICROV_SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct restore_opts {
+    bool lazy;          //serve ram through userfaultfd while the guest runs
+    int threads;        //prefetch threads, 0 leaves ram to the faults
+};
+
+extern struct restore_opts restore_opts;
+
+typedef int (*snapshot_save_fn)(void *opaque, FILE *fp);
+typedef int (*snapshot_load_fn)(void *opaque, FILE *fp, uint64_t len);
+
+int parse_restore_lazy(const char *arg);
+int snapshot_init(int vmfd);
+void snapshot_register(const char *name, snapshot_save_fn save,
+                       snapshot_load_fn load, void *opaque);
+int snapshot_write(FILE *fp, const void *data, uint64_t len);
+int snapshot_read(FILE *fp, void *data, uint64_t len);
+int snapshot_save(const char *path);
+int snapshot_restore(const char *path);
+void snapshot_dump(FILE *out);
+
+#endif /* MICROV_SNAPSHOT_H */
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "global.h"
+#include "thread.h"
+
+#define THREAD_MAX_CPUS 1024
+
+/*
+ * Host placement of each thread class. vcpu threads are pinned one per
+ * host cpu, the index-th vcpu to the index-th cpu of the list, io threads
+ * (ioeventfd, serial) float over the whole housekeeping list. Bulk threads
+ * (prefault, lazy restore prefetch) have no options and keep the default
+ * policy, so they neither crowd the housekeeping cpus nor run at io rt
+ * priority.
+ */
+struct ThreadPolicy {
+    int cpus[THREAD_MAX_CPUS];
+    int nr_cpus;
+    int rt_prio;
+};
+
+static struct ThreadPolicy policies[ThreadClassEnd];
+//per vcpu fallback when no explicit vcpu list is given, e.g. a numa node's cpus
+static cpu_set_t vcpu_sets[VCPU_MAX];
+static bool vcpu_set_valid[VCPU_MAX];
+static const char *class_names[ThreadClassEnd] = {"vcpu", "io", "bulk"};
+
+//monotonic clock for timing threads and phases
+uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//parse "0-3,8,10-11" into cpus[], keeping the given order
+int parse_cpulist(const char *cpulist, int *cpus, int max)
+{
+    int n = 0;
+    const char *p = cpulist;
+
+    while (*p) {
+        char *end;
+        long first, last;
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (n >= max || cpu >= CPU_SETSIZE)
+                return -1;
+            cpus[n++] = cpu;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+    return n;
+}
+
+int thread_set_affinity(enum ThreadClass cls, const char *cpulist)
+{
+    int n = parse_cpulist(cpulist, policies[cls].cpus, THREAD_MAX_CPUS);
+
+    if (n <= 0) {
+        fprintf(stderr, "invalid %s cpu list: %s\n", class_names[cls], cpulist);
+        return -1;
+    }
+    policies[cls].nr_cpus = n;
+    return 0;
+}
+
+int thread_set_rt_prio(enum ThreadClass cls, int prio)
+{
+    int min = sched_get_priority_min(SCHED_FIFO);
+    int max = sched_get_priority_max(SCHED_FIFO);
+
+    if (prio < min || prio > max) {
+        fprintf(stderr, "%s rt priority must be %d-%d\n",
+                class_names[cls], min, max);
+        return -1;
+    }
+    policies[cls].rt_prio = prio;
+    return 0;
+}
+
+int thread_set_vcpu_cpulist(int index, const char *cpulist)
+{
+    int cpus[THREAD_MAX_CPUS];
+    int n;
+
+    if (index < 0 || index >= VCPU_MAX)
+        return -1;
+    n = parse_cpulist(cpulist, cpus, THREAD_MAX_CPUS);
+    if (n <= 0) {
+        fprintf(stderr, "invalid cpu list %s\n", cpulist);
+        return -1;
+    }
+    CPU_ZERO(&vcpu_sets[index]);
+    for (int i = 0; i < n; i++)
+        CPU_SET(cpus[i], &vcpu_sets[index]);
+    vcpu_set_valid[index] = true;
+    return 0;
+}
+
+//a vcpu list must give every vcpu a host cpu of its own, checked once -s is known
+int thread_check_vcpu_affinity(int vcpu_count)
+{
+    struct ThreadPolicy *policy = &policies[ThreadVcpu];
+
+    if (policy->nr_cpus > 0 && policy->nr_cpus < vcpu_count) {
+        fprintf(stderr, "--vcpu-affinity lists %d host cpus for %d vcpus\n",
+                policy->nr_cpus, vcpu_count);
+        return -1;
+    }
+    return 0;
+}
+
+//the host cpu a pinned thread runs on, -1 when it floats
+int thread_host_cpu(enum ThreadClass cls, int index)
+{
+    struct ThreadPolicy *policy = &policies[cls];
+
+    if (cls != ThreadVcpu || policy->nr_cpus == 0)
+        return -1;
+    return policy->cpus[index];
+}
+
+static void thread_init_attr(pthread_attr_t *attr, enum ThreadClass cls,
+                             int index)
+{
+    struct ThreadPolicy *policy = &policies[cls];
+
+    pthread_attr_init(attr);
+
+    if (policy->nr_cpus > 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        if (cls == ThreadVcpu) {
+            CPU_SET(policy->cpus[index], &set);
+        } else {
+            for (int i = 0; i < policy->nr_cpus; i++)
+                CPU_SET(policy->cpus[i], &set);
+        }
+        pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    } else if (cls == ThreadVcpu && index < VCPU_MAX && vcpu_set_valid[index]) {
+        pthread_attr_setaffinity_np(attr, sizeof(vcpu_sets[index]), &vcpu_sets[index]);
+    }
+
+    if (policy->rt_prio > 0) {
+        struct sched_param param = { .sched_priority = policy->rt_prio };
+
+        pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+        pthread_attr_setschedparam(attr, &param);
+    }
+}
+
+int thread_create(pthread_t *thread, enum ThreadClass cls, int index,
+                  thread_fn fn, void *arg)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    thread_init_attr(&attr, cls, index);
+    ret = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (ret == 0)
+        return 0;
+
+    //no CAP_SYS_NICE or cpus outside our cpuset, run unpinned rather than not at all
+    fprintf(stderr, "create %s thread %d with policy failed: %s, using defaults\n",
+            class_names[cls], index, strerror(ret));
+    ret = pthread_create(thread, NULL, fn, arg);
+    return ret == 0 ? 0 : -1;
+}
@@ -0,0 +1,27 @@
+#ifndef MICROV_THREAD_H
+#define MICROV_THREAD_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+enum ThreadClass
+{
+    ThreadVcpu = 0,
+    ThreadIo,
+    ThreadBulk,     //copy heavy workers, default policy, never pinned or rt
+    ThreadClassEnd
+};
+
+typedef void *(*thread_fn)(void *);
+
+int thread_set_affinity(enum ThreadClass cls, const char *cpulist);
+int thread_set_rt_prio(enum ThreadClass cls, int prio);
+int thread_create(pthread_t *thread, enum ThreadClass cls, int index,
+                  thread_fn fn, void *arg);
+int thread_set_vcpu_cpulist(int index, const char *cpulist);
+int thread_check_vcpu_affinity(int vcpu_count);
+int thread_host_cpu(enum ThreadClass cls, int index);
+int parse_cpulist(const char *cpulist, int *cpus, int max);
+uint64_t now_ns();
+
+#endif /* MICROV_THREAD_H */
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kvm.h>
+
+#include "global.h"
+#include "vcpu.h"
+#include "thread.h"
+#include "topology.h"
+
+#define X86_FEATURE_HTT		28
+
+//leaf 0xb/0x1f level types
+#define TOPO_LEVEL_INVALID	0
+#define TOPO_LEVEL_SMT		1
+#define TOPO_LEVEL_CORE		2
+
+struct cpu_topology cpu_topology = {
+    .sockets = 1,
+    .cores = 1,
+    .threads = 1,
+};
+
+static int count_bits(int n)
+{
+    int bits = 0;
+
+    while ((1 << bits) < n)
+        bits++;
+    return bits;
+}
+
+static int parse_level(const char *tok, const char *name, int *val)
+{
+    size_t len = strlen(name);
+    char *end;
+
+    if (strncmp(tok, name, len) || tok[len] != '=')
+        return 0;
+    *val = strtol(tok + len + 1, &end, 10);
+    if (*end || *val < 1)
+        return -1;
+    return 1;
+}
+
+/*
+ * "n", "n,sockets=s,cores=c,threads=t" or just the levels. Missing
+ * sockets and threads default to 1, missing cores are sized to fit n.
+ * Returns the vcpu count.
+ */
+int parse_smp(const char *arg)
+{
+    char buf[128];
+    char *save = NULL;
+    int cpus = 0, sockets = 0, cores = 0, threads = 0;
+
+    if (strlen(arg) >= sizeof(buf))
+        return -1;
+    strcpy(buf, arg);
+
+    for (char *tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        int ret;
+
+        if ((ret = parse_level(tok, "sockets", &sockets)) ||
+            (ret = parse_level(tok, "cores", &cores)) ||
+            (ret = parse_level(tok, "threads", &threads))) {
+            if (ret < 0)
+                goto err;
+            continue;
+        }
+        char *end;
+        cpus = strtol(tok, &end, 10);
+        if (*end || cpus < 1)
+            goto err;
+    }
+
+    if (!sockets)
+        sockets = 1;
+    if (!threads)
+        threads = 1;
+    if (!cores)
+        cores = cpus ? (cpus + sockets * threads - 1) / (sockets * threads) : 1;
+    if (!cpus)
+        cpus = sockets * cores * threads;
+    if (cpus > sockets * cores * threads) {
+        fprintf(stderr, "%d vcpus do not fit %d sockets x %d cores x %d threads\n",
+                cpus, sockets, cores, threads);
+        return -1;
+    }
+
+    cpu_topology.sockets = sockets;
+    cpu_topology.cores = cores;
+    cpu_topology.threads = threads;
+    cpu_topology.smt_bits = count_bits(threads);
+    cpu_topology.core_bits = count_bits(cores);
+    return cpus;
+
+err:
+    fprintf(stderr, "invalid smp %s\n", arg);
+    return -1;
+}
+
+uint32_t topology_apic_id(int cpu_index)
+{
+    struct cpu_topology *t = &cpu_topology;
+    uint32_t thread = cpu_index % t->threads;
+    uint32_t core = cpu_index / t->threads % t->cores;
+    uint32_t socket = cpu_index / t->threads / t->cores;
+
+    return (socket << (t->core_bits + t->smt_bits)) |
+           (core << t->smt_bits) | thread;
+}
+
+uint32_t topology_max_apic_id(int vcpu_count)
+{
+    return topology_apic_id(vcpu_count - 1);
+}
+
+//leaf 0xb and its successor 0x1f: smt level, core level, terminator
+static void setup_ext_topology(struct kvm_cpuid2 *cpuid, uint32_t max,
+                               uint32_t function, uint32_t apic_id)
+{
+    struct cpu_topology *t = &cpu_topology;
+    const struct {
+        uint32_t shift, count, type;
+    } levels[] = {
+        {t->smt_bits, t->threads, TOPO_LEVEL_SMT},
+        {t->smt_bits + t->core_bits, t->threads * t->cores, TOPO_LEVEL_CORE},
+        {0, 0, TOPO_LEVEL_INVALID},
+    };
+    struct kvm_cpuid_entry2 *entry;
+
+    for (int i = 0; i < cpuid->nent; i++) {
+        entry = &cpuid->entries[i];
+        if (entry->function == function && entry->index >= 3) {
+            entry->eax = entry->ebx = 0;
+            entry->ecx = entry->index;
+            entry->edx = apic_id;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        entry = cpuid_entry(cpuid, max, function, i, true);
+        if (!entry)
+            return;
+        entry->flags |= KVM_CPUID_FLAG_SIGNIFCANT_INDEX;
+        entry->eax = levels[i].shift;
+        entry->ebx = levels[i].count;
+        entry->ecx = i | (levels[i].type << 8);
+        entry->edx = apic_id;
+    }
+}
+
+void topology_setup_cpuid(struct kvm_cpuid2 *cpuid, uint32_t max, int cpu_index)
+{
+    struct cpu_topology *t = &cpu_topology;
+    uint32_t apic_id = topology_apic_id(cpu_index);
+    uint32_t pkg_bits = t->smt_bits + t->core_bits;
+    struct kvm_cpuid_entry2 *entry;
+
+    for (int i = 0; i < cpuid->nent; i++) {
+        entry = &cpuid->entries[i];
+        switch (entry->function) {
+        case 1:
+            //initial apic id and addressable ids per package
+            entry->ebx &= 0x0000ffff;
+            entry->ebx |= apic_id << 24;
+            entry->ebx |= ((1 << pkg_bits) & 0xff) << 16;
+            if (pkg_bits) {
+                entry->edx |= 1 << X86_FEATURE_HTT;
+            }
+            break;
+        case 4:
+        case 0x8000001d:
+            if ((entry->eax & 0x1f) == 0)
+                break;
+            //l1 and l2 belong to a core, l3 to the whole socket
+            entry->eax &= ~0x03ffc000;
+            if (((entry->eax >> 5) & 0x7) <= 2) {
+                entry->eax |= ((1 << t->smt_bits) - 1) << 14;
+            } else {
+                entry->eax |= ((1 << pkg_bits) - 1) << 14;
+            }
+            if (entry->function == 4) {
+                entry->eax &= ~0xfc000000;
+                entry->eax |= ((1 << t->core_bits) - 1) << 26;
+            }
+            break;
+        case 0x8000001e:
+            entry->eax = apic_id;
+            entry->ebx = ((apic_id >> t->smt_bits) & 0xff) | ((t->threads - 1) << 8);
+            entry->ecx = apic_id >> pkg_bits;
+            break;
+        }
+    }
+
+    setup_ext_topology(cpuid, max, 0xb, apic_id);
+    entry = cpuid_entry(cpuid, max, 0, 0, false);
+    if (entry && entry->eax >= 0x1f) {
+        setup_ext_topology(cpuid, max, 0x1f, apic_id);
+    }
+}
+
+static int read_cpu_topology(int cpu, const char *name)
+{
+    char path[128];
+    FILE *f;
+    int val = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &val) != 1)
+        val = -1;
+    fclose(f);
+    return val;
+}
+
+/*
+ * The guest scheduler trusts the topology it is given, so warn when the
+ * vcpu pinning contradicts it: guest siblings on different host cores
+ * share nothing, guest cores on one host core fight over it.
+ */
+void topology_check_pinning(int vcpu_count)
+{
+    int pkg[VCPU_MAX], core[VCPU_MAX], host[VCPU_MAX];
+
+    for (int i = 0; i < vcpu_count; i++) {
+        host[i] = thread_host_cpu(ThreadVcpu, i);
+        if (host[i] < 0)
+            return;
+        pkg[i] = read_cpu_topology(host[i], "physical_package_id");
+        core[i] = read_cpu_topology(host[i], "core_id");
+        if (pkg[i] < 0 || core[i] < 0)
+            return;
+    }
+
+    for (int i = 0; i < vcpu_count; i++) {
+        for (int j = i + 1; j < vcpu_count; j++) {
+            bool guest_sibling = i / cpu_topology.threads == j / cpu_topology.threads;
+            bool host_sibling = pkg[i] == pkg[j] && core[i] == core[j];
+
+            if (host[i] == host[j]) {
+                fprintf(stderr, "vcpu %d and %d share host cpu %d\n", i, j, host[i]);
+                continue;
+            }
+            if (guest_sibling == host_sibling)
+                continue;
+            fprintf(stderr, "vcpu %d and %d are %s in the guest but host cpus %d and %d are %s\n",
+                    i, j, guest_sibling ? "siblings" : "separate cores",
+                    host[i], host[j], host_sibling ? "siblings" : "separate cores");
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef MICROV_TOPOLOGY_H
+#define MICROV_TOPOLOGY_H
+
+#include <stdint.h>
+#include <linux/kvm.h>
+
+/*
+ * Guest cpu topology. vcpu indexes fill threads first, then cores, then
+ * sockets, so vcpus 2n and 2n+1 are siblings with threads=2. APIC ids
+ * pack each level into a power of two field like real hardware does,
+ * which leaves holes when a count is not a power of two.
+ */
+struct cpu_topology {
+    int sockets;
+    int cores;      //per socket
+    int threads;    //per core
+    int smt_bits;
+    int core_bits;
+};
+
+extern struct cpu_topology cpu_topology;
+
+int parse_smp(const char *arg);
+uint32_t topology_apic_id(int cpu_index);
+uint32_t topology_max_apic_id(int vcpu_count);
+void topology_setup_cpuid(struct kvm_cpuid2 *cpuid, uint32_t max, int cpu_index);
+void topology_check_pinning(int vcpu_count);
+
+#endif /* MICROV_TOPOLOGY_H */
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "thread.h"
+#include "uffd.h"
+
+#define UFFD_PAGE_SIZE	0x1000
+
+//faults from kvm come from kernel mode, so no UFFD_USER_MODE_ONLY
+static int uffd_create()
+{
+    int fd = syscall(SYS_userfaultfd, O_CLOEXEC);
+    int dev;
+
+    if (fd >= 0 || errno != EPERM)
+        return fd;
+    //vm.unprivileged_userfaultfd=0, the device node may still be open to us
+    dev = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+    if (dev < 0)
+        return -1;
+    fd = ioctl(dev, USERFAULTFD_IOC_NEW, O_CLOEXEC);
+    close(dev);
+    return fd;
+}
+
+static void *uffd_thread_fn(void *arg)
+{
+    struct uffd *uffd = arg;
+    struct uffd_msg msg;
+
+    for (;;) {
+        ssize_t n = read(uffd->fd, &msg, sizeof(msg));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != sizeof(msg)) {
+            fprintf(stderr, "userfaultfd read failed\n");
+            return NULL;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+        uffd->fn(uffd->opaque, msg.arg.pagefault.address & ~0xfffULL,
+                 msg.arg.pagefault.flags);
+    }
+    return NULL;
+}
+
+int uffd_open(struct uffd *uffd, uint64_t features, uffd_fault_fn fn, void *opaque)
+{
+    struct uffdio_api api = {
+        .api = UFFD_API,
+        .features = features,
+    };
+
+    uffd->fn = fn;
+    uffd->opaque = opaque;
+    uffd->fd = uffd_create();
+    if (uffd->fd < 0) {
+        fprintf(stderr, "userfaultfd failed, check vm.unprivileged_userfaultfd\n");
+        return -1;
+    }
+    if (ioctl(uffd->fd, UFFDIO_API, &api) < 0 || (api.features & features) != features) {
+        fprintf(stderr, "userfaultfd features 0x%llx not supported\n",
+                (unsigned long long)features);
+        close(uffd->fd);
+        return -1;
+    }
+    if (thread_create(&uffd->thread, ThreadIo, 0, uffd_thread_fn, uffd) != 0) {
+        fprintf(stderr, "can not create userfaultfd thread\n");
+        close(uffd->fd);
+        return -1;
+    }
+    return 0;
+}
+
+int uffd_register(struct uffd *uffd, void *addr, uint64_t len, uint64_t mode)
+{
+    struct uffdio_register reg = {
+        .range = { .start = (uint64_t)addr, .len = len },
+        .mode = mode,
+    };
+
+    if (ioctl(uffd->fd, UFFDIO_REGISTER, &reg) < 0) {
+        fprintf(stderr, "userfaultfd register failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+int uffd_unregister(struct uffd *uffd, void *addr, uint64_t len)
+{
+    struct uffdio_range range = { .start = (uint64_t)addr, .len = len };
+
+    if (ioctl(uffd->fd, UFFDIO_UNREGISTER, &range) < 0) {
+        fprintf(stderr, "userfaultfd unregister failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * EEXIST means another fault got there first, the page is in either
+ * way. It stops a multi page copy at that page, the rest is carried on
+ * after it.
+ */
+int uffd_copy(struct uffd *uffd, uint64_t dst, const void *src, uint64_t len)
+{
+    struct uffdio_copy copy = {
+        .dst = dst,
+        .src = (uint64_t)src,
+        .len = len,
+    };
+
+    while (ioctl(uffd->fd, UFFDIO_COPY, &copy) < 0) {
+        if (errno == EEXIST) {
+            if (copy.len <= UFFD_PAGE_SIZE)
+                return 0;
+            copy.dst += UFFD_PAGE_SIZE;
+            copy.src += UFFD_PAGE_SIZE;
+            copy.len -= UFFD_PAGE_SIZE;
+            copy.copy = 0;
+            continue;
+        }
+        if (errno != EAGAIN)
+            return -1;
+        //partial copy while the mm changed, carry on after it
+        if (copy.copy > 0) {
+            copy.dst += copy.copy;
+            copy.src += copy.copy;
+            copy.len -= copy.copy;
+        }
+        copy.copy = 0;
+    }
+    return 0;
+}
+
+int uffd_zeropage(struct uffd *uffd, uint64_t dst, uint64_t len)
+{
+    struct uffdio_zeropage zero = {
+        .range = { .start = dst, .len = len },
+    };
+
+    while (ioctl(uffd->fd, UFFDIO_ZEROPAGE, &zero) < 0) {
+        if (errno == EEXIST)
+            return 0;
+        if (errno != EAGAIN)
+            return -1;
+    }
+    return 0;
+}
+
+//clearing write protection also wakes threads blocked on it
+int uffd_writeprotect(struct uffd *uffd, uint64_t addr, uint64_t len, bool wp)
+{
+    struct uffdio_writeprotect prot = {
+        .range = { .start = addr, .len = len },
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    return ioctl(uffd->fd, UFFDIO_WRITEPROTECT, &prot);
+}
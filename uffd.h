@@ -0,0 +1,30 @@
+#ifndef MICROV_UFFD_H
+#define MICROV_UFFD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <linux/userfaultfd.h>
+
+/*
+ * A userfaultfd with its own fault thread. fn runs on that thread for
+ * every fault with the page aligned address and UFFD_PAGEFAULT_FLAG_*,
+ * and must resolve it (copy, zeropage or writeprotect) before returning.
+ */
+typedef void (*uffd_fault_fn)(void *opaque, uint64_t addr, uint64_t flags);
+
+struct uffd {
+    int fd;
+    pthread_t thread;
+    uffd_fault_fn fn;
+    void *opaque;
+};
+
+int uffd_open(struct uffd *uffd, uint64_t features, uffd_fault_fn fn, void *opaque);
+int uffd_register(struct uffd *uffd, void *addr, uint64_t len, uint64_t mode);
+int uffd_unregister(struct uffd *uffd, void *addr, uint64_t len);
+int uffd_copy(struct uffd *uffd, uint64_t dst, const void *src, uint64_t len);
+int uffd_zeropage(struct uffd *uffd, uint64_t dst, uint64_t len);
+int uffd_writeprotect(struct uffd *uffd, uint64_t addr, uint64_t len, bool wp);
+
+#endif /* MICROV_UFFD_H */
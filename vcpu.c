@@ -2,19 +2,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <linux/kvm.h>
+#include <linux/kvm_para.h>
 #include <sys/ioctl.h>
 
 #include "global.h"
 #include "memory.h"
 #include "gdt.h"
+#include "vcpu.h"
+#include "topology.h"
+
 #define KVM_MAX_CPUID_ENTRIES 80
 
-#define X86_FEATURE_HYPERVISOR		31
+//leaf 1 ecx
+#define X86_FEATURE_MWAIT		3
 #define X86_FEATURE_TSC_DEADLINE_TIMER	24
+#define X86_FEATURE_HYPERVISOR		31
+#define X86_FEATURE_PDCM		15
+//leaf 7 ebx
+#define X86_FEATURE_TSC_ADJUST		1
+//leaf 0xd.1 eax
+#define X86_FEATURE_XSAVES		3
+//leaf 0x80000001 ecx
+#define X86_FEATURE_PERFCTR_CORE	23
+//leaf 0x80000001 edx
+#define X86_FEATURE_GBPAGES		26
+#define X86_FEATURE_RDTSCP		27
 
 #define ECX_EPB_SHIFT 3
 
 //see kernel arch/x86/include/asm/apicdef.h
+#define	APIC_ID			0x20
 #define	APIC_LVT0		0x350
 #define	APIC_LVT1		0x360
 #define	APIC_MODE_NMI		0x4
@@ -36,6 +53,27 @@
 #define MSR_IA32_SYSENTER_ESP	0x0175
 #define MSR_IA32_SYSENTER_EIP	0x0176
 #define MSR_IA32_MISC_ENABLE	0x01a0
+#define MSR_IA32_CR_PAT		0x0277
+#define MSR_IA32_TSC_ADJUST	0x003b
+#define MSR_IA32_TSC_DEADLINE	0x06e0
+#define MSR_IA32_XSS		0x0da0
+#define MSR_TSC_AUX		0xc0000103
+
+#define MSR_IA32_PERFCTR0		0x00c1
+#define MSR_P6_EVNTSEL0			0x0186
+#define MSR_CORE_PERF_FIXED_CTR0	0x0309
+#define MSR_CORE_PERF_FIXED_CTR_CTRL	0x038d
+#define MSR_CORE_PERF_GLOBAL_CTRL	0x038f
+#define MSR_CORE_PERF_GLOBAL_OVF_CTRL	0x0390
+#define MSR_K7_EVNTSEL0			0xc0010000
+#define MSR_K7_PERFCTR0			0xc0010004
+#define MSR_F15H_PERF_CTL		0xc0010200
+#define AMD64_NUM_COUNTERS		4
+#define AMD64_NUM_COUNTERS_CORE		6
+
+#define MSR_IA32_APICBASE_BSP			(1ULL << 8)
+#define MSR_IA32_MISC_ENABLE_FAST_STRING	(1ULL << 0)
+#define MSR_IA32_MISC_ENABLE_MWAIT		(1ULL << 18)
 #define MSR_STAR		0xc0000081
 #define MSR_LSTAR		0xc0000082
 #define MSR_CSTAR		0xc0000083
@@ -44,17 +82,136 @@
 
 #define SET_APIC_DELIVERY_MODE(x, y)	(((x) & ~0x700) | ((y) << 8))
 
-struct kvm_lapic_state kapic;
-struct kvm_mp_state mp_state;
-struct kvm_regs regs;
-struct kvm_sregs sregs;
-struct kvm_fpu fpu;
-struct {
-    struct kvm_msrs info;
-    struct kvm_msr_entry entries[100];
-} msr_data;
+//leaf 0 ebx, "Auth" of AuthenticAMD and "Hygo" of HygonGenuine
+#define CPUID_VENDOR_AMD_EBX	0x68747541
+#define CPUID_VENDOR_HYGON_EBX	0x6f677948
+
+//"KVMKVMKVM\0\0\0" in ebx, ecx, edx of leaf 0x40000000
+#define KVM_SIGNATURE_EBX	0x4b4d564b
+#define KVM_SIGNATURE_ECX	0x564b4d56
+#define KVM_SIGNATURE_EDX	0x0000004d
+
+struct kvm_pv_feature {
+    const char *name;
+    uint32_t bits;
+};
+
+static const struct kvm_pv_feature kvm_pv_features[] = {
+    {"clock",    (1 << KVM_FEATURE_CLOCKSOURCE) | (1 << KVM_FEATURE_CLOCKSOURCE2) |
+                 (1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT)},
+    {"steal",    1 << KVM_FEATURE_STEAL_TIME},
+    {"eoi",      1 << KVM_FEATURE_PV_EOI},
+    {"tlbflush", 1 << KVM_FEATURE_PV_TLB_FLUSH},
+    {"yield",    1 << KVM_FEATURE_PV_SCHED_YIELD},
+    {"asyncpf",  (1 << KVM_FEATURE_ASYNC_PF) | (1 << KVM_FEATURE_ASYNC_PF_VMEXIT) |
+                 (1 << KVM_FEATURE_ASYNC_PF_INT)},
+    {"ipi",      1 << KVM_FEATURE_PV_SEND_IPI},
+    {"unhalt",   1 << KVM_FEATURE_PV_UNHALT},
+    {"nopiodelay", 1 << KVM_FEATURE_NOP_IO_DELAY},
+};
+
+#define KVM_PV_FEATURE_NUM (sizeof(kvm_pv_features) / sizeof(kvm_pv_features[0]))
+#define KVM_PV_FEATURES_ALL 0x0100ffff
+
+struct cpu_opts cpu_opts = {
+    .kvm_pv_features = KVM_PV_FEATURES_ALL,
+};
+
+static const struct kvm_pv_feature disable_exit_names[] = {
+    {"hlt",    KVM_X86_DISABLE_EXITS_HLT},
+    {"pause",  KVM_X86_DISABLE_EXITS_PAUSE},
+    {"mwait",  KVM_X86_DISABLE_EXITS_MWAIT},
+    {"cstate", KVM_X86_DISABLE_EXITS_CSTATE},
+};
+
+#define DISABLE_EXIT_NUM (sizeof(disable_exit_names) / sizeof(disable_exit_names[0]))
+
+//NULL for all of them, otherwise a comma separated list of disable_exit_names
+int parse_disable_exits(const char *list)
+{
+    char buf[64];
+    char *save = NULL;
+    uint32_t bits = 0;
+
+    if (!list) {
+        cpu_opts.disable_exits = KVM_X86_DISABLE_VALID_EXITS;
+        return 0;
+    }
+    if (strlen(list) >= sizeof(buf))
+        return -1;
+    strcpy(buf, list);
+
+    for (char *tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        int i;
+
+        for (i = 0; i < DISABLE_EXIT_NUM; i++) {
+            if (!strcmp(tok, disable_exit_names[i].name)) {
+                bits |= disable_exit_names[i].bits;
+                break;
+            }
+        }
+        if (i == DISABLE_EXIT_NUM) {
+            fprintf(stderr, "unknown exit %s\n", tok);
+            return -1;
+        }
+    }
+    cpu_opts.disable_exits = bits;
+    return 0;
+}
+
+//NULL for every counter kvm offers, otherwise the general purpose count
+int parse_pmu(const char *arg)
+{
+    char *end;
+
+    cpu_opts.pmu = true;
+    cpu_opts.pmu_counters = 0;
+    if (!arg)
+        return 0;
+    cpu_opts.pmu_counters = strtol(arg, &end, 10);
+    if (*end || cpu_opts.pmu_counters < 1) {
+        fprintf(stderr, "invalid pmu counters %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+//"all", "none" or a comma separated list of kvm_pv_features names
+int parse_kvm_pv_features(const char *list)
+{
+    char buf[256];
+    char *save = NULL;
+    uint32_t bits = 0;
 
-struct kvm_msr_entry *msrs = msr_data.entries;
+    if (!strcmp(list, "all")) {
+        cpu_opts.kvm_pv_features = KVM_PV_FEATURES_ALL;
+        return 0;
+    }
+    if (strlen(list) >= sizeof(buf))
+        return -1;
+    strcpy(buf, list);
+
+    for (char *tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        int i;
+
+        if (!strcmp(tok, "none"))
+            continue;
+        for (i = 0; i < KVM_PV_FEATURE_NUM; i++) {
+            if (!strcmp(tok, kvm_pv_features[i].name)) {
+                bits |= kvm_pv_features[i].bits;
+                break;
+            }
+        }
+        if (i == KVM_PV_FEATURE_NUM) {
+            fprintf(stderr, "unknown kvm pv feature %s\n", tok);
+            return -1;
+        }
+    }
+    cpu_opts.kvm_pv_features = bits;
+    return 0;
+}
 
 static void host_cpuid(uint32_t function, uint32_t count,
                        uint32_t *eax, uint32_t *ebx,
@@ -77,12 +234,120 @@ static void host_cpuid(uint32_t function, uint32_t count,
         *edx = vec[3];
 }
 
-static void setup_cpuid(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id)
+struct kvm_cpuid_entry2 *cpuid_entry(struct kvm_cpuid2 *cpuid,
+                                     uint32_t max,
+                                     uint32_t function,
+                                     uint32_t index,
+                                     bool create)
+{
+    struct kvm_cpuid_entry2 *entry;
+
+    for (int i = 0; i < cpuid->nent; i++) {
+        entry = &cpuid->entries[i];
+        if (entry->function == function && entry->index == index)
+            return entry;
+    }
+    if (!create || cpuid->nent >= max)
+        return NULL;
+
+    entry = &cpuid->entries[cpuid->nent++];
+    memset(entry, 0, sizeof(*entry));
+    entry->function = function;
+    entry->index = index;
+    return entry;
+}
+
+/*
+ * With the idle exits gone the guest owns its physical core: let it
+ * mwait natively, and tell it through KVM_HINTS_REALTIME that its vcpus
+ * are never preempted so it picks native spinlocks and tlb shootdowns
+ * over the pv ones.
+ */
+static void setup_cpuid_dedicated(struct kvm_cpuid2 *cpuid, uint32_t max)
+{
+    struct kvm_cpuid_entry2 *entry;
+
+    if (cpu_opts.disable_exits & KVM_X86_DISABLE_EXITS_MWAIT) {
+        entry = cpuid_entry(cpuid, max, 1, 0, false);
+        if (entry)
+            entry->ecx |= 1 << X86_FEATURE_MWAIT;
+        entry = cpuid_entry(cpuid, max, 5, 0, true);
+        if (entry)
+            host_cpuid(5, 0, &entry->eax, &entry->ebx, &entry->ecx, &entry->edx);
+    }
+
+    entry = cpuid_entry(cpuid, max, KVM_CPUID_FEATURES, 0, false);
+    if (entry)
+        entry->edx |= 1 << KVM_HINTS_REALTIME;
+}
+
+static bool cpuid_has(struct kvm_cpuid2 *cpuid, uint32_t function,
+                      uint32_t index, int reg, int bit)
+{
+    struct kvm_cpuid_entry2 *entry;
+    uint32_t regs[4];
+
+    entry = cpuid_entry(cpuid, 0, function, index, false);
+    if (!entry)
+        return false;
+    regs[0] = entry->eax;
+    regs[1] = entry->ebx;
+    regs[2] = entry->ecx;
+    regs[3] = entry->edx;
+    return regs[reg] & (1u << bit);
+}
+
+/*
+ * Leaf 0xa as kvm reports it, trimmed to the requested counter count, or
+ * no pmu at all. Without --pmu kvm is asked to drop its pmu emulation in
+ * cpus_init, this keeps cpuid from advertising it anyway.
+ */
+static void setup_cpuid_pmu(struct kvm_cpuid2 *cpuid, uint32_t max)
+{
+    struct kvm_cpuid_entry2 *entry;
+    uint32_t version, counters;
+
+    entry = cpuid_entry(cpuid, max, 0xa, 0, false);
+    if (!cpu_opts.pmu) {
+        if (entry) {
+            entry->eax = entry->ebx = entry->ecx = entry->edx = 0;
+        }
+        entry = cpuid_entry(cpuid, max, 1, 0, false);
+        if (entry)
+            entry->ecx &= ~(1 << X86_FEATURE_PDCM);
+        entry = cpuid_entry(cpuid, max, 0x80000001, 0, false);
+        if (entry)
+            entry->ecx &= ~(1 << X86_FEATURE_PERFCTR_CORE);
+        return;
+    }
+
+    //amd hosts have no leaf 0xa, their counters come with the core msrs
+    if (!entry)
+        return;
+    version = entry->eax & 0xff;
+    counters = (entry->eax >> 8) & 0xff;
+    if (version == 0 || counters == 0) {
+        fprintf(stderr, "kvm offers no architectural pmu\n");
+        return;
+    }
+    if (cpu_opts.pmu_counters && cpu_opts.pmu_counters < counters) {
+        entry->eax &= ~0xff00;
+        entry->eax |= cpu_opts.pmu_counters << 8;
+    } else if (cpu_opts.pmu_counters > counters) {
+        fprintf(stderr, "kvm offers %u pmu counters\n", counters);
+    }
+    //fixed counters only exist from version 2 on
+    if (version < 2) {
+        entry->edx = 0;
+    }
+}
+
+//everything but the topology leaves, which setup_vcpu fills per vcpu
+static void setup_cpuid(int kvm_fd, struct X86CPUState *env)
 {
     int ret, size;
     struct kvm_cpuid2 *cpuid;
     uint32_t max = KVM_MAX_CPUID_ENTRIES;
-    uint32_t apic_id = vcpu_id;
 
     size = sizeof(*cpuid) + max * sizeof(*cpuid->entries);
     cpuid = malloc(size);
@@ -95,14 +360,15 @@ static void setup_cpuid(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id)
     if (ret == 0 && cpuid->nent >= max) {
         fprintf(stderr, "get kvm cpuid2 failed!\n");
     }
-    
+
+    cpu_model_apply(cpuid, max, true);
+
     for (int i = 0; i < cpuid->nent; i++) {
         struct kvm_cpuid_entry2 *entry = &(cpuid->entries[i]);
         switch (entry->function) {
         case 1:
             if(entry->index == 0) {
                         entry->ecx |= 1 << X86_FEATURE_HYPERVISOR;
-                        entry->ecx |= 1 << X86_FEATURE_TSC_DEADLINE_TIMER;
             } 
             break;
         case 2:
@@ -124,41 +390,18 @@ static void setup_cpuid(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id)
                         &entry->ecx,
                         &entry->edx
                     );
-                    entry->eax &= ~0xfc000000;
-                    if((entry->eax & 0x0001ffff) != 0 && vcpu_count > 1) {
-                        entry->eax |= (vcpu_count - 1) << 26;
-                    }
             break;
         case 6:
             entry->ecx &= ~(1 << ECX_EPB_SHIFT);
             break;
-        case 10:
-            if(entry->eax != 0) {
-                uint32_t version_id = entry->eax & 0xff;
-                uint32_t num_counters = entry->eax & 0xff00;
-                if(version_id != 2 || num_counters == 0) {
-                    entry->eax = 0;
-                }
-            }
+        case KVM_CPUID_SIGNATURE:
+            entry->eax = KVM_CPUID_FEATURES;
+            entry->ebx = KVM_SIGNATURE_EBX;
+            entry->ecx = KVM_SIGNATURE_ECX;
+            entry->edx = KVM_SIGNATURE_EDX;
             break;
-        case 0xb:
-            entry->edx = apic_id;
-            entry->ecx = entry->index & 0xff;
-            switch(entry->index) {
-            case 0:
-                entry->eax = 0;
-                entry->ebx = 1;
-                entry->ecx |= 1 << 8;
-                break;
-            case 1:
-                entry->eax = 32 - vcpu_count;
-                entry->ebx = vcpu_count;
-                entry->ecx |= 2 << 8;
-                break;
-            default:
-                entry->ebx = 0xff;
-            }
-            entry->ebx &= 0xffff;
+        case KVM_CPUID_FEATURES:
+            entry->eax &= cpu_opts.kvm_pv_features;
             break;
         case 0x80000002:
         case 0x80000003:
@@ -175,93 +418,108 @@ static void setup_cpuid(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id)
         }
     }
 
-    ret = ioctl(vcpu_fd, KVM_SET_CPUID2, cpuid);
-    if (ret < 0) {
-        fprintf(stderr, "set kvm cpuid2 failed\n");
+    setup_cpuid_pmu(cpuid, max);
+    if (cpu_opts.disable_exits) {
+        setup_cpuid_dedicated(cpuid, max);
     }
+
+    env->cpuid = cpuid;
 }
 
 //see https://wiki.osdev.org/APIC
-static void setup_lapic(int vcpu_fd)
+static void setup_lapic(int vcpu_fd, struct X86CPUState *env)
 {
     int ret = 0;
     char r;
+    struct kvm_lapic_state *kapic = &env->kapic;
 
-    ret = ioctl(vcpu_fd, KVM_GET_LAPIC, &kapic);
+    ret = ioctl(vcpu_fd, KVM_GET_LAPIC, kapic);
     if (ret < 0) {
         fprintf(stderr, "get lapic failed\n");
     }
 
-    r = SET_APIC_DELIVERY_MODE(kapic.regs[APIC_LVT0], APIC_MODE_EXTINT);
-    kapic.regs[APIC_LVT0] = r;
-    r = SET_APIC_DELIVERY_MODE(kapic.regs[APIC_LVT1], APIC_MODE_NMI);
-    kapic.regs[APIC_LVT1] = r;
+    r = SET_APIC_DELIVERY_MODE(kapic->regs[APIC_LVT0], APIC_MODE_EXTINT);
+    kapic->regs[APIC_LVT0] = r;
+    r = SET_APIC_DELIVERY_MODE(kapic->regs[APIC_LVT1], APIC_MODE_NMI);
+    kapic->regs[APIC_LVT1] = r;
 }
 
-static void setup_mpstate(int vcpu_fd, int vcpu_id)
+static void setup_lapic_id(struct X86CPUState *env, uint32_t apic_id)
+{
+    uint32_t *id = (uint32_t *)&env->kapic.regs[APIC_ID];
+
+    *id = apic_id << 24;
+}
+
+static void setup_mpstate(int vcpu_fd, struct X86CPUState *env, int vcpu_id)
 {
     if(vcpu_id == 0) {
-        mp_state.mp_state = KVM_MP_STATE_RUNNABLE;
+        env->mp_state.mp_state = KVM_MP_STATE_RUNNABLE;
     } else {
-        mp_state.mp_state = KVM_MP_STATE_UNINITIALIZED;
+        env->mp_state.mp_state = KVM_MP_STATE_UNINITIALIZED;
     }
 }
 
-static void setup_regs(int vcpu_fd)
+static void setup_regs(int vcpu_fd, struct X86CPUState *env)
 {
-    memset(&regs, 0, sizeof regs);
-    regs.rflags = 0x0002;
-    regs.rip = VMLINUX_START;
-    regs.rsp = BOOT_LOADER_SP;
-    regs.rbp = BOOT_LOADER_SP;
-    regs.rsi = ZERO_PAGE_START;
+    struct kvm_regs *regs = &env->regs;
+
+    memset(regs, 0, sizeof(*regs));
+    regs->rflags = 0x0002;
+    regs->rip = VMLINUX_START;
+    regs->rsp = BOOT_LOADER_SP;
+    regs->rbp = BOOT_LOADER_SP;
+    regs->rsi = ZERO_PAGE_START;
 }
 
 //see kernel arch/x86/include/uapi/asm/processor-flags.h
-static void setup_sregs(int vcpu_fd)
+static void setup_sregs(int vcpu_fd, struct X86CPUState *env)
 {
     int ret = 0;
     struct kvm_segment code_segment;
     struct kvm_segment data_segment;
+    struct kvm_sregs *sregs = &env->sregs;
 
-    ret = ioctl(vcpu_fd, KVM_GET_SREGS, &sregs);
+    ret = ioctl(vcpu_fd, KVM_GET_SREGS, sregs);
     if (ret < 0) {
         fprintf(stderr, "get sregs failed\n");
     }
 
     code_segment = get_code_kvm_seg();
     data_segment = get_data_kvm_seg();
-    sregs.cs = code_segment;
-    sregs.ds = data_segment;
-    sregs.es = data_segment;
-    sregs.fs = data_segment;
-    sregs.gs = data_segment;
-    sregs.ss = data_segment;
+    sregs->cs = code_segment;
+    sregs->ds = data_segment;
+    sregs->es = data_segment;
+    sregs->fs = data_segment;
+    sregs->gs = data_segment;
+    sregs->ss = data_segment;
 
     // Init gdt table, gdt table has loaded to Guest Memory Space
-    sregs.gdt.base = BOOT_GDT_START;
-    sregs.gdt.limit = get_gdt_limit();
+    sregs->gdt.base = BOOT_GDT_START;
+    sregs->gdt.limit = get_gdt_limit();
 
     // Init idt table, idt table has loaded to Guest Memory Space
-    sregs.idt.base = BOOT_IDT_START;
-    sregs.idt.limit = get_idt_limit();
+    sregs->idt.base = BOOT_IDT_START;
+    sregs->idt.limit = get_idt_limit();
 
     // Open 64-bit protected mode, include
     // Protection enable, Long mode enable, Long mode active
-    sregs.cr0 |= X86_CR0_PE;
-    sregs.efer |= (MSR_EFER_LME | MSR_EFER_LMA);
+    sregs->cr0 |= X86_CR0_PE;
+    sregs->efer |= (MSR_EFER_LME | MSR_EFER_LMA);
 
     // Setup page table
-    sregs.cr3 = PML4_START;
-    sregs.cr4 |= X86_CR4_PAE;
-    sregs.cr0 |= X86_CR0_PG;
+    sregs->cr3 = PML4_START;
+    sregs->cr4 |= X86_CR4_PAE;
+    sregs->cr0 |= X86_CR0_PG;
 }
 
-static void setup_fpu(int vcpu_fd)
+static void setup_fpu(int vcpu_fd, struct X86CPUState *env)
 {
-    memset(&fpu, 0, sizeof fpu);
-    fpu.fcw = 0x37f;
-    fpu.mxcsr = MXCSR_DEFAULT;
+    struct kvm_fpu *fpu = &env->fpu;
+
+    memset(fpu, 0, sizeof(*fpu));
+    fpu->fcw = 0x37f;
+    fpu->mxcsr = MXCSR_DEFAULT;
 }
 
 static void setup_msr_entry(struct kvm_msr_entry *entry,
@@ -271,9 +529,63 @@ static void setup_msr_entry(struct kvm_msr_entry *entry,
     entry->data = value;
 }
 
-static void setup_msr(int vcpu_fd)
+//all counters stopped and zeroed, global ctrl at its reset value
+static int setup_msr_pmu(struct kvm_msr_entry *msrs, int n, struct kvm_cpuid2 *cpuid)
+{
+    struct kvm_cpuid_entry2 *entry = cpuid_entry(cpuid, 0, 0xa, 0, false);
+    struct kvm_cpuid_entry2 *vendor = cpuid_entry(cpuid, 0, 0, 0, false);
+    uint32_t counters, fixed = 0;
+
+    if (vendor && (vendor->ebx == CPUID_VENDOR_AMD_EBX ||
+                   vendor->ebx == CPUID_VENDOR_HYGON_EBX)) {
+        //amd: the legacy four counters, six with the core extension
+        if (cpuid_has(cpuid, 0x80000001, 0, 2, X86_FEATURE_PERFCTR_CORE)) {
+            for (int i = 0; i < AMD64_NUM_COUNTERS_CORE; i++) {
+                setup_msr_entry(&msrs[n++], MSR_F15H_PERF_CTL + 2 * i, 0);
+                setup_msr_entry(&msrs[n++], MSR_F15H_PERF_CTL + 2 * i + 1, 0);
+            }
+        } else {
+            for (int i = 0; i < AMD64_NUM_COUNTERS; i++) {
+                setup_msr_entry(&msrs[n++], MSR_K7_EVNTSEL0 + i, 0);
+                setup_msr_entry(&msrs[n++], MSR_K7_PERFCTR0 + i, 0);
+            }
+        }
+        return n;
+    }
+
+    if (!entry || !(entry->eax & 0xff))
+        return n;
+    counters = (entry->eax >> 8) & 0xff;
+    if ((entry->eax & 0xff) >= 2) {
+        fixed = entry->edx & 0x1f;
+    }
+    for (int i = 0; i < counters; i++) {
+        setup_msr_entry(&msrs[n++], MSR_P6_EVNTSEL0 + i, 0);
+        setup_msr_entry(&msrs[n++], MSR_IA32_PERFCTR0 + i, 0);
+    }
+    if ((entry->eax & 0xff) >= 2) {
+        for (int i = 0; i < fixed; i++) {
+            setup_msr_entry(&msrs[n++], MSR_CORE_PERF_FIXED_CTR0 + i, 0);
+        }
+        setup_msr_entry(&msrs[n++], MSR_CORE_PERF_FIXED_CTR_CTRL, 0);
+        setup_msr_entry(&msrs[n++], MSR_CORE_PERF_GLOBAL_OVF_CTRL, 0);
+        setup_msr_entry(&msrs[n++], MSR_CORE_PERF_GLOBAL_CTRL,
+                        ((1ULL << counters) - 1) | (((1ULL << fixed) - 1) << 32));
+    }
+    return n;
+}
+
+static void setup_msr(int vcpu_fd, struct X86CPUState *env)
 {
     int n = 0;
+    struct kvm_msr_entry *msrs = env->msr_data.entries;
+    struct kvm_cpuid2 *cpuid = env->cpuid;
+    uint64_t misc_enable = MSR_IA32_MISC_ENABLE_FAST_STRING;
+
+    //kvm wants the monitor enable bit to agree with cpuid
+    if (cpuid_has(cpuid, 1, 0, 2, X86_FEATURE_MWAIT)) {
+        misc_enable |= MSR_IA32_MISC_ENABLE_MWAIT;
+    }
 
     setup_msr_entry(&msrs[n++], MSR_IA32_SYSENTER_CS, 0);
     setup_msr_entry(&msrs[n++], MSR_IA32_SYSENTER_ESP, 0);
@@ -286,54 +598,262 @@ static void setup_msr(int vcpu_fd)
     setup_msr_entry(&msrs[n++], MSR_SYSCALL_MASK, 0);
     setup_msr_entry(&msrs[n++], MSR_KERNELGSBASE, 0);
     setup_msr_entry(&msrs[n++], MSR_IA32_TSC, 0);
-    setup_msr_entry(&msrs[n++], MSR_IA32_MISC_ENABLE, 1);
+    setup_msr_entry(&msrs[n++], MSR_IA32_MISC_ENABLE, misc_enable);
+
+    //msrs behind optional features only exist when cpuid offers them
+    if (cpuid_has(cpuid, 1, 0, 2, X86_FEATURE_TSC_DEADLINE_TIMER)) {
+        setup_msr_entry(&msrs[n++], MSR_IA32_TSC_DEADLINE, 0);
+    }
+    if (cpuid_has(cpuid, 7, 0, 1, X86_FEATURE_TSC_ADJUST)) {
+        setup_msr_entry(&msrs[n++], MSR_IA32_TSC_ADJUST, 0);
+    }
+    if (cpuid_has(cpuid, 0xd, 1, 0, X86_FEATURE_XSAVES)) {
+        setup_msr_entry(&msrs[n++], MSR_IA32_XSS, 0);
+    }
+    if (cpuid_has(cpuid, 0x80000001, 0, 3, X86_FEATURE_RDTSCP)) {
+        setup_msr_entry(&msrs[n++], MSR_TSC_AUX, 0);
+    }
+
+    //pv areas start disabled, the guest enables what it finds in cpuid; an msr
+    //the host kvm does not know would end KVM_SET_MSRS early
+    if (cpuid_has(cpuid, KVM_CPUID_FEATURES, 0, 0, KVM_FEATURE_CLOCKSOURCE2)) {
+        setup_msr_entry(&msrs[n++], MSR_KVM_SYSTEM_TIME_NEW, 0);
+        setup_msr_entry(&msrs[n++], MSR_KVM_WALL_CLOCK_NEW, 0);
+    }
+    if (cpuid_has(cpuid, KVM_CPUID_FEATURES, 0, 0, KVM_FEATURE_ASYNC_PF)) {
+        setup_msr_entry(&msrs[n++], MSR_KVM_ASYNC_PF_EN, 0);
+    }
+    if (cpuid_has(cpuid, KVM_CPUID_FEATURES, 0, 0, KVM_FEATURE_ASYNC_PF_INT)) {
+        setup_msr_entry(&msrs[n++], MSR_KVM_ASYNC_PF_INT, 0);
+    }
+    if (cpuid_has(cpuid, KVM_CPUID_FEATURES, 0, 0, KVM_FEATURE_STEAL_TIME)) {
+        setup_msr_entry(&msrs[n++], MSR_KVM_STEAL_TIME, 0);
+    }
+    if (cpuid_has(cpuid, KVM_CPUID_FEATURES, 0, 0, KVM_FEATURE_PV_EOI)) {
+        setup_msr_entry(&msrs[n++], MSR_KVM_PV_EOI_EN, 0);
+    }
+
+    if (cpu_opts.pmu) {
+        n = setup_msr_pmu(msrs, n, cpuid);
+    }
+
+    env->msr_data.info.nmsrs = n;
+}
+
+/*
+ * Fresh vcpus only differ in their apic id, bsp flag and topology leaves.
+ * Everything else is queried and built once on the bsp and copied, so the
+ * per vcpu work left is a few memcpys and the KVM_SET_* calls.
+ */
+static struct X86CPUState vcpu_template;
+
+static struct kvm_cpuid2 *dup_cpuid(struct kvm_cpuid2 *cpuid)
+{
+    struct kvm_cpuid2 *copy;
+    int size = sizeof(*cpuid) + KVM_MAX_CPUID_ENTRIES * sizeof(*cpuid->entries);
+
+    copy = malloc(size);
+    if (!copy)
+        return NULL;
+    memcpy(copy, cpuid, sizeof(*cpuid) + cpuid->nent * sizeof(*cpuid->entries));
+    return copy;
+}
 
-    msr_data.info.nmsrs = n;
+int setup_vcpu_template(int kvm_fd, struct VCPUState *bsp)
+{
+    int vcpu_fd = bsp->vcpu_fd;
+    struct X86CPUState *env = &vcpu_template;
+
+    setup_cpuid(kvm_fd, env);
+    if (!env->cpuid)
+        return -1;
+    setup_lapic(vcpu_fd, env);
+    setup_sregs(vcpu_fd, env);
+    setup_fpu(vcpu_fd, env);
+    setup_msr(vcpu_fd, env);
+    return 0;
 }
 
-void setup_vcpu(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id)
+//1G pages in the guest cpuid, valid once the bsp template is built
+bool vcpu_has_gbpages()
 {
-    setup_lapic(vcpu_fd);
-    setup_mpstate(vcpu_fd, vcpu_id);
-    setup_sregs(vcpu_fd);
-    setup_regs(vcpu_fd);
-    setup_fpu(vcpu_fd);
-    setup_msr(vcpu_fd);
+    return vcpu_template.cpuid &&
+           cpuid_has(vcpu_template.cpuid, 0x80000001, 0, 3, X86_FEATURE_GBPAGES);
 }
 
-void reset_vcpu(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id)
+//guest physical address width, 36 bits when cpuid does not say
+int vcpu_phys_bits()
+{
+    struct kvm_cpuid_entry2 *entry = NULL;
+
+    if (vcpu_template.cpuid)
+        entry = cpuid_entry(vcpu_template.cpuid, 0, 0x80000008, 0, false);
+    return entry && (entry->eax & 0xff) ? entry->eax & 0xff : 36;
+}
+
+void setup_vcpu(int kvm_fd, struct VCPUState *vcpu, int vcpu_count)
+{
+    int vcpu_fd = vcpu->vcpu_fd;
+    struct X86CPUState *env = &vcpu->env;
+    uint32_t apic_id = topology_apic_id(vcpu->cpu_index);
+
+    *env = vcpu_template;
+    env->cpuid = dup_cpuid(vcpu_template.cpuid);
+    if (env->cpuid) {
+        topology_setup_cpuid(env->cpuid, KVM_MAX_CPUID_ENTRIES, vcpu->cpu_index);
+    }
+    setup_lapic_id(env, apic_id);
+    env->sregs.apic_base &= ~MSR_IA32_APICBASE_BSP;
+    if (vcpu->cpu_index == 0) {
+        env->sregs.apic_base |= MSR_IA32_APICBASE_BSP;
+    }
+    setup_mpstate(vcpu_fd, env, vcpu->cpu_index);
+    setup_regs(vcpu_fd, env);
+}
+
+void reset_vcpu(int kvm_fd, struct VCPUState *vcpu, int vcpu_count)
 {
     int ret = 0;
+    int vcpu_fd = vcpu->vcpu_fd;
+    struct X86CPUState *env = &vcpu->env;
 
-    setup_cpuid(kvm_fd, vcpu_fd, vcpu_count, vcpu_id);
+    ret = ioctl(vcpu_fd, KVM_SET_CPUID2, env->cpuid);
+    if (ret < 0) {
+        fprintf(stderr, "set kvm cpuid2 failed\n");
+    }
 
-    ret = ioctl(vcpu_fd, KVM_SET_LAPIC, &kapic);
+    ret = ioctl(vcpu_fd, KVM_SET_LAPIC, &env->kapic);
     if (ret < 0) {
         fprintf(stderr, "set lapic failed\n");
     }
 
-    ret = ioctl(vcpu_fd, KVM_SET_MP_STATE, &mp_state);
+    ret = ioctl(vcpu_fd, KVM_SET_MP_STATE, &env->mp_state);
     if (ret < 0) {
         fprintf(stderr, "set mp state failed\n");
     }
 
-    ret = ioctl(vcpu_fd, KVM_SET_REGS, &regs);
+    ret = ioctl(vcpu_fd, KVM_SET_REGS, &env->regs);
     if (ret < 0) {
         fprintf(stderr, "set regs failed\n");
     }
 
-    ret = ioctl(vcpu_fd, KVM_SET_SREGS, &sregs);
+    ret = ioctl(vcpu_fd, KVM_SET_SREGS, &env->sregs);
     if (ret < 0) {
         fprintf(stderr, "set sregs failed\n");
     }
 
-    ret = ioctl(vcpu_fd, KVM_SET_FPU, &fpu);
+    ret = ioctl(vcpu_fd, KVM_SET_FPU, &env->fpu);
     if (ret < 0) {
         fprintf(stderr, "set fpu failed\n");
     }
 
-    ret = ioctl(vcpu_fd, KVM_SET_MSRS, &msr_data);
+    //returns the number of msrs set, it stops at the first one kvm rejects
+    ret = ioctl(vcpu_fd, KVM_SET_MSRS, &env->msr_data);
     if (ret < 0) {
         fprintf(stderr, "set msrs failed\n");
+    } else if (ret < env->msr_data.info.nmsrs) {
+        fprintf(stderr, "set msr 0x%x failed\n", env->msr_data.entries[ret].index);
+    }
+}
+
+/*
+ * The msrs saved are the ones a fresh vcpu is set up with plus PAT,
+ * which the guest reprograms. EFER and the apic base travel in sregs.
+ */
+int vcpu_save_state(int kvm_fd, struct VCPUState *vcpu, struct vcpu_snapshot *s)
+{
+    int vcpu_fd = vcpu->vcpu_fd;
+    struct X86CPUState *env = &vcpu->env;
+    int n = env->msr_data.info.nmsrs, ret;
+
+    memset(s, 0, sizeof(*s));
+    if (ioctl(vcpu_fd, KVM_GET_REGS, &s->regs) < 0 ||
+        ioctl(vcpu_fd, KVM_GET_SREGS, &s->sregs) < 0 ||
+        ioctl(vcpu_fd, KVM_GET_FPU, &s->fpu) < 0 ||
+        ioctl(vcpu_fd, KVM_GET_LAPIC, &s->lapic) < 0 ||
+        ioctl(vcpu_fd, KVM_GET_MP_STATE, &s->mp_state) < 0 ||
+        ioctl(vcpu_fd, KVM_GET_VCPU_EVENTS, &s->events) < 0 ||
+        ioctl(vcpu_fd, KVM_GET_DEBUGREGS, &s->debugregs) < 0) {
+        fprintf(stderr, "get vcpu %d state failed\n", vcpu->cpu_index);
+        return -1;
+    }
+    if (ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE) > 0) {
+        if (ioctl(vcpu_fd, KVM_GET_XSAVE, &s->xsave) < 0) {
+            fprintf(stderr, "get vcpu %d xsave failed\n", vcpu->cpu_index);
+            return -1;
+        }
+        s->has_xsave = 1;
+    }
+    if (ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) > 0) {
+        if (ioctl(vcpu_fd, KVM_GET_XCRS, &s->xcrs) < 0) {
+            fprintf(stderr, "get vcpu %d xcrs failed\n", vcpu->cpu_index);
+            return -1;
+        }
+        s->has_xcrs = 1;
+    }
+
+    for (int i = 0; i < n; i++)
+        s->msr_data.entries[i].index = env->msr_data.entries[i].index;
+    if (n < KVM_MAX_MSR_ENTRIES)
+        s->msr_data.entries[n++].index = MSR_IA32_CR_PAT;
+    s->msr_data.info.nmsrs = n;
+    ret = ioctl(vcpu_fd, KVM_GET_MSRS, &s->msr_data);
+    if (ret < 0) {
+        fprintf(stderr, "get vcpu %d msrs failed\n", vcpu->cpu_index);
+        return -1;
+    }
+    //like KVM_SET_MSRS it stops at the first msr kvm does not know
+    s->msr_data.info.nmsrs = ret;
+    return 0;
+}
+
+/*
+ * sregs carry the apic base and go before the lapic, the lapic before
+ * the msrs so the tsc deadline lands on a timer in deadline mode.
+ */
+int vcpu_load_state(struct VCPUState *vcpu, struct vcpu_snapshot *s)
+{
+    int vcpu_fd = vcpu->vcpu_fd;
+    int ret;
+
+    if (ioctl(vcpu_fd, KVM_SET_REGS, &s->regs) < 0) {
+        fprintf(stderr, "set regs failed\n");
+        return -1;
+    }
+    if (s->has_xsave ? ioctl(vcpu_fd, KVM_SET_XSAVE, &s->xsave) < 0 :
+                       ioctl(vcpu_fd, KVM_SET_FPU, &s->fpu) < 0) {
+        fprintf(stderr, "set fpu failed\n");
+        return -1;
+    }
+    if (s->has_xcrs && ioctl(vcpu_fd, KVM_SET_XCRS, &s->xcrs) < 0) {
+        fprintf(stderr, "set xcrs failed\n");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_SREGS, &s->sregs) < 0) {
+        fprintf(stderr, "set sregs failed\n");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_LAPIC, &s->lapic) < 0) {
+        fprintf(stderr, "set lapic failed\n");
+        return -1;
+    }
+    ret = ioctl(vcpu_fd, KVM_SET_MSRS, &s->msr_data);
+    if (ret < 0 || ret < s->msr_data.info.nmsrs) {
+        fprintf(stderr, "set msr 0x%x failed\n",
+                ret < 0 ? 0 : s->msr_data.entries[ret].index);
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_MP_STATE, &s->mp_state) < 0) {
+        fprintf(stderr, "set mp state failed\n");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_VCPU_EVENTS, &s->events) < 0) {
+        fprintf(stderr, "set vcpu events failed\n");
+        return -1;
+    }
+    if (ioctl(vcpu_fd, KVM_SET_DEBUGREGS, &s->debugregs) < 0) {
+        fprintf(stderr, "set debugregs failed\n");
+        return -1;
     }
+    return 0;
 }
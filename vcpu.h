@@ -1,7 +1,83 @@
 #ifndef MICROV_VCPU_H
 #define MICROV_VCPU_H
 
-void setup_vcpu(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id);
-void reset_vcpu(int kvm_fd, int vcpu_fd, int vcpu_count, int vcpu_id);
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/kvm.h>
+
+#include "cpumodel.h"
+
+#define KVM_MAX_MSR_ENTRIES 100
+
+struct X86CPUState {
+    struct kvm_lapic_state kapic;
+    struct kvm_mp_state mp_state;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_cpuid2 *cpuid;
+    struct {
+        struct kvm_msrs info;
+        struct kvm_msr_entry entries[KVM_MAX_MSR_ENTRIES];
+    } msr_data;
+};
+
+//everything kvm holds for a vcpu, as saved in a snapshot
+struct vcpu_snapshot {
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_lapic_state lapic;
+    struct kvm_mp_state mp_state;
+    struct kvm_vcpu_events events;
+    struct kvm_debugregs debugregs;
+    uint32_t has_xsave;
+    uint32_t has_xcrs;
+    struct {
+        struct kvm_msrs info;
+        struct kvm_msr_entry entries[KVM_MAX_MSR_ENTRIES];
+    } msr_data;
+};
+
+struct cpu_opts {
+    enum CpuModel model;
+    uint32_t kvm_pv_features;   //KVM_FEATURE_* bits offered in leaf 0x40000001
+    uint32_t disable_exits;     //KVM_X86_DISABLE_EXITS_* for dedicated cores
+    bool pmu;                   //expose a virtual pmu
+    int pmu_counters;           //general purpose counters, 0 for all kvm has
+};
+
+extern struct cpu_opts cpu_opts;
+
+struct ExitStats;
+
+typedef struct VCPUState {
+    int cpu_index;
+    int vcpu_fd;
+    struct kvm_run *kvm_run;
+    pthread_t thread;
+    bool started;
+    bool running;
+    bool sample_pending;    //set by the profiler before it kicks
+    struct ExitStats *exit_stats;
+    struct X86CPUState env;
+} X86VCPUState;
+
+int setup_vcpu_template(int kvm_fd, struct VCPUState *bsp);
+bool vcpu_has_gbpages();
+int vcpu_phys_bits();
+void setup_vcpu(int kvm_fd, struct VCPUState *vcpu, int vcpu_count);
+void reset_vcpu(int kvm_fd, struct VCPUState *vcpu, int vcpu_count);
+int vcpu_save_state(int kvm_fd, struct VCPUState *vcpu, struct vcpu_snapshot *s);
+int vcpu_load_state(struct VCPUState *vcpu, struct vcpu_snapshot *s);
+struct kvm_cpuid_entry2 *cpuid_entry(struct kvm_cpuid2 *cpuid, uint32_t max,
+                                     uint32_t function, uint32_t index,
+                                     bool create);
+int parse_kvm_pv_features(const char *list);
+int parse_disable_exits(const char *list);
+int parse_pmu(const char *arg);
 
 #endif /* MICROV_VCPU_H */
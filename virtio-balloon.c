@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+
+#include "memory.h"
+#include "virtio-balloon.h"
+#include "snapshot.h"
+
+#define VIRTIO_PCI_DEVICE_ID_BALLOON 0x1045
+#define VIRTIO_BALLOON_PCI_CLASS 0xff0000
+#define VIRTIO_BALLOON_DEVICE_IRQ 11
+#define VIRTQUEUE_SIZE 128
+#define VIRTIO_PCI_ISR_QUEUE 0x1
+
+/*
+ * Queue roles. The guest numbers only the queues it negotiated, so
+ * without the stats queue the reporting queue is index 2.
+ */
+enum BalloonVq {
+    BalloonVqInflate = 0,
+    BalloonVqDeflate,
+    BalloonVqStats,
+    BalloonVqReporting,
+};
+
+//device side state saved after the transport
+struct virtio_balloon_state {
+    int32_t stats_desc;     //ring index of the held stats buffer, -1 for none
+    uint8_t stats_valid[VIRTIO_BALLOON_S_NR];
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    uint64_t inflated;
+    uint64_t reported;
+};
+
+struct balloon_opts balloon_opts;
+
+static struct virtio_balloon_dev *balloon_dev;
+static const char *balloon_stat_names[VIRTIO_BALLOON_S_NR] = VIRTIO_BALLOON_S_NAMES;
+
+//"" or "lazy"
+int parse_balloon(const char *arg)
+{
+    balloon_opts.enabled = true;
+    if (!arg)
+        return 0;
+    if (!strcmp(arg, "lazy")) {
+        balloon_opts.lazy = true;
+        return 0;
+    }
+    fprintf(stderr, "unknown balloon mode %s\n", arg);
+    return -1;
+}
+
+static int virtio_balloon_vq_role(struct virtio_balloon_dev *dev, struct virtq *vq)
+{
+    int idx = vq - dev->vq;
+
+    if (idx >= BalloonVqStats &&
+        !(dev->virtio_pci_dev.guest_feature & (1ULL << VIRTIO_BALLOON_F_STATS_VQ)))
+        idx++;
+    return idx;
+}
+
+static void virtio_balloon_signal(struct virtio_balloon_dev *dev, uint32_t isr)
+{
+    uint64_t n = 1;
+
+    dev->virtio_pci_dev.config.isr_cfg.isr_status |= isr;
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        fprintf(stderr, "write irqfd failed\n");
+}
+
+static void virtio_balloon_push(struct vring_packed_desc *head)
+{
+    head->len = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    head->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
+}
+
+static void virtio_balloon_discard(struct virtio_balloon_dev *dev, uint64_t gpa, uint64_t len)
+{
+    static bool warned;
+
+    if (discard_guest_ram(gpa, len, balloon_opts.lazy) < 0 && !warned) {
+        fprintf(stderr, "balloon can not discard guest memory at 0x%llx\n",
+                (unsigned long long)gpa);
+        warned = true;
+    }
+}
+
+//an array of 4k guest pfns, contiguous runs go back to the host in one call
+static void virtio_balloon_inflate(struct virtio_balloon_dev *dev,
+                                   struct vring_packed_desc *desc)
+{
+    uint32_t *pfns = get_userspace_ptr(desc->addr, desc->len);
+    int n = desc->len / sizeof(uint32_t);
+
+    if (!pfns)
+        return;
+    for (int i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && pfns[j] == pfns[j - 1] + 1; j++)
+            ;
+        virtio_balloon_discard(dev, (uint64_t)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT,
+                               (uint64_t)(j - i) << VIRTIO_BALLOON_PFN_SHIFT);
+    }
+    dev->inflated += n;
+}
+
+static void virtio_balloon_update_stats(struct virtio_balloon_dev *dev,
+                                        struct vring_packed_desc *desc)
+{
+    struct virtio_balloon_stat *stat = get_userspace_ptr(desc->addr, desc->len);
+    int n = desc->len / sizeof(*stat);
+
+    if (!stat)
+        return;
+    for (int i = 0; i < n; i++) {
+        if (stat[i].tag < VIRTIO_BALLOON_S_NR) {
+            dev->stats[stat[i].tag] = stat[i].val;
+            dev->stats_valid[stat[i].tag] = true;
+        }
+    }
+    dev->stats_seq++;
+    pthread_cond_broadcast(&dev->stats_cond);
+}
+
+/*
+ * Deflated pages need nothing, they fault back in as zeros. The stats
+ * buffer is kept, handing it back is how the device asks for fresh
+ * numbers.
+ */
+static void virtio_balloon_handle_output(struct virtq *vq)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) vq->dev;
+    int role = virtio_balloon_vq_role(dev, vq);
+    struct vring_packed_desc *desc;
+    bool pushed = false;
+
+    pthread_mutex_lock(&dev->lock);
+    while ((desc = virtq_get_avail(vq))) {
+        struct vring_packed_desc *head = desc;
+
+        for (;;) {
+            switch (role) {
+            case BalloonVqInflate:
+                virtio_balloon_inflate(dev, desc);
+                break;
+            case BalloonVqStats:
+                virtio_balloon_update_stats(dev, desc);
+                break;
+            case BalloonVqReporting:
+                virtio_balloon_discard(dev, desc->addr, desc->len);
+                dev->reported += desc->len;
+                break;
+            default:
+                break;
+            }
+            if (!virtq_check_next(desc) || !(desc = virtq_get_avail(vq)))
+                break;
+        }
+
+        if (role == BalloonVqStats) {
+            dev->stats_desc = head;
+        } else {
+            virtio_balloon_push(head);
+            pushed = true;
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    if (pushed && vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+        virtio_balloon_signal(dev, VIRTIO_PCI_ISR_QUEUE);
+}
+
+static void virtio_balloon_setup(struct virtio_balloon_dev *dev)
+{
+    dev->irq_num = VIRTIO_BALLOON_DEVICE_IRQ;
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->stats_cond, NULL);
+
+    for (int i = 0; i < VIRTIO_BALLOON_VIRTQUEUE_NUM; i++) {
+        virtq_init(&dev->vq[i], dev, VIRTQUEUE_SIZE, virtio_balloon_handle_output);
+    }
+}
+
+static int virtio_balloon_save(void *opaque, FILE *fp)
+{
+    struct virtio_balloon_dev *dev = opaque;
+    struct virtio_balloon_state s = {
+        .stats_desc = -1,
+        .inflated = dev->inflated,
+        .reported = dev->reported,
+    };
+    int ret;
+
+    pthread_mutex_lock(&dev->lock);
+    if (dev->stats_desc)
+        s.stats_desc = dev->stats_desc - dev->vq[BalloonVqStats].desc_ring;
+    for (int i = 0; i < VIRTIO_BALLOON_S_NR; i++) {
+        s.stats[i] = dev->stats[i];
+        s.stats_valid[i] = dev->stats_valid[i];
+    }
+    ret = virtio_pci_save(&dev->virtio_pci_dev, fp);
+    if (ret == 0)
+        ret = snapshot_write(fp, &s, sizeof(s));
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+static int virtio_balloon_load(void *opaque, FILE *fp, uint64_t len)
+{
+    struct virtio_balloon_dev *dev = opaque;
+    struct virtq *vq = &dev->vq[BalloonVqStats];
+    struct virtio_balloon_state s;
+
+    if (virtio_pci_load(&dev->virtio_pci_dev, fp) < 0 ||
+        snapshot_read(fp, &s, sizeof(s)) < 0)
+        return -1;
+    if (s.stats_desc >= 0) {
+        if (!vq->info.enable || s.stats_desc >= vq->info.size)
+            return -1;
+        dev->stats_desc = &vq->desc_ring[s.stats_desc];
+    }
+    for (int i = 0; i < VIRTIO_BALLOON_S_NR; i++) {
+        dev->stats[i] = s.stats[i];
+        dev->stats_valid[i] = s.stats_valid[i];
+    }
+    dev->inflated = s.inflated;
+    dev->reported = s.reported;
+    virtio_pci_notify_all(&dev->virtio_pci_dev);
+    return 0;
+}
+
+void virtio_balloon_init_pci(int vmfd, struct virtio_balloon_dev *virtio_balloon_dev)
+{
+    memset(virtio_balloon_dev, 0x00, sizeof(struct virtio_balloon_dev));
+    virtio_balloon_setup(virtio_balloon_dev);
+
+    struct virtio_pci_dev *dev = &virtio_balloon_dev->virtio_pci_dev;
+    virtio_pci_init(vmfd, dev,
+                    VIRTIO_PCI_DEVICE_ID_BALLOON,
+                    VIRTIO_BALLOON_PCI_CLASS,
+                    virtio_balloon_dev->irq_num);
+    virtio_pci_set_dev_cfg(dev, &virtio_balloon_dev->config, sizeof(virtio_balloon_dev->config));
+    virtio_pci_set_virtq_cfg(dev, virtio_balloon_dev->vq, VIRTIO_BALLOON_VIRTQUEUE_NUM);
+    dev->device_feature |= (1ULL << VIRTIO_BALLOON_F_STATS_VQ) |
+                           (1ULL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) |
+                           (1ULL << VIRTIO_BALLOON_F_REPORTING);
+
+    struct kvm_irqfd irqfd = {
+        .fd = virtio_balloon_dev->irqfd,
+        .gsi = virtio_balloon_dev->irq_num,
+        .flags = 0,
+    };
+    if (ioctl(dev->vmfd, KVM_IRQFD, &irqfd) < 0) {
+        fprintf(stderr, "ioctl kvm irqfd failed\n");
+    }
+    snapshot_register("virtio-balloon", virtio_balloon_save, virtio_balloon_load,
+                      virtio_balloon_dev);
+    balloon_dev = virtio_balloon_dev;
+}
+
+//ask the guest to shrink to (or grow back to) ram_size bytes
+int virtio_balloon_set_target(uint64_t ram_size)
+{
+    if (!balloon_dev || ram_size > mem_opts.size)
+        return -1;
+    balloon_dev->config.num_pages = (mem_opts.size - ram_size) >> VIRTIO_BALLOON_PFN_SHIFT;
+    virtio_balloon_signal(balloon_dev, VIRTIO_PCI_ISR_CONFIG);
+    return 0;
+}
+
+//refresh the guest stats, waiting up to a second for them
+void virtio_balloon_dump(FILE *out)
+{
+    struct virtio_balloon_dev *dev = balloon_dev;
+    struct timespec deadline;
+
+    if (!dev)
+        return;
+
+    pthread_mutex_lock(&dev->lock);
+    if (dev->stats_desc) {
+        struct virtq *vq = &dev->vq[BalloonVqStats];
+        uint64_t seq = dev->stats_seq;
+
+        virtio_balloon_push(dev->stats_desc);
+        dev->stats_desc = NULL;
+        if (vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+            virtio_balloon_signal(dev, VIRTIO_PCI_ISR_QUEUE);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        while (dev->stats_seq == seq &&
+               pthread_cond_timedwait(&dev->stats_cond, &dev->lock, &deadline) == 0)
+            ;
+    }
+
+    fprintf(out, "guest ram target: %llu MiB\n",
+            (unsigned long long)(mem_opts.size -
+                                 ((uint64_t)dev->config.num_pages << VIRTIO_BALLOON_PFN_SHIFT)) >> 20);
+    fprintf(out, "balloon size:     %llu MiB\n",
+            (unsigned long long)dev->config.actual >> (20 - VIRTIO_BALLOON_PFN_SHIFT));
+    fprintf(out, "inflated total:   %llu pages\n", (unsigned long long)dev->inflated);
+    fprintf(out, "reported free:    %llu MiB\n", (unsigned long long)dev->reported >> 20);
+    for (int i = 0; i < VIRTIO_BALLOON_S_NR; i++) {
+        if (dev->stats_valid[i])
+            fprintf(out, "%s: %llu\n", balloon_stat_names[i], (unsigned long long)dev->stats[i]);
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
@@ -0,0 +1,40 @@
+#ifndef MICROV_VIRTIO_BALLOON_H
+#define MICROV_VIRTIO_BALLOON_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/virtio_balloon.h>
+#include "virtio-pci.h"
+
+//inflate, deflate, stats and free page reporting
+#define VIRTIO_BALLOON_VIRTQUEUE_NUM 4
+
+struct balloon_opts {
+    bool enabled;
+    bool lazy;          //MADV_FREE instead of MADV_DONTNEED
+};
+
+extern struct balloon_opts balloon_opts;
+
+struct virtio_balloon_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_balloon_config config;
+    struct virtq vq[VIRTIO_BALLOON_VIRTQUEUE_NUM];
+    int irqfd;
+    int irq_num;
+    pthread_mutex_t lock;
+    pthread_cond_t stats_cond;
+    struct vring_packed_desc *stats_desc;   //held until the next refresh
+    uint64_t stats_seq;
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    bool stats_valid[VIRTIO_BALLOON_S_NR];
+    uint64_t inflated;
+    uint64_t reported;
+};
+
+int parse_balloon(const char *arg);
+void virtio_balloon_init_pci(int vmfd, struct virtio_balloon_dev *dev);
+int virtio_balloon_set_target(uint64_t ram_size);
+void virtio_balloon_dump(FILE *out);
+
+#endif /* MICROV_VIRTIO_BALLOON_H */
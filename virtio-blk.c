@@ -6,35 +6,35 @@
 #include <sys/ioctl.h>
 #include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "memory.h"
 #include "virtio-blk.h"
+#include "snapshot.h"
 
 #define VIRTIO_PCI_DEVICE_ID_BLK 0x1042
 #define VIRTIO_BLK_PCI_CLASS 0x018000
 #define VIRTIO_BLK_DEVICE_IRQ 15
 #define VIRTQUEUE_SIZE 128
 
-ssize_t diskimg_read(struct diskimg *diskimg,
-                     void *data,
-                     off_t offset,
-                     size_t size)
+ssize_t diskimg_readv(struct diskimg *diskimg,
+                      const struct iovec *iov,
+                      int iovcnt,
+                      off_t offset)
 {
     if(offset < diskimg->size) {
-        lseek(diskimg->fd, offset, SEEK_SET);
-        return read(diskimg->fd, data, size);
+        return preadv(diskimg->fd, iov, iovcnt, offset);
     }
     return -1;
 }
 
-ssize_t diskimg_write(struct diskimg *diskimg,
-                      void *data,
-                      off_t offset,
-                      size_t size)
+ssize_t diskimg_writev(struct diskimg *diskimg,
+                       const struct iovec *iov,
+                       int iovcnt,
+                       off_t offset)
 {
     if(offset < diskimg->size) {
-        lseek(diskimg->fd, offset, SEEK_SET);
-        return write(diskimg->fd, data, size);
+        return pwritev(diskimg->fd, iov, iovcnt, offset);
     }
     return -1;
 }
@@ -57,21 +57,17 @@ void diskimg_exit(struct diskimg *diskimg)
 
 
 static ssize_t virtio_blk_write(struct virtio_blk_dev *dev,
-                                void *data,
-                                uint64_t sector,
-                                size_t size)
+                                struct virtio_blk_req *req)
 {
-    off_t offset = sector * 512;
-    return diskimg_write(dev->diskimg, data, offset, size);
+    off_t offset = req->hdr.sector * 512;
+    return diskimg_writev(dev->diskimg, req->iov, req->iovcnt, offset);
 }
 
 static ssize_t virtio_blk_read(struct virtio_blk_dev *dev,
-                               void *data,
-                               uint64_t sector,
-                               size_t size)
+                               struct virtio_blk_req *req)
 {
-    off_t offset = sector * 512;
-    return diskimg_read(dev->diskimg, data, offset, size);
+    off_t offset = req->hdr.sector * 512;
+    return diskimg_readv(dev->diskimg, req->iov, req->iovcnt, offset);
 }
 
 static void virtio_blk_handle_output(struct virtq *vq)
@@ -85,26 +81,34 @@ static void virtio_blk_handle_output(struct virtq *vq)
         struct vring_packed_desc *used_desc = desc;
         ssize_t r = 0;
 
-        memcpy(&req.hdr, (void *)get_userspace_addr((uint64_t) desc->addr), desc->len);
+        memset(&req.hdr, 0, sizeof(req.hdr));
+        if (read_userspace_memory(&req.hdr, desc->addr,
+                                  desc->len < sizeof(req.hdr) ? desc->len : sizeof(req.hdr)) < 0)
+            req.hdr.type = -1;
         if (req.hdr.type == VIRTIO_BLK_T_IN || req.hdr.type == VIRTIO_BLK_T_OUT) {
             if (!virtq_check_next(desc))
                 return;
             desc = virtq_get_avail(vq);
-            req.data = (uint8_t *)get_userspace_addr((uint64_t) desc->addr);
+            //a buffer crossing slots takes one iovec per slot
+            req.iovcnt = gpa_to_iovec(desc->addr, desc->len, req.iov, VIRTIO_BLK_IOV_MAX);
 
-            if (req.hdr.type == VIRTIO_BLK_T_IN)
-                r = virtio_blk_read(dev, req.data, req.hdr.sector, desc->len);
+            if (req.iovcnt < 0)
+                r = -1;
+            else if (req.hdr.type == VIRTIO_BLK_T_IN)
+                r = virtio_blk_read(dev, &req);
             else
-                r = virtio_blk_write(dev, req.data, req.hdr.sector, desc->len);
+                r = virtio_blk_write(dev, &req);
 
             status = r < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+            if (r < 0)
+                r = 0;
         } else {
             status = VIRTIO_BLK_S_UNSUPP;
         }
         if (!virtq_check_next(desc))
             return;
         desc = virtq_get_avail(vq);
-        *(uint8_t *)get_userspace_addr((uint64_t) desc->addr) = status;
+        write_userspace_memory(&status, desc->addr, sizeof(status));
 
         used_desc->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
         used_desc->len = r;
@@ -132,6 +136,23 @@ static void virtio_blk_setup(struct virtio_blk_dev *dev,
     }
 }
 
+static int virtio_blk_save(void *opaque, FILE *fp)
+{
+    struct virtio_blk_dev *dev = opaque;
+
+    return virtio_pci_save(&dev->virtio_pci_dev, fp);
+}
+
+static int virtio_blk_load(void *opaque, FILE *fp, uint64_t len)
+{
+    struct virtio_blk_dev *dev = opaque;
+
+    if (virtio_pci_load(&dev->virtio_pci_dev, fp) < 0)
+        return -1;
+    virtio_pci_notify_all(&dev->virtio_pci_dev);
+    return 0;
+}
+
 void virtio_blk_init_pci(int vmfd, struct virtio_blk_dev *virtio_blk_dev,
                          struct diskimg *diskimg)
 {
@@ -154,6 +175,7 @@ void virtio_blk_init_pci(int vmfd, struct virtio_blk_dev *virtio_blk_dev,
     if (ioctl(dev->vmfd, KVM_IRQFD, &irqfd) < 0) {
         fprintf(stderr, "ioctl kvm irqfd failed\n");
     }
+    snapshot_register("virtio-blk", virtio_blk_save, virtio_blk_load, virtio_blk_dev);
 }
 
 void virtio_blk_exit(struct virtio_blk_dev *dev)
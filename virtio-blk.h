@@ -1,10 +1,12 @@
 #ifndef MICROV_VIRTIO_BLK_H
 #define MICROV_VIRTIO_BLK_H
 
+#include <sys/uio.h>
 #include <linux/virtio_blk.h>
 #include "virtio-pci.h"
 
 #define VIRTIO_BLK_VIRTQUEUE_NUM 1
+#define VIRTIO_BLK_IOV_MAX 4        //a data buffer spans this many memory slots at most
 
 struct diskimg {
     int fd;
@@ -24,7 +26,8 @@ struct virtio_blk_dev {
 
 struct virtio_blk_req {
     struct virtio_blk_outhdr hdr;
-    uint8_t *data;
+    struct iovec iov[VIRTIO_BLK_IOV_MAX];
+    int iovcnt;
 };
 
 int diskimg_init(struct diskimg *diskimg, const char *file_path);
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+
+#include "memory.h"
+#include "numa.h"
+#include "virtio-mem.h"
+#include "snapshot.h"
+
+#define VIRTIO_PCI_DEVICE_ID_MEM 0x1058
+#define VIRTIO_MEM_PCI_CLASS 0xff0000
+#define VIRTIO_MEM_DEVICE_IRQ 12
+#define VIRTQUEUE_SIZE 128
+#define VIRTIO_PCI_ISR_QUEUE 0x1
+
+/*
+ * virtio-mem over the hotplug region memory.c sets up above ram. The
+ * guest plugs blocks up to the requested size, unplugged blocks go back
+ * to the host right away. The whole region stays usable, so the host
+ * only ever changes requested_size.
+ */
+static struct virtio_mem_dev *mem_dev;
+
+static bool virtio_mem_test(struct virtio_mem_dev *dev, uint64_t block)
+{
+    return dev->plugged[block / 64] & (1ULL << (block % 64));
+}
+
+static void virtio_mem_assign(struct virtio_mem_dev *dev, uint64_t first,
+                              uint64_t n, bool plug)
+{
+    for (uint64_t i = first; i < first + n; i++) {
+        if (virtio_mem_test(dev, i) == plug)
+            continue;
+        dev->plugged[i / 64] ^= 1ULL << (i % 64);
+        if (plug)
+            dev->config.plugged_size += dev->config.block_size;
+        else
+            dev->config.plugged_size -= dev->config.block_size;
+    }
+}
+
+//plugged blocks among [first, first + n)
+static uint64_t virtio_mem_count(struct virtio_mem_dev *dev, uint64_t first, uint64_t n)
+{
+    uint64_t count = 0;
+
+    for (uint64_t i = first; i < first + n; i++)
+        count += virtio_mem_test(dev, i);
+    return count;
+}
+
+//first block of a request, -1 unless it is aligned and inside the usable region
+static int64_t virtio_mem_range(struct virtio_mem_dev *dev, uint64_t addr, uint16_t nb_blocks)
+{
+    uint64_t block = dev->config.block_size;
+    uint64_t offset = addr - dev->config.addr;
+
+    if (!nb_blocks || addr < dev->config.addr || (offset & (block - 1)))
+        return -1;
+    if (offset / block + nb_blocks > dev->config.usable_region_size / block)
+        return -1;
+    return offset / block;
+}
+
+static void virtio_mem_discard(struct virtio_mem_dev *dev, uint64_t first, uint64_t n)
+{
+    uint64_t block = dev->config.block_size;
+
+    if (discard_guest_ram(dev->config.addr + first * block, n * block, false) < 0)
+        fprintf(stderr, "virtio-mem can not discard blocks at 0x%llx\n",
+                (unsigned long long)(dev->config.addr + first * block));
+}
+
+static void virtio_mem_request(struct virtio_mem_dev *dev, struct virtio_mem_req *req,
+                               struct virtio_mem_resp *resp)
+{
+    uint64_t block = dev->config.block_size;
+    int64_t first;
+    uint64_t n, count;
+
+    resp->type = VIRTIO_MEM_RESP_ERROR;
+    switch (req->type) {
+    case VIRTIO_MEM_REQ_PLUG:
+        first = virtio_mem_range(dev, req->u.plug.addr, req->u.plug.nb_blocks);
+        n = req->u.plug.nb_blocks;
+        if (first < 0 || virtio_mem_count(dev, first, n))
+            break;
+        if (dev->config.plugged_size + n * block > dev->config.requested_size) {
+            resp->type = VIRTIO_MEM_RESP_NACK;
+            dev->nacks++;
+            break;
+        }
+        virtio_mem_assign(dev, first, n, true);
+        dev->plugs += n;
+        resp->type = VIRTIO_MEM_RESP_ACK;
+        break;
+    case VIRTIO_MEM_REQ_UNPLUG:
+        first = virtio_mem_range(dev, req->u.unplug.addr, req->u.unplug.nb_blocks);
+        n = req->u.unplug.nb_blocks;
+        if (first < 0 || virtio_mem_count(dev, first, n) != n)
+            break;
+        virtio_mem_discard(dev, first, n);
+        virtio_mem_assign(dev, first, n, false);
+        dev->unplugs += n;
+        resp->type = VIRTIO_MEM_RESP_ACK;
+        break;
+    case VIRTIO_MEM_REQ_UNPLUG_ALL:
+        n = dev->nr_blocks;
+        dev->unplugs += virtio_mem_count(dev, 0, n);
+        virtio_mem_discard(dev, 0, n);
+        virtio_mem_assign(dev, 0, n, false);
+        resp->type = VIRTIO_MEM_RESP_ACK;
+        break;
+    case VIRTIO_MEM_REQ_STATE:
+        first = virtio_mem_range(dev, req->u.state.addr, req->u.state.nb_blocks);
+        n = req->u.state.nb_blocks;
+        if (first < 0)
+            break;
+        count = virtio_mem_count(dev, first, n);
+        resp->u.state.state = count == n ? VIRTIO_MEM_STATE_PLUGGED :
+                              count ? VIRTIO_MEM_STATE_MIXED : VIRTIO_MEM_STATE_UNPLUGGED;
+        resp->type = VIRTIO_MEM_RESP_ACK;
+        break;
+    default:
+        break;
+    }
+}
+
+static void virtio_mem_signal(struct virtio_mem_dev *dev, uint32_t isr)
+{
+    uint64_t n = 1;
+
+    dev->virtio_pci_dev.config.isr_cfg.isr_status |= isr;
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        fprintf(stderr, "write irqfd failed\n");
+}
+
+//a request is a driver buffer with the request and a device buffer for the response
+static void virtio_mem_handle_output(struct virtq *vq)
+{
+    struct virtio_mem_dev *dev = (struct virtio_mem_dev *) vq->dev;
+    struct vring_packed_desc *desc;
+    bool pushed = false;
+
+    pthread_mutex_lock(&dev->lock);
+    while ((desc = virtq_get_avail(vq))) {
+        struct vring_packed_desc *head = desc;
+        struct virtio_mem_req req;
+        struct virtio_mem_resp resp;
+
+        memset(&req, 0, sizeof(req));
+        memset(&resp, 0, sizeof(resp));
+        if (read_userspace_memory(&req, desc->addr,
+                                  desc->len < sizeof(req) ? desc->len : sizeof(req)) < 0)
+            req.type = -1;
+        if (!virtq_check_next(desc) || !(desc = virtq_get_avail(vq)))
+            break;
+        virtio_mem_request(dev, &req, &resp);
+        head->len = 0;
+        if (desc->len >= sizeof(resp) &&
+            write_userspace_memory(&resp, desc->addr, sizeof(resp)) == 0)
+            head->len = sizeof(resp);
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        head->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
+        pushed = true;
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    if (pushed && vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+        virtio_mem_signal(dev, VIRTIO_PCI_ISR_QUEUE);
+}
+
+static int virtio_mem_setup(struct virtio_mem_dev *dev)
+{
+    uint64_t gpa, size;
+    int node;
+
+    if (get_hotplug_ram(&gpa, &size, &node) < 0) {
+        fprintf(stderr, "virtio-mem needs a hotplug region\n");
+        return -1;
+    }
+    dev->config.block_size = mem_opts.hotplug_block;
+    dev->config.node_id = node;
+    dev->config.addr = gpa;
+    dev->config.region_size = size;
+    dev->config.usable_region_size = size;
+    dev->nr_blocks = size / mem_opts.hotplug_block;
+    dev->plugged = calloc((dev->nr_blocks + 63) / 64, sizeof(uint64_t));
+    if (!dev->plugged) {
+        fprintf(stderr, "virtio-mem block bitmap allocation failed\n");
+        return -1;
+    }
+
+    dev->irq_num = VIRTIO_MEM_DEVICE_IRQ;
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    pthread_mutex_init(&dev->lock, NULL);
+    for (int i = 0; i < VIRTIO_MEM_VIRTQUEUE_NUM; i++) {
+        virtq_init(&dev->vq[i], dev, VIRTQUEUE_SIZE, virtio_mem_handle_output);
+    }
+    return 0;
+}
+
+//the transport with the config, then the counters and the plugged bitmap
+static int virtio_mem_save(void *opaque, FILE *fp)
+{
+    struct virtio_mem_dev *dev = opaque;
+    uint64_t counts[3] = {dev->plugs, dev->unplugs, dev->nacks};
+    int ret;
+
+    pthread_mutex_lock(&dev->lock);
+    ret = virtio_pci_save(&dev->virtio_pci_dev, fp);
+    if (ret == 0)
+        ret = snapshot_write(fp, counts, sizeof(counts));
+    if (ret == 0)
+        ret = snapshot_write(fp, dev->plugged, (dev->nr_blocks + 63) / 64 * 8);
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+static int virtio_mem_load(void *opaque, FILE *fp, uint64_t len)
+{
+    struct virtio_mem_dev *dev = opaque;
+    uint64_t region_size = dev->config.region_size;
+    uint64_t block_size = dev->config.block_size;
+    uint64_t counts[3];
+
+    if (virtio_pci_load(&dev->virtio_pci_dev, fp) < 0)
+        return -1;
+    //the bitmap is only meaningful for the same region cut the same way
+    if (dev->config.region_size != region_size || dev->config.block_size != block_size) {
+        fprintf(stderr, "snapshot hotplug region differs, restore with the same --mem-hotplug\n");
+        return -1;
+    }
+    if (snapshot_read(fp, counts, sizeof(counts)) < 0 ||
+        snapshot_read(fp, dev->plugged, (dev->nr_blocks + 63) / 64 * 8) < 0)
+        return -1;
+    dev->plugs = counts[0];
+    dev->unplugs = counts[1];
+    dev->nacks = counts[2];
+    virtio_pci_notify_all(&dev->virtio_pci_dev);
+    return 0;
+}
+
+int virtio_mem_init_pci(int vmfd, struct virtio_mem_dev *virtio_mem_dev)
+{
+    memset(virtio_mem_dev, 0x00, sizeof(struct virtio_mem_dev));
+    if (virtio_mem_setup(virtio_mem_dev) < 0)
+        return -1;
+
+    struct virtio_pci_dev *dev = &virtio_mem_dev->virtio_pci_dev;
+    virtio_pci_init(vmfd, dev,
+                    VIRTIO_PCI_DEVICE_ID_MEM,
+                    VIRTIO_MEM_PCI_CLASS,
+                    virtio_mem_dev->irq_num);
+    virtio_pci_set_dev_cfg(dev, &virtio_mem_dev->config, sizeof(virtio_mem_dev->config));
+    virtio_pci_set_virtq_cfg(dev, virtio_mem_dev->vq, VIRTIO_MEM_VIRTQUEUE_NUM);
+    //the srat names the node, without numa the guest picks one
+    if (numa_enabled())
+        dev->device_feature |= (1ULL << VIRTIO_MEM_F_ACPI_PXM);
+
+    struct kvm_irqfd irqfd = {
+        .fd = virtio_mem_dev->irqfd,
+        .gsi = virtio_mem_dev->irq_num,
+        .flags = 0,
+    };
+    if (ioctl(dev->vmfd, KVM_IRQFD, &irqfd) < 0) {
+        fprintf(stderr, "ioctl kvm irqfd failed\n");
+    }
+    snapshot_register("virtio-mem", virtio_mem_save, virtio_mem_load, virtio_mem_dev);
+    mem_dev = virtio_mem_dev;
+    return 0;
+}
+
+//ask the guest to plug or unplug blocks until size bytes of the region are in use
+int virtio_mem_set_requested(uint64_t size)
+{
+    if (!mem_dev || size > mem_dev->config.region_size ||
+        (size & (mem_dev->config.block_size - 1)))
+        return -1;
+    pthread_mutex_lock(&mem_dev->lock);
+    mem_dev->config.requested_size = size;
+    pthread_mutex_unlock(&mem_dev->lock);
+    virtio_mem_signal(mem_dev, VIRTIO_PCI_ISR_CONFIG);
+    return 0;
+}
+
+void virtio_mem_dump(FILE *out)
+{
+    struct virtio_mem_dev *dev = mem_dev;
+
+    if (!dev)
+        return;
+    pthread_mutex_lock(&dev->lock);
+    fprintf(out, "hotplug region:   0x%llx, %llu MiB in %llu KiB blocks\n",
+            (unsigned long long)dev->config.addr,
+            (unsigned long long)dev->config.region_size >> 20,
+            (unsigned long long)dev->config.block_size >> 10);
+    fprintf(out, "requested:        %llu MiB\n", (unsigned long long)dev->config.requested_size >> 20);
+    fprintf(out, "plugged:          %llu MiB\n", (unsigned long long)dev->config.plugged_size >> 20);
+    fprintf(out, "blocks plugged:   %llu total\n", (unsigned long long)dev->plugs);
+    fprintf(out, "blocks unplugged: %llu total\n", (unsigned long long)dev->unplugs);
+    fprintf(out, "plugs refused:    %llu\n", (unsigned long long)dev->nacks);
+    pthread_mutex_unlock(&dev->lock);
+}
@@ -0,0 +1,30 @@
+#ifndef MICROV_VIRTIO_MEM_H
+#define MICROV_VIRTIO_MEM_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/virtio_mem.h>
+#include "virtio-pci.h"
+
+//guest plug, unplug and state requests
+#define VIRTIO_MEM_VIRTQUEUE_NUM 1
+
+struct virtio_mem_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_mem_config config;
+    struct virtq vq[VIRTIO_MEM_VIRTQUEUE_NUM];
+    int irqfd;
+    int irq_num;
+    pthread_mutex_t lock;
+    uint64_t *plugged;      //one bit per block of the region
+    uint64_t nr_blocks;
+    uint64_t plugs;
+    uint64_t unplugs;
+    uint64_t nacks;
+};
+
+int virtio_mem_init_pci(int vmfd, struct virtio_mem_dev *dev);
+int virtio_mem_set_requested(uint64_t size);
+void virtio_mem_dump(FILE *out);
+
+#endif /* MICROV_VIRTIO_MEM_H */
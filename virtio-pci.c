@@ -9,10 +9,27 @@
 #include "pci.h"
 #include "virtio-pci.h"
 #include "ioeventfd.h"
+#include "snapshot.h"
 
 #define VIRTIO_PCI_VENDOR_ID 0x1AF4
 #define VIRTIO_PCI_CAP_NUM 5
 
+//transport state saved in a snapshot, followed by the queues and dev cfg
+struct virtio_pci_state {
+    uint8_t cfg_space[PCI_CFG_SPACE_SIZE];
+    struct virtio_pci_common_cfg common_cfg;
+    struct virtio_pci_isr_cfg isr_cfg;
+    struct virtio_pci_notify_cfg notify_cfg;
+    uint64_t guest_feature;
+    uint32_t dev_cfg_len;
+};
+
+struct virtq_state {
+    struct virtq_info info;
+    uint16_t next_avail_idx;
+    uint16_t used_wrap_count;
+};
+
 #define container_of(ptr, type, member)               \
     ({                                                \
         void *__mptr = (void *) (ptr);                \
@@ -98,6 +115,9 @@ static void virtio_pci_cmd_select_virtq(struct virtio_pci_dev *dev)
 static void virtio_pci_cmd_enable_virtq(struct virtio_pci_dev *dev)
 {
     uint16_t select = dev->config.common_cfg.queue_select;
+
+    if (select >= dev->config.common_cfg.num_queues)
+        return;
     virtq_enable(&dev->vq[select]);
     virtio_pci_init_ioeventfd(dev, select);
 }
@@ -174,12 +194,15 @@ static void virtio_pci_iospace_handle_io(uint64_t offset,
 {
     struct virtio_pci_dev *virtio_pci_dev =
         container_of(owner, struct virtio_pci_dev, pci_dev);
+
+    pthread_mutex_lock(&virtio_pci_dev->lock);
     if (is_write) {
         virtio_pci_iospace_write(virtio_pci_dev, data, offset, size);
     }
     else {
         virtio_pci_iospace_read(virtio_pci_dev, data, offset, size);
     }
+    pthread_mutex_unlock(&virtio_pci_dev->lock);
 }
 
 static void virtio_pci_set_cap(struct virtio_pci_dev *dev, uint8_t next)
@@ -249,6 +272,7 @@ void virtio_pci_init(int vmfd,
 
     memset(dev, 0x00, sizeof(struct virtio_pci_dev));
     dev->vmfd = vmfd;
+    pthread_mutex_init(&dev->lock, NULL);
     pci_dev_init(&dev->pci_dev);
     PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_VENDOR_ID, VIRTIO_PCI_VENDOR_ID, 16);
     PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_CAPABILITY_LIST, cap_list, 8);
@@ -260,8 +284,83 @@ void virtio_pci_init(int vmfd,
     PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_INTERRUPT_LINE, irq_line, 8);
     pci_init_bar(&dev->pci_dev, 0, 0x100, PCI_BASE_ADDRESS_SPACE_MEMORY,
                 virtio_pci_iospace_handle_io);
+    //common cfg is always read back by the driver, notify must still exit
+    region_set_coalesced(&dev->pci_dev.bar_region[0],
+                         offsetof(struct virtio_pci_config, common_cfg),
+                         sizeof(struct virtio_pci_common_cfg));
     virtio_pci_set_cap(dev, cap_list);
     dev->device_feature |=
         (1ULL << VIRTIO_F_RING_PACKED) | (1ULL << VIRTIO_F_VERSION_1);
 }
 
+
+int virtio_pci_save(struct virtio_pci_dev *dev, FILE *fp)
+{
+    struct virtio_pci_state s;
+
+    memset(&s, 0, sizeof(s));
+    memcpy(s.cfg_space, dev->pci_dev.cfg_space, PCI_CFG_SPACE_SIZE);
+    s.common_cfg = dev->config.common_cfg;
+    s.isr_cfg = dev->config.isr_cfg;
+    s.notify_cfg = dev->config.notify_cfg;
+    s.guest_feature = dev->guest_feature;
+    s.dev_cfg_len = dev->dev_cfg_cap->length;
+    if (snapshot_write(fp, &s, sizeof(s)) < 0)
+        return -1;
+    for (int i = 0; i < dev->config.common_cfg.num_queues; i++) {
+        struct virtq_state vs = {
+            .info = dev->vq[i].info,
+            .next_avail_idx = dev->vq[i].next_avail_idx,
+            .used_wrap_count = dev->vq[i].used_wrap_count,
+        };
+        if (snapshot_write(fp, &vs, sizeof(vs)) < 0)
+            return -1;
+    }
+    return snapshot_write(fp, dev->config.dev_cfg, s.dev_cfg_len);
+}
+
+/*
+ * Live bars are mapped again and enabled queues get their rings and
+ * notify ioeventfds back, as if the guest had just set them up.
+ */
+int virtio_pci_load(struct virtio_pci_dev *dev, FILE *fp)
+{
+    struct virtio_pci_state s;
+    uint16_t num_queues = dev->config.common_cfg.num_queues;
+
+    if (snapshot_read(fp, &s, sizeof(s)) < 0 ||
+        s.common_cfg.num_queues != num_queues ||
+        s.dev_cfg_len != dev->dev_cfg_cap->length)
+        return -1;
+    pci_dev_restore(&dev->pci_dev, s.cfg_space);
+    dev->config.common_cfg = s.common_cfg;
+    dev->config.isr_cfg = s.isr_cfg;
+    dev->config.notify_cfg = s.notify_cfg;
+    dev->guest_feature = s.guest_feature;
+
+    for (int i = 0; i < num_queues; i++) {
+        struct virtq *vq = &dev->vq[i];
+        struct virtq_state vs;
+
+        if (snapshot_read(fp, &vs, sizeof(vs)) < 0)
+            return -1;
+        vq->info = vs.info;
+        vq->info.enable = 0;
+        vq->next_avail_idx = vs.next_avail_idx;
+        vq->used_wrap_count = vs.used_wrap_count;
+        if (!vs.info.enable)
+            continue;
+        virtq_enable(vq);
+        if (!vq->info.enable)
+            return -1;
+        virtio_pci_init_ioeventfd(dev, i);
+    }
+    return snapshot_read(fp, dev->config.dev_cfg, s.dev_cfg_len);
+}
+
+//a kick that was still in its eventfd when the snapshot was taken is lost
+void virtio_pci_notify_all(struct virtio_pci_dev *dev)
+{
+    for (int i = 0; i < dev->config.common_cfg.num_queues; i++)
+        virtq_notify(&dev->vq[i]);
+}
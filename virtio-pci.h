@@ -1,6 +1,8 @@
 #ifndef MICROV_VIRTIO_PCI_H
 #define MICROV_VIRTIO_PCI_H
 
+#include <stdio.h>
+#include <pthread.h>
 #include <linux/virtio_pci.h>
 
 #include "pci.h"
@@ -31,6 +33,8 @@ struct virtio_pci_dev {
     struct virtio_pci_notify_cap *notify_cap;
     struct virtio_pci_cap *dev_cfg_cap;
     struct virtq *vq;
+    //common and dev cfg, written by vcpus and the coalesced flush thread
+    pthread_mutex_t lock;
 };
 
 void virtio_pci_set_dev_cfg(struct virtio_pci_dev *virtio_pci_dev,
@@ -45,5 +49,8 @@ void virtio_pci_init(int vmfd,
                      uint16_t device_id,
                      uint32_t class, 
                      uint8_t irq_line);
+int virtio_pci_save(struct virtio_pci_dev *dev, FILE *fp);
+int virtio_pci_load(struct virtio_pci_dev *dev, FILE *fp);
+void virtio_pci_notify_all(struct virtio_pci_dev *dev);
 
 #endif /* MICROV_VIRTIO_PCI_H */
@@ -25,18 +25,23 @@ void virtq_init(struct virtq *vq, void *dev,
     vq->handle_output = handle_output;
 }
 
+//the rings must sit in guest ram, a queue pointing elsewhere stays disabled
 void virtq_enable(struct virtq *vq)
 {
     if (vq->info.enable)
         return;
-    vq->info.enable = true;
 
-    vq->desc_ring = (struct vring_packed_desc *) get_userspace_addr(
-        (uint64_t) vq->info.desc_addr);
-    vq->guest_event = (struct vring_packed_desc_event *) get_userspace_addr(
-        (uint64_t) vq->info.driver_addr); 
-    vq->device_event = (struct vring_packed_desc_event *) get_userspace_addr(
-        (uint64_t) vq->info.device_addr);
+    vq->desc_ring = get_userspace_ptr(vq->info.desc_addr,
+                                      vq->info.size * sizeof(struct vring_packed_desc));
+    vq->guest_event = get_userspace_ptr(vq->info.driver_addr,
+                                        sizeof(struct vring_packed_desc_event));
+    vq->device_event = get_userspace_ptr(vq->info.device_addr,
+                                         sizeof(struct vring_packed_desc_event));
+    if (!vq->desc_ring || !vq->guest_event || !vq->device_event) {
+        fprintf(stderr, "virtqueue rings outside guest ram\n");
+        return;
+    }
+    vq->info.enable = true;
 }
 
 bool virtq_check_next(struct vring_packed_desc *desc)